@@ -0,0 +1,124 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "util.hpp"
+#include "mapped_file.hpp"
+
+// Writes packed snapshots of an index while ingestion carries on. The
+// snapshot is written by a forked child process: the child sees the index
+// exactly as it was at the fork (a consistent view up to the last docid
+// indexed), and the kernel copies a page for the parent only when the
+// parent writes to it, which ingestion does to few pages
+// (the heads and tails of the lists, and the new blocks). So the parent
+// pays for the fork and some page copies, rather than for the dump.
+//
+// The child writes to a temporary file and renames it into place once it
+// is complete, so a reader never sees half a snapshot. run() hands other
+// jobs to a child in the same way (see segmented_index.hpp). Children are
+// used rather than threads for a further reason: once a process has
+// started a thread, the C and C++ runtimes take their thread-safe paths
+// (locked malloc, atomic reference counts) for good, and ingestion, which
+// allocates a string or two per posting, slows by more than half
+class background_snapshot {
+
+  public:
+    background_snapshot() : m_pid(-1), m_taken(0), m_failed(0), m_last_ok(true) {}
+
+    ~background_snapshot() {
+      wait();
+    }
+
+    background_snapshot(const background_snapshot&) = delete;
+    background_snapshot& operator=(const background_snapshot&) = delete;
+
+    // Starts a snapshot of the index as it is now. False if the last one
+    // is still being written (the caller can simply try again later) or
+    // if we can't fork. The caller mustn't have other threads running
+    template <typename Index>
+    bool start(Index& index, const std::string& filename, const size_t threads) {
+      return run([&]() { return write_packed(index, filename, threads); });
+    }
+
+    // Runs job() in a forked child the same way, for other work on a
+    // consistent view of the process (which job() returns true if it
+    // did); false if the last is still running or we can't fork
+    template <typename Job>
+    bool run(Job job) {
+      if (running()) {
+        return false;
+      }
+      pid_t pid = fork();
+      if (pid < 0) {
+        std::cerr << "__ERROR__: Could not fork to work in the background.\n";
+        return false;
+      }
+      if (pid == 0) {
+        // The child leaves without running any of the parent's destructors
+        // or flushing its buffers
+        _exit(job() ? EXIT_SUCCESS : EXIT_FAILURE);
+      }
+      m_pid = pid;
+      return true;
+    }
+
+    // Packs an index to a temporary file which is renamed into place once
+    // it is complete and on disk, so neither a reader nor a crash sees
+    // half of one
+    template <typename Index>
+    static bool write_packed(Index& index, const std::string& filename, const size_t threads) {
+      std::string partial = filename + ".partial";
+      return index.serialize_pack(partial, threads) && rename_synced(partial, filename);
+    }
+
+    // True while a snapshot is being written
+    bool running() {
+      if (m_pid < 0) {
+        return false;
+      }
+      int status = 0;
+      if (waitpid(m_pid, &status, WNOHANG) == 0) {
+        return true;
+      }
+      finish(status);
+      return false;
+    }
+
+    // Blocks until the snapshot being written (if any) is done. False if
+    // the last one failed
+    bool wait() {
+      if (m_pid >= 0) {
+        int status = 0;
+        waitpid(m_pid, &status, 0);
+        finish(status);
+      }
+      return m_last_ok;
+    }
+
+    // The number of snapshots which completed, and which failed
+    size_t taken() const {
+      return m_taken;
+    }
+
+    size_t failed() const {
+      return m_failed;
+    }
+
+  private:
+    void finish(const int status) {
+      m_last_ok = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+      if (m_last_ok) {
+        m_taken += 1;
+      } else {
+        m_failed += 1;
+      }
+      m_pid = -1;
+    }
+
+    pid_t m_pid;
+    size_t m_taken;
+    size_t m_failed;
+    bool m_last_ok;
+};
@@ -0,0 +1,236 @@
+#pragma once
+
+#include "util.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_index_blocks.hpp"
+#else
+#include "index_blocks.hpp"
+#endif
+
+// Marks the layout record, which follows the document lengths in an index
+// file; indexes from before it was kept simply end without one
+const uint32_t LAYOUT_MAGIC = 0x544f594c; // "LYOT"
+
+// How the chains of an index grow: the number of blocks in each slab of a
+// chain, by the slab's place in the chain (the head is the first). With
+// variable blocks this is a table of MAX_SLAB_IDX + 1 sizes, the last of
+// which repeats, chosen when the index is made and recorded in its file,
+// so one binary can build and read every scheme: fixed (one block at a
+// time), exponential or triangular growth, or a table of our own. With
+// fixed blocks, the only layout is fixed.
+//
+// The record also says whether the postings hold positions (written by
+// insert_positions), which only the positional cursor can read.
+//
+// A slab is addressed through a 16-bit byte offset in the head, which
+// limits slabs to MAX_LAYOUT_SLAB_BLOCKS
+class block_layout {
+
+  public:
+#ifdef VARIABLE_BLOCK
+    static const size_t MAX_LAYOUT_SLAB_BLOCKS = std::numeric_limits<uint16_t>::max() / BLOCK_SIZE;
+#else
+    static const size_t MAX_LAYOUT_SLAB_BLOCKS = 1;
+#endif
+
+    // The layout an index gets unless told otherwise
+    block_layout() {
+#ifdef VARIABLE_BLOCK
+      *this = triangle();
+#else
+      *this = fixed();
+#endif
+    }
+
+    // One block per slab
+    static block_layout fixed() {
+      return block_layout("fixed", std::vector<uint32_t>(1, 1));
+    }
+
+#ifdef VARIABLE_BLOCK
+    // Each slab adds (base - 1) of what the chain holds so far
+    static block_layout expon(const double expon_base = 1.1) {
+      size_t cumulative_bytes = TT_BYTES;
+      std::vector<uint32_t> sizes(1, 1);
+      for (size_t i = 0; i < MAX_SLAB_IDX; ++i) {
+        // We're assuming n blocks minus the header bytes of payload
+        double next = (double(TT_PL_OFFSET) + (expon_base - 1) * cumulative_bytes) / BLOCK_SIZE;
+        size_t this_size = next + 0.9999;
+        cumulative_bytes += (this_size * BLOCK_SIZE) - TT_PL_OFFSET;
+        // We'll overflow in the t_ptr, stick with the last one
+        if (this_size > MAX_LAYOUT_SLAB_BLOCKS) {
+          this_size = sizes.back();
+        }
+        sizes.push_back(this_size);
+      }
+      return block_layout("expon", sizes);
+    }
+
+    // Each slab is about the square root of twice what the chain holds
+    static block_layout triangle() {
+      size_t cumulative_bytes = TT_BYTES;
+      std::vector<uint32_t> sizes(1, 1);
+      for (size_t i = 0; i < MAX_SLAB_IDX; ++i) {
+        double next = (double(TT_PL_OFFSET) + std::sqrt(2.0f * TT_PL_OFFSET * cumulative_bytes)) / BLOCK_SIZE;
+        size_t this_size = next + 0.9999;
+        cumulative_bytes += (this_size * BLOCK_SIZE) - TT_PL_OFFSET;
+        if (this_size > MAX_LAYOUT_SLAB_BLOCKS) {
+          this_size = sizes.back();
+        }
+        sizes.push_back(this_size);
+      }
+      return block_layout("triangle", sizes);
+    }
+#endif
+
+    // Reads a layout given on the command line: fixed, expon, triangle, or
+    // a comma-separated table of slab sizes such as 1,2,4,8. False (with
+    // a message) if it can't be had with this build
+    static bool parse(const std::string& spec, block_layout& layout) {
+      if (spec == "fixed") {
+        layout = fixed();
+        return true;
+      }
+#ifdef VARIABLE_BLOCK
+      if (spec == "expon") {
+        layout = expon();
+        return true;
+      }
+      if (spec == "triangle") {
+        layout = triangle();
+        return true;
+      }
+      std::vector<uint32_t> sizes;
+      std::istringstream in(spec);
+      std::string size;
+      while (std::getline(in, size, ',')) {
+        char* end = nullptr;
+        unsigned long blocks = std::strtoul(size.c_str(), &end, 10);
+        if (size.empty() || *end != '\0' || blocks == 0 || blocks > MAX_LAYOUT_SLAB_BLOCKS ||
+            sizes.size() > MAX_SLAB_IDX) {
+          std::cerr << "Bad layout: " << spec << " (slabs are 1 to " << MAX_LAYOUT_SLAB_BLOCKS << " blocks, "
+                    << MAX_SLAB_IDX + 1 << " at most)\n";
+          return false;
+        }
+        sizes.push_back(blocks);
+      }
+      if (sizes.empty()) {
+        std::cerr << "Bad layout: " << spec << "\n";
+        return false;
+      }
+      layout = block_layout(spec, sizes);
+      return true;
+#else
+      std::cerr << "Unknown layout: " << spec << " (growing slabs need variable blocks: use the bin/v_ binaries)\n";
+      return false;
+#endif
+    }
+
+    // The blocks in the slab at this place in a chain; with variable
+    // blocks, for any place up to MAX_SLAB_IDX
+    uint32_t slab_blocks(const size_t position) const {
+      return m_slab_size[position];
+    }
+
+    const std::string& name() const {
+      return m_name;
+    }
+
+    bool variable_blocks() const {
+      return m_variable_blocks;
+    }
+
+    bool positions() const {
+      return m_positions;
+    }
+
+    void set_positions(const bool positions) {
+      m_positions = positions;
+    }
+
+    // False (with a message) unless the postings hold positions just when
+    // the reader wants them
+    bool expect_positions(const bool positions) const {
+      if (m_positions && !positions) {
+        std::cerr << "__ERROR__: The index holds positions, which only phrase_query can read.\n";
+        return false;
+      }
+      if (!m_positions && positions) {
+        std::cerr << "__ERROR__: The index holds no positions; build it with stream_index -p.\n";
+        return false;
+      }
+      return true;
+    }
+
+    // Writes the layout record
+    void serialize(std::ostream& out) const {
+      uint32_t variable = m_variable_blocks;
+      uint32_t positions = m_positions;
+      uint32_t name_bytes = m_name.size();
+      uint32_t slabs = m_slab_size.size();
+      out.write(reinterpret_cast<const char *>(&LAYOUT_MAGIC), sizeof(uint32_t));
+      out.write(reinterpret_cast<const char *>(&variable), sizeof(uint32_t));
+      out.write(reinterpret_cast<const char *>(&positions), sizeof(uint32_t));
+      out.write(reinterpret_cast<const char *>(&name_bytes), sizeof(uint32_t));
+      out.write(m_name.data(), name_bytes);
+      out.write(reinterpret_cast<const char *>(&slabs), sizeof(uint32_t));
+      out.write(reinterpret_cast<const char *>(m_slab_size.data()), sizeof(uint32_t) * slabs);
+    }
+
+    // Reads the layout record, leaving the default in place if there is
+    // none. False (with a message) if the index was built with the other
+    // kind of blocks, which this build can't read
+    bool load(std::istream& in) {
+      uint32_t magic = 0;
+      if (in.peek() == EOF || !in.read(reinterpret_cast<char *>(&magic), sizeof(uint32_t)) ||
+          magic != LAYOUT_MAGIC) {
+        *this = block_layout();
+        return true;
+      }
+      uint32_t variable = 0;
+      uint32_t positions = 0;
+      uint32_t name_bytes = 0;
+      uint32_t slabs = 0;
+      in.read(reinterpret_cast<char *>(&variable), sizeof(uint32_t));
+      in.read(reinterpret_cast<char *>(&positions), sizeof(uint32_t));
+      in.read(reinterpret_cast<char *>(&name_bytes), sizeof(uint32_t));
+      std::string name(name_bytes, '\0');
+      in.read(&name[0], name_bytes);
+      in.read(reinterpret_cast<char *>(&slabs), sizeof(uint32_t));
+      std::vector<uint32_t> sizes(std::min(slabs, uint32_t(MAX_SLAB_SIZES)));
+      in.read(reinterpret_cast<char *>(sizes.data()), sizeof(uint32_t) * sizes.size());
+      if (!in || sizes.empty() || bool(variable) != block_layout().m_variable_blocks) {
+        std::cerr << "__ERROR__: The index was built with " << (variable ? "variable" : "fixed")
+                  << " blocks, which this build can't read; use the " << (variable ? "bin/v_" : "plain")
+                  << " binaries.\n";
+        return false;
+      }
+      *this = block_layout(name, sizes);
+      m_positions = positions;
+      return true;
+    }
+
+  private:
+#ifdef VARIABLE_BLOCK
+    static const size_t MAX_SLAB_SIZES = MAX_SLAB_IDX + 1;
+#else
+    static const size_t MAX_SLAB_SIZES = 1;
+#endif
+
+    // Pads the sizes out to a full table by repeating the last
+    block_layout(const std::string& name, std::vector<uint32_t> sizes) : m_name(name), m_positions(false) {
+#ifdef VARIABLE_BLOCK
+      m_variable_blocks = true;
+#else
+      m_variable_blocks = false;
+#endif
+      sizes.resize(MAX_SLAB_SIZES, sizes.back());
+      m_slab_size = sizes;
+    }
+
+    std::string m_name;
+    bool m_variable_blocks;
+    bool m_positions;
+    std::vector<uint32_t> m_slab_size;
+};
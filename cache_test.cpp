@@ -0,0 +1,130 @@
+#include "util.hpp"
+#include "query.hpp"
+#include "query_processing.hpp"
+#include "ranking.hpp"
+#include "result_cache.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#include "variable_postings_cursor.hpp"
+#else
+#include "immediate_index.hpp"
+#include "postings_cursor.hpp"
+#endif
+
+// Checks the result cache as the index grows between lookups: counts are
+// patched up by evaluating the new docids alone, and must always equal a
+// fresh count; ranked results are patched up until the index has grown by
+// more than max_growth, and recomputed from scratch after that.
+//
+// Every document matching the query holds both terms equally often, so
+// the order of the matches doesn't depend on the idf weights, and a
+// patched top-k must rank the same documents as a fresh one
+
+const size_t K = 3;
+
+size_t failures = 0;
+
+void report(const std::string& name, const bool ok) {
+  std::cout << name << ": " << (ok ? "ok" : "FAILED") << "\n";
+  if (!ok) {
+    failures += 1;
+  }
+}
+
+void add_document(immediate_index& index, const uint32_t docid, const uint32_t freq) {
+  if (freq > 0) {
+    index.insert(docid, "a", freq);
+    index.insert(docid, "b", freq);
+  } else {
+    index.insert(docid, docid % 2 == 0 ? "a" : "c", 1);
+  }
+  index.add_document(docid, freq > 0 ? 2 * freq : 1);
+}
+
+size_t fresh_count(immediate_index& index, const query& in_query) {
+  auto cursors = query_to_cursors(index, in_query);
+  return adaptive_conjunction(cursors, index.num_docs());
+}
+
+std::vector<topk_queue::entry_type> fresh_topk(immediate_index& index, const query& in_query) {
+  tfidf_ranker tfidf(index.num_docs());
+  topk_queue results(K);
+  auto cursors = query_to_cursors(index, in_query);
+  ranked_conjunction(cursors, tfidf, results);
+  return results.topk();
+}
+
+std::vector<uint32_t> docids(const std::vector<topk_queue::entry_type>& results) {
+  std::vector<uint32_t> ids;
+  for (const auto& result : results) {
+    ids.push_back(result.second);
+  }
+  return ids;
+}
+
+int main() {
+
+  immediate_index index(1024, 1024);
+  // Keyed by the terms alone, so Boolean and ranked results each have
+  // their own cache, as they do in the query binaries
+  result_cache counts(8, 0.5);
+  result_cache ranked(8, 0.5);
+  std::vector<std::string> terms = {"b", "a"};
+  const query in_query("0", terms);
+  topk_queue heap(K);
+
+  auto count = [&]() {
+    return counts.count(in_query, index.doc_lengths().last_docid(), [&](const docid_range& range) {
+      auto cursors = query_to_cursors(index, in_query);
+      if (range.m_begin == 0) {
+        return adaptive_conjunction(cursors, index.num_docs());
+      }
+      return boolean_conjunction(cursors, range);
+    });
+  };
+  auto topk = [&]() {
+    tfidf_ranker tfidf(index.num_docs());
+    ranked.topk(in_query, index.doc_lengths().last_docid(), heap, [&](topk_queue& results, const docid_range& range) {
+      auto cursors = query_to_cursors(index, in_query);
+      ranked_conjunction(cursors, tfidf, results, range);
+    });
+    return heap.topk();
+  };
+
+  // Every fourth of the first 20 documents matches, each more often
+  for (uint32_t docid = 1; docid <= 20; ++docid) {
+    add_document(index, docid, docid % 4 == 0 ? docid / 4 : 0);
+  }
+  report("count, miss", count() == fresh_count(index, in_query) && counts.misses() == 1);
+  report("top-k, miss", topk() == fresh_topk(index, in_query) && ranked.misses() == 1);
+  report("count, hit", count() == fresh_count(index, in_query) && counts.hits() == 1);
+
+  // Grown by 25%, within max_growth: both are patched up
+  for (uint32_t docid = 21; docid <= 25; ++docid) {
+    add_document(index, docid, docid == 22 ? 10 : docid == 24 ? 1 : 0);
+  }
+  report("count, partial hit", count() == fresh_count(index, in_query) && counts.partial_hits() == 1);
+  report("top-k, partial hit", docids(topk()) == docids(fresh_topk(index, in_query)) &&
+                               heap.topk().front().second == 22 && ranked.partial_hits() == 1);
+  report("top-k, hit", docids(topk()) == docids(fresh_topk(index, in_query)) && ranked.hits() == 1);
+
+  // Grown by 100% since the top-k was computed in full: it is recomputed,
+  // while the count is still patched up
+  for (uint32_t docid = 26; docid <= 40; ++docid) {
+    add_document(index, docid, docid == 30 ? 7 : 0);
+  }
+  report("top-k, too stale", topk() == fresh_topk(index, in_query) && ranked.misses() == 2);
+  report("count, partial hit after growth", count() == fresh_count(index, in_query) && counts.partial_hits() == 2);
+
+  // Recomputed in full, so the growth is measured afresh from here
+  add_document(index, 41, 8);
+  report("top-k, partial hit after recompute", docids(topk()) == docids(fresh_topk(index, in_query)) &&
+                                               ranked.partial_hits() == 2);
+
+  if (failures > 0) {
+    std::cerr << "Error: " << failures << " checks failed\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
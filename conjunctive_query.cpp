@@ -1,6 +1,10 @@
 #include "util.hpp"
 #include "query.hpp"
 #include "query_processing.hpp"
+#include "parallel_query.hpp"
+#include "result_cache.hpp"
+#include "intersection_cache.hpp"
+#include "segmented_query.hpp"
 
 #ifdef VARIABLE_BLOCK
 #include "variable_immediate_index.hpp"
@@ -13,8 +17,8 @@
 
 int main(int argc, const char **argv) {
 
-  if (argc != 3 && argc != 4) {
-    std::cerr << "Usage: " << argv[0] << " <index> <query_file> [-v(v)]\n"; 
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <index> <query_file> [-v(v)] [-r <n> [-d <min_docid>]] [-k <k> [-s tfidf|bm25]] [-t <threads> | -i <threads>] [-c <entries>] [-x <KiB>] [-m [-P <query_log>]] [-g]\n"; 
     return -1;
   }
 
@@ -23,19 +27,135 @@ int main(int argc, const char **argv) {
 
   bool verbose = false;
   bool very_verbose = false;
-  if (argc == 4) { 
-    if (std::string(argv[3]) == "-v")
+  size_t recent_n = 0;   // If set, return the n most recent matches only
+  uint32_t min_docid = 0; // ... and stop once we are older than this
+  size_t k = 0;           // If set, rank the matches and return the top-k
+  std::string scorer = "tfidf";
+  size_t threads = 0;     // If set, run the queries concurrently on this many threads
+  size_t intra_threads = 0; // If set, split each query over this many threads
+  size_t cache_entries = 0; // If set, cache this many results
+  size_t pair_cache_kib = 0; // If set, cache frequent pairwise intersections in this much space
+  bool map_index = false;   // If set, map the index rather than reading it in
+  std::string prefault_log; // ... and fault in the lists of the terms of this query log
+  bool segmented = false;   // If set, the index is the manifest of a segmented index
+  for (int i = 3; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-v")
       verbose = true;
-    else if (std::string(argv[3]) == "-vv")
+    else if (arg == "-vv")
       very_verbose = true;
+    else if (arg == "-r" && i + 1 < argc)
+      recent_n = std::atol(argv[++i]);
+    else if (arg == "-d" && i + 1 < argc)
+      min_docid = std::atol(argv[++i]);
+    else if (arg == "-k" && i + 1 < argc)
+      k = std::atol(argv[++i]);
+    else if (arg == "-s" && i + 1 < argc)
+      scorer = argv[++i];
+    else if (arg == "-t" && i + 1 < argc)
+      threads = std::atol(argv[++i]);
+    else if (arg == "-i" && i + 1 < argc)
+      intra_threads = std::atol(argv[++i]);
+    else if (arg == "-c" && i + 1 < argc)
+      cache_entries = std::atol(argv[++i]);
+    else if (arg == "-x" && i + 1 < argc)
+      pair_cache_kib = std::atol(argv[++i]);
+    else if (arg == "-m")
+      map_index = true;
+    else if (arg == "-P" && i + 1 < argc)
+      prefault_log = argv[++i];
+    else if (arg == "-g")
+      segmented = true;
     else 
-      std::cerr << "Ignoring unknown argument: " << argv[3] << "\n";
+      std::cerr << "Ignoring unknown argument: " << arg << "\n";
+  }
+  if (recent_n > 0) {
+    std::cerr << "Recency-first: " << recent_n << " most recent matches, min docid = " << min_docid << "\n";
+  }
+  if (k > 0) {
+    if (scorer != "tfidf" && scorer != "bm25") {
+      std::cerr << "Unknown ranker: " << scorer << "\n";
+      return -1;
+    }
+    std::cerr << "Ranked conjunction: top-" << k << " with " << scorer << "\n";
+  }
+  if (threads > 0 && very_verbose) {
+    std::cerr << "Profiling runs on one thread, ignoring -t\n";
+    threads = 0;
+  }
+  if (threads > 0) {
+    std::cerr << "Throughput mode: " << threads << " threads\n";
+  }
+  if (intra_threads > 0) {
+    if (threads > 0 || very_verbose || recent_n > 0) {
+      std::cerr << "Intra-query parallelism can't be combined with -t, -vv or -r\n";
+      return -1;
+    }
+    std::cerr << "Intra-query parallelism: " << intra_threads << " threads\n";
+  }
+  if (cache_entries > 0) {
+    if (threads > 0 || intra_threads > 0 || very_verbose || recent_n > 0) {
+      std::cerr << "The result cache can't be combined with -t, -i, -vv or -r\n";
+      return -1;
+    }
+    std::cerr << "Result cache: " << cache_entries << " entries\n";
+  }
+  if (pair_cache_kib > 0) {
+    if (threads > 0 || intra_threads > 0 || very_verbose || recent_n > 0) {
+      std::cerr << "The intersection cache can't be combined with -t, -i, -vv or -r\n";
+      return -1;
+    }
+    std::cerr << "Intersection cache: " << pair_cache_kib << " KiB\n";
+  }
+  if (segmented) {
+    if (very_verbose || recent_n > 0 || intra_threads > 0 || cache_entries > 0 || pair_cache_kib > 0 || map_index) {
+      std::cerr << "A segmented index (-g) can't be combined with -vv, -r, -i, -c, -x or -m\n";
+      return -1;
+    }
+    std::cerr << "Segmented index: mapping the segments in the manifest\n";
+  }
+  if (!prefault_log.empty() && !map_index) {
+    std::cerr << "Prefaulting (-P) is for mapped indexes (-m)\n";
+    return -1;
+  }
+  if (map_index) {
+    std::cerr << "Mapping the index read-only\n";
   }
   std::cerr << "Reading the index...\n";
-  std::ifstream in_idx(argv[1], std::ios::binary);
- 
+  double load_start = get_time_usecs();
   immediate_index my_idx;
-  my_idx.load(in_idx);
+  segmented_index segments;
+  if (segmented) {
+    if (!segments.open(argv[1])) {
+      return -1;
+    }
+  } else if (map_index) {
+    if (!my_idx.map(argv[1])) {
+      return -1;
+    }
+  } else {
+    std::ifstream in_idx(argv[1], std::ios::binary);
+    if (!my_idx.load(in_idx)) {
+      return -1;
+    }
+  }
+  if (!segmented && !my_idx.layout().expect_positions(false)) {
+    return -1;
+  }
+  std::cerr << "Index ready in " << (get_time_usecs() - load_start) / 1000 << " ms\n";
+  if (!prefault_log.empty()) {
+    double prefault_start = get_time_usecs();
+    std::ifstream in_log(prefault_log);
+    auto hot_terms = query_log_terms(in_log);
+    size_t touched = my_idx.prefault(hot_terms);
+    std::cerr << "Prefaulted " << touched << " blocks of " << hot_terms.size() << " terms in "
+              << (get_time_usecs() - prefault_start) / 1000 << " ms\n";
+  }
+  const document_lengths& lengths = segmented ? segments.doc_lengths() : my_idx.doc_lengths();
+  if (k > 0 && lengths.num_docs() == 0) {
+    std::cerr << "The index has no document statistics; rebuild it to rank.\n";
+    return -1;
+  }
 
   std::cerr << "Reading the query file...\n";
   std::ifstream in_q(argv[2]);
@@ -44,29 +164,162 @@ int main(int argc, const char **argv) {
   std::vector<double> query_times;
   std::vector<size_t> match_counts;
 
-  for (size_t i = 0; i < queries.size(); ++i) {
+  // Ranking structures
+  tfidf_ranker tfidf(lengths.num_docs());
+  std::unique_ptr<bm25_ranker> bm25;
+  if (k > 0 && scorer == "bm25") {
+    bm25 = std::make_unique<bm25_ranker>(lengths);
+  }
+
+  // With -i, each query is split into docid ranges over this pool
+  std::unique_ptr<thread_pool> intra_pool;
+  if (intra_threads > 0) {
+    intra_pool = std::make_unique<thread_pool>(intra_threads);
+  }
 
-    if (very_verbose) {
+  // With -c, results are cached; the index is loaded once, so its
+  // watermark doesn't move here
+  result_cache cache(cache_entries);
+  const uint32_t watermark = my_idx.doc_lengths().last_docid();
+
+  // With -x, frequent term pairs are materialised, and stand in for two of
+  // the lists of any query containing them
+  intersection_cache pair_cache(pair_cache_kib * 1024);
+  auto evaluate_count = [&](const query& in_query, const docid_range& range) {
+    auto cursors = query_to_cursors(my_idx, in_query);
+    if (pair_cache_kib > 0 && range.m_begin == 0) {
+      size_t first = 0;
+      size_t second = 0;
+      const cached_pair* pair = pair_cache.lookup(my_idx, cursors, watermark, first, second);
+      if (pair != nullptr) {
+        return pair_conjunction(*pair, cursors, first, second);
+      }
+    }
+    if (range.m_begin == 0) {
+      return adaptive_conjunction(cursors, my_idx.num_docs());
+    }
+    return boolean_conjunction(cursors, range);
+  };
+  auto evaluate_ranked = [&](const query& in_query, topk_queue& results, const docid_range& range) {
+    auto cursors = query_to_cursors(my_idx, in_query);
+    if (pair_cache_kib > 0 && range.m_begin == 0) {
+      size_t first = 0;
+      size_t second = 0;
+      const cached_pair* pair = pair_cache.lookup(my_idx, cursors, watermark, first, second);
+      if (pair != nullptr) {
+        if (bm25) {
+          return ranked_pair_conjunction(*pair, cursors, first, second, *bm25, results);
+        }
+        return ranked_pair_conjunction(*pair, cursors, first, second, tfidf, results);
+      }
+    }
+    if (bm25) {
+      return ranked_conjunction(cursors, *bm25, results, range);
+    }
+    return ranked_conjunction(cursors, tfidf, results, range);
+  };
+
+  // Runs a query using the given scratch space, returning the match count.
+  // The index and rankers are only read, so this is safe to run on many
+  // threads at once as long as each has its own heap and buffer
+  auto run_query = [&](const query& in_query, topk_queue& heap, std::vector<uint32_t>& recent_matches) {
+    size_t result_count = 0;
+    if (recent_n > 0) {
+      auto cursors = query_to_reverse_cursors(my_idx, in_query);
+      result_count = recent_conjunction(cursors, recent_n, min_docid, recent_matches);
+    } else if (segmented && k > 0) {
+      heap.clear();
+      result_count = segmented_ranked(segments, in_query, true, heap,
+        [&](std::vector<postings_cursor>& cursors, topk_queue& results, const docid_range& range) {
+          if (bm25) {
+            ranked_conjunction(cursors, *bm25, results, range);
+          } else {
+            ranked_conjunction(cursors, tfidf, results, range);
+          }
+        });
+    } else if (segmented) {
+      result_count = segmented_boolean(segments, in_query, true, [&](std::vector<postings_cursor>& cursors) {
+        return adaptive_conjunction(cursors, lengths.num_docs());
+      });
+    } else if (k > 0 && cache_entries > 0) {
+      result_count = cache.topk(in_query, watermark, heap, [&](topk_queue& results, const docid_range& range) {
+        evaluate_ranked(in_query, results, range);
+      });
+    } else if (k > 0 && intra_pool) {
+      heap.clear();
+      auto cursors = query_to_cursors(my_idx, in_query);
+      result_count = range_parallel_ranked(cursors, my_idx.num_docs(), *intra_pool, heap,
+        [&](std::vector<postings_cursor>& range_cursors, topk_queue& range_heap, const docid_range& range) {
+          if (bm25) {
+            ranked_conjunction(range_cursors, *bm25, range_heap, range);
+          } else {
+            ranked_conjunction(range_cursors, tfidf, range_heap, range);
+          }
+        });
+    } else if (k > 0) {
+      heap.clear();
+      result_count = evaluate_ranked(in_query, heap, docid_range());
+    } else if (cache_entries > 0) {
+      result_count = cache.count(in_query, watermark, [&](const docid_range& range) {
+        return evaluate_count(in_query, range);
+      });
+    } else if (intra_pool) {
+      auto cursors = query_to_cursors(my_idx, in_query);
+      result_count = range_parallel_conjunction(cursors, my_idx.num_docs(), *intra_pool);
+    } else {
+      result_count = evaluate_count(in_query, docid_range());
+    }
+    do_not_optimize_away(result_count);
+    return result_count;
+  };
+
+  // Filled in by whichever thread runs each query
+  std::vector<double> latencies(queries.size(), 0);
+  std::vector<size_t> results(queries.size(), 0);
+
+  double wall_start = get_time_usecs();
+  if (very_verbose) {
+    for (size_t i = 0; i < queries.size(); ++i) {
       auto cursors = query_to_cursors(my_idx, queries[i]);
       //size_t result_count = boolean_conjunction_joel(cursors);
-      size_t result_count = profile_boolean_conjunction(cursors);
+      size_t result_count = adaptive_conjunction(cursors, my_idx.num_docs(), true);
       if (result_count > 0) {
         match_counts.push_back(result_count);
       }
       do_not_optimize_away(result_count);
-    } else {
+    }
+  } else if (threads > 0) {
+    thread_pool pool(threads);
+    std::vector<topk_queue> heaps(pool.size(), topk_queue(std::max(k, size_t(1))));
+    std::vector<std::vector<uint32_t>> recent_matches(pool.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+      pool.submit([&, i](size_t worker) {
+        double start = get_time_usecs();
+        results[i] = run_query(queries[i], heaps[worker], recent_matches[worker]);
+        latencies[i] = get_time_usecs() - start;
+      });
+    }
+    pool.wait();
+  } else {
+    topk_queue heap(std::max(k, size_t(1)));
+    std::vector<uint32_t> recent_matches;
+    for (size_t i = 0; i < queries.size(); ++i) {
       double start = get_time_usecs();
-      auto cursors = query_to_cursors(my_idx, queries[i]);
-      size_t result_count = boolean_conjunction(cursors);
-      do_not_optimize_away(result_count);
-      double stop = get_time_usecs() - start;
+      results[i] = run_query(queries[i], heap, recent_matches);
+      latencies[i] = get_time_usecs() - start;
+    }
+  }
+  double wall_time = get_time_usecs() - wall_start;
+
+  if (!very_verbose) {
+    for (size_t i = 0; i < queries.size(); ++i) {
       // XXX We're only counting queries with matches
-      if (result_count > 0) {
+      if (results[i] > 0) {
         if (verbose) {
-          std::cout << queries[i].m_id << " latency=" << stop << " matches=" << result_count << "\n";
+          std::cout << queries[i].m_id << " latency=" << latencies[i] << " matches=" << results[i] << "\n";
         }
-        query_times.push_back(stop);
-        match_counts.push_back(result_count);
+        query_times.push_back(latencies[i]);
+        match_counts.push_back(results[i]);
       }
     }
   }
@@ -86,7 +339,23 @@ int main(int argc, const char **argv) {
               << " p90: " << p90 
               << " p95: " << p95
               << " p99: " << p99 << "\n";
+    std::cerr << "Throughput -> QPS: " << queries.size() / (wall_time / 1000000)
+              << " (" << queries.size() << " queries in " << wall_time / 1000 << " ms on "
+              << std::max(threads, size_t(1)) << " thread" << (threads > 1 ? "s" : "") << ")\n";
+    if (intra_pool) {
+      std::cerr << "(each query split over " << intra_pool->size() << " threads)\n";
+    }
+  }
+
+  if (cache_entries > 0) {
+    std::cerr << "Cache -> hits: " << cache.hits() << " partial hits: " << cache.partial_hits()
+              << " misses: " << cache.misses() << "\n";
+  }
 
+  if (pair_cache_kib > 0) {
+    std::cerr << "Intersection cache -> hits: " << pair_cache.hits() << " misses: " << pair_cache.misses()
+              << " admissions: " << pair_cache.admissions() << " evictions: " << pair_cache.evictions()
+              << " bytes: " << pair_cache.bytes() << "\n";
   }
 
   std::sort(match_counts.begin(), match_counts.end());
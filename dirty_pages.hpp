@@ -0,0 +1,122 @@
+#pragma once
+
+#include "util.hpp"
+
+// Tracks which pages of an array have been written to since it was last
+// saved, for incremental checkpoints. Writers mark the bytes they change;
+// a bitmap keeps each page from being listed twice, and the list of dirty
+// pages means that saving them (and then forgetting them) takes time in
+// the number of dirty pages, not the size of the array.
+//
+// The pages needn't be those of the OS. The index changes in scattered
+// places (every list which takes a posting changes its head block), so it
+// tracks pages as small as a block, and consecutive dirty pages (the new
+// blocks, mostly) are written together as runs
+class dirty_pages {
+
+  public:
+    explicit dirty_pages(const size_t page_shift) : m_shift(page_shift) {}
+
+    size_t page_bytes() const {
+      return size_t(1) << m_shift;
+    }
+
+    // Tracks an array of this many bytes, all clean
+    void resize(const size_t bytes) {
+      size_t pages = (bytes + page_bytes() - 1) >> m_shift;
+      m_bits.assign((pages + 63) / 64, 0);
+      m_dirty.clear();
+    }
+
+    // Notes that [offset, offset + bytes) has changed
+    void mark(const size_t offset, const size_t bytes) {
+      if (bytes == 0) {
+        return;
+      }
+      size_t last = (offset + bytes - 1) >> m_shift;
+      for (size_t page = offset >> m_shift; page <= last; ++page) {
+        uint64_t bit = uint64_t(1) << (page & 63);
+        if ((m_bits[page >> 6] & bit) == 0) {
+          m_bits[page >> 6] |= bit;
+          m_dirty.push_back(page);
+        }
+      }
+    }
+
+    // The number of dirty pages
+    size_t size() const {
+      return m_dirty.size();
+    }
+
+    // Marks every page clean again
+    void clear() {
+      for (auto page : m_dirty) {
+        m_bits[page >> 6] = 0;
+      }
+      m_dirty.clear();
+    }
+
+    // Writes the dirty pages of the array as runs of consecutive pages,
+    // each as its first page, its length in pages and then its contents
+    // (the last page of the array may be short), and then marks them
+    // clean. Returns the number of pages written
+    size_t write(std::ostream& out, const void* data, const size_t bytes) {
+      std::sort(m_dirty.begin(), m_dirty.end());
+      // Pages past the end of the array (which may have shrunk) hold nothing
+      size_t end_page = (bytes + page_bytes() - 1) >> m_shift;
+      size_t count = std::lower_bound(m_dirty.begin(), m_dirty.end(), end_page) - m_dirty.begin();
+      std::vector<std::pair<size_t, size_t>> runs;
+      for (size_t i = 0; i < count; ++i) {
+        if (!runs.empty() && runs.back().first + runs.back().second == m_dirty[i]) {
+          runs.back().second += 1;
+        } else {
+          runs.emplace_back(m_dirty[i], 1);
+        }
+      }
+      size_t num_runs = runs.size();
+      out.write(reinterpret_cast<const char *>(&m_shift), sizeof(size_t));
+      out.write(reinterpret_cast<const char *>(&num_runs), sizeof(size_t));
+      for (const auto& run : runs) {
+        size_t offset = run.first << m_shift;
+        out.write(reinterpret_cast<const char *>(&run.first), sizeof(size_t));
+        out.write(reinterpret_cast<const char *>(&run.second), sizeof(size_t));
+        out.write(reinterpret_cast<const char *>(data) + offset, std::min(run.second << m_shift, bytes - offset));
+      }
+      clear();
+      return count;
+    }
+
+    // Copies pages written by write() back into an array of this many
+    // bytes. With no array, just checks that the pages are all there
+    static bool read(std::istream& in, void* data, const size_t bytes) {
+      size_t shift = 0;
+      size_t num_runs = 0;
+      in.read(reinterpret_cast<char *>(&shift), sizeof(size_t));
+      in.read(reinterpret_cast<char *>(&num_runs), sizeof(size_t));
+      for (size_t i = 0; i < num_runs && in; ++i) {
+        size_t first = 0;
+        size_t pages = 0;
+        in.read(reinterpret_cast<char *>(&first), sizeof(size_t));
+        in.read(reinterpret_cast<char *>(&pages), sizeof(size_t));
+        size_t offset = first << shift;
+        if (offset >= bytes) {
+          return false;
+        }
+        size_t run_bytes = std::min(pages << shift, bytes - offset);
+        if (data == nullptr) {
+          in.ignore(run_bytes);
+          if (in.gcount() != std::streamsize(run_bytes)) {
+            return false;
+          }
+        } else {
+          in.read(reinterpret_cast<char *>(data) + offset, run_bytes);
+        }
+      }
+      return bool(in);
+    }
+
+  private:
+    size_t m_shift;
+    std::vector<uint64_t> m_bits;
+    std::vector<size_t> m_dirty;
+};
@@ -10,35 +10,165 @@
 
 #include "query.hpp"
 #include "query_processing.hpp"
+#include "parallel_query.hpp"
+#include "result_cache.hpp"
+#include "segmented_query.hpp"
 
 int main(int argc, const char **argv) {
 
-  if (argc != 5 && argc != 6) {
-    std::cerr << "Usage: " << argv[0] << " <index> <query_file> <k> <num_docs_in_index> [-v]\n"; 
+  if (argc < 4) {
+    std::cerr << "Usage: " << argv[0] << " <index> <query_file> <k> [-v] [-s tfidf|bm25] [-N <num_docs>] [-a exhaustive|maxscore|bmw|boolean] [-e] [-r [-d <min_docid>]] [-t <threads> | -i <threads>] [-c <entries>] [-m [-P <query_log>]] [-g]\n"; 
     return -1;
   }
 
   bool verbose = false;
-  if (argc == 6) { 
-    if (std::string(argv[5]) == "-v")
+  std::string scorer = "tfidf";
+  size_t num_docs = 0;    // If set, the collection size for tf-idf, for an index without document statistics
+  std::string algorithm = "exhaustive";
+  bool recent = false;    // If set, return the k most recent matches rather than the top-k
+  uint32_t min_docid = 0; // ... and stop once we are older than this
+  size_t threads = 0;     // If set, run the queries concurrently on this many threads
+  size_t intra_threads = 0; // If set, split each query over this many threads
+  size_t cache_entries = 0; // If set, cache this many results
+  bool prime = false;     // If set, start each heap from an estimated threshold
+  bool map_index = false; // If set, map the index rather than reading it in
+  std::string prefault_log; // ... and fault in the lists of the terms of this query log
+  bool segmented = false; // If set, the index is the manifest of a segmented index
+  for (int i = 4; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-v")
       verbose = true;
+    else if (arg == "-s" && i + 1 < argc)
+      scorer = argv[++i];
+    else if (arg == "-N" && i + 1 < argc)
+      num_docs = std::atol(argv[++i]);
+    else if (arg == "-a" && i + 1 < argc)
+      algorithm = argv[++i];
+    else if (arg == "-r")
+      recent = true;
+    else if (arg == "-d" && i + 1 < argc)
+      min_docid = std::atol(argv[++i]);
+    else if (arg == "-t" && i + 1 < argc)
+      threads = std::atol(argv[++i]);
+    else if (arg == "-i" && i + 1 < argc)
+      intra_threads = std::atol(argv[++i]);
+    else if (arg == "-c" && i + 1 < argc)
+      cache_entries = std::atol(argv[++i]);
+    else if (arg == "-e")
+      prime = true;
+    else if (arg == "-m")
+      map_index = true;
+    else if (arg == "-P" && i + 1 < argc)
+      prefault_log = argv[++i];
+    else if (arg == "-g")
+      segmented = true;
     else 
-      std::cerr << "Ignoring unknown argument: " << argv[5] << "\n";
+      std::cerr << "Ignoring unknown argument: " << arg << "\n";
   }
  
 
   std::cerr << "Index File: " << argv[1] << "\n";
   std::cerr << "Query File: " << argv[2] << "\n";
   size_t k = std::atol(argv[3]);
-  size_t num_docs = std::atol(argv[4]);
   std::cerr << "k = " << k << "\n";
-  std::cerr << "N = " << num_docs << "\n";
+  if (scorer != "tfidf" && scorer != "bm25") {
+    std::cerr << "Unknown ranker: " << scorer << "\n";
+    return -1;
+  }
+  std::cerr << "Ranker: " << scorer << "\n";
+  if (algorithm != "exhaustive" && algorithm != "maxscore" && algorithm != "bmw" && algorithm != "boolean") {
+    std::cerr << "Unknown algorithm: " << algorithm << "\n";
+    return -1;
+  }
+  std::cerr << "Algorithm: " << algorithm << "\n";
+  if (prime) {
+    std::cerr << "Priming the heap with an estimated threshold\n";
+  }
+  if (algorithm == "boolean" && (recent || intra_threads > 0 || cache_entries > 0)) {
+    std::cerr << "Boolean disjunctions can't be combined with -r, -i or -c\n";
+    return -1;
+  }
+  if (recent) {
+    std::cerr << "Recency-first: " << k << " most recent matches, min docid = " << min_docid << "\n";
+  }
+  if (threads > 0) {
+    std::cerr << "Throughput mode: " << threads << " threads\n";
+  }
+  if (intra_threads > 0) {
+    if (threads > 0 || recent) {
+      std::cerr << "Intra-query parallelism can't be combined with -t or -r\n";
+      return -1;
+    }
+    std::cerr << "Intra-query parallelism: " << intra_threads << " threads\n";
+  }
+  if (cache_entries > 0) {
+    if (threads > 0 || intra_threads > 0 || recent) {
+      std::cerr << "The result cache can't be combined with -t, -i or -r\n";
+      return -1;
+    }
+    std::cerr << "Result cache: " << cache_entries << " entries\n";
+  }
 
+  if (segmented) {
+    if (recent || intra_threads > 0 || cache_entries > 0 || prime || map_index) {
+      std::cerr << "A segmented index (-g) can't be combined with -r, -i, -c, -e or -m\n";
+      return -1;
+    }
+    std::cerr << "Segmented index: mapping the segments in the manifest\n";
+  }
+  if (!prefault_log.empty() && !map_index) {
+    std::cerr << "Prefaulting (-P) is for mapped indexes (-m)\n";
+    return -1;
+  }
+  if (map_index) {
+    std::cerr << "Mapping the index read-only\n";
+  }
   std::cerr << "Reading the index...\n";
-  std::ifstream in_idx(argv[1], std::ios::binary);
- 
+  double load_start = get_time_usecs();
   immediate_index my_idx;
-  my_idx.load(in_idx);
+  segmented_index segments;
+  if (segmented) {
+    if (!segments.open(argv[1])) {
+      return -1;
+    }
+  } else if (map_index) {
+    if (!my_idx.map(argv[1])) {
+      return -1;
+    }
+  } else {
+    std::ifstream in_idx(argv[1], std::ios::binary);
+    if (!my_idx.load(in_idx)) {
+      return -1;
+    }
+  }
+  if (!segmented && !my_idx.layout().expect_positions(false)) {
+    return -1;
+  }
+  std::cerr << "Index ready in " << (get_time_usecs() - load_start) / 1000 << " ms\n";
+  if (!prefault_log.empty()) {
+    double prefault_start = get_time_usecs();
+    std::ifstream in_log(prefault_log);
+    auto hot_terms = query_log_terms(in_log);
+    size_t touched = my_idx.prefault(hot_terms);
+    std::cerr << "Prefaulted " << touched << " blocks of " << hot_terms.size() << " terms in "
+              << (get_time_usecs() - prefault_start) / 1000 << " ms\n";
+  }
+  const document_lengths& lengths = segmented ? segments.doc_lengths() : my_idx.doc_lengths();
+  if (num_docs == 0) {
+    num_docs = lengths.num_docs();
+  }
+  std::cerr << "N = " << num_docs << "\n";
+  // Only ranking needs the statistics: BM25 needs the length of every
+  // document, tf-idf just their number
+  bool ranking = !recent && algorithm != "boolean";
+  if (ranking && scorer == "bm25" && lengths.num_docs() == 0) {
+    std::cerr << "The index has no document lengths; rebuild it to rank with BM25.\n";
+    return -1;
+  }
+  if (ranking && num_docs == 0) {
+    std::cerr << "The index has no document statistics; give -N <num_docs> or rebuild it to rank.\n";
+    return -1;
+  }
 
   std::cerr << "Reading the query file...\n";
   std::ifstream in_q(argv[2]);
@@ -47,26 +177,134 @@ int main(int argc, const char **argv) {
   std::vector<double> query_times;
 
   // Ranking structures
-  topk_queue heap(k);
-  tfidf_ranker ranker(num_docs); 
+  tfidf_ranker tfidf(num_docs); 
+  std::unique_ptr<bm25_ranker> bm25;
+  if (scorer == "bm25") {
+    bm25 = std::make_unique<bm25_ranker>(lengths);
+  }
 
-  // For each query
-  for (size_t i = 0; i < queries.size(); ++i) {
-   
+  auto ranked_query = [&](auto& ranker, std::vector<postings_cursor>& cursors, topk_queue& heap,
+                          const docid_range& range) {
+    if (algorithm == "maxscore") {
+      return maxscore_disjunction(cursors, ranker, heap, range);
+    } else if (algorithm == "bmw") {
+      return block_max_wand(cursors, ranker, heap, range);
+    }
+    return ranked_disjunction(cursors, ranker, heap, range);
+  };
+
+  // With -i, each query is split into docid ranges over this pool
+  std::unique_ptr<thread_pool> intra_pool;
+  if (intra_threads > 0) {
+    intra_pool = std::make_unique<thread_pool>(intra_threads);
+  }
+  auto split_query = [&](auto& ranker, std::vector<postings_cursor>& cursors, topk_queue& heap) {
+    return range_parallel_ranked(cursors, num_docs, *intra_pool, heap,
+      [&](std::vector<postings_cursor>& range_cursors, topk_queue& range_heap, const docid_range& range) {
+        ranked_query(ranker, range_cursors, range_heap, range);
+      });
+  };
+
+  // With -c, results are cached; the index is loaded once, so its
+  // watermark doesn't move here
+  result_cache cache(cache_entries);
+  const uint32_t watermark = my_idx.doc_lengths().last_docid();
+
+  // Runs a query using the given scratch space, returning the match count.
+  // The index and rankers are only read, so this is safe to run on many
+  // threads at once as long as each has its own heap and buffer
+  auto run_query = [&](const query& in_query, topk_queue& heap, std::vector<uint32_t>& recent_matches) {
     // Clear the heap from the last query 
     heap.clear();
-
-    double start = get_time_usecs();
-    auto cursors = query_to_cursors(my_idx, queries[i]);
-    size_t result_count = ranked_disjunction(cursors, ranker, heap);
+    size_t result_count = 0;
+    if (recent) {
+      auto cursors = query_to_reverse_cursors(my_idx, in_query);
+      result_count = recent_disjunction(cursors, k, min_docid, recent_matches);
+    } else if (segmented && algorithm == "boolean") {
+      result_count = segmented_boolean(segments, in_query, false, [&](std::vector<postings_cursor>& cursors) {
+        return boolean_disjunction(cursors, lengths.num_docs());
+      });
+    } else if (segmented) {
+      result_count = segmented_ranked(segments, in_query, false, heap,
+        [&](std::vector<postings_cursor>& cursors, topk_queue& results, const docid_range& range) {
+          if (bm25) {
+            ranked_query(*bm25, cursors, results, range);
+          } else {
+            ranked_query(tfidf, cursors, results, range);
+          }
+        });
+    } else if (algorithm == "boolean") {
+      auto cursors = query_to_cursors(my_idx, in_query);
+      result_count = boolean_disjunction(cursors, my_idx.num_docs());
+    } else if (cache_entries > 0) {
+      result_count = cache.topk(in_query, watermark, heap, [&](topk_queue& results, const docid_range& range) {
+        auto cursors = query_to_cursors(my_idx, in_query);
+        // Only a miss runs the whole query; a partial hit resumes from the
+        // cached results, which already set the threshold
+        if (prime && range.m_begin == 0) {
+          float estimate = bm25 ? estimate_threshold(cursors, *bm25, k) : estimate_threshold(cursors, tfidf, k);
+          results.clear(std::nextafter(estimate, 0.0f));
+        }
+        if (bm25) {
+          ranked_query(*bm25, cursors, results, range);
+        } else {
+          ranked_query(tfidf, cursors, results, range);
+        }
+      });
+    } else {
+      auto cursors = query_to_cursors(my_idx, in_query);
+      if (prime) {
+        float estimate = bm25 ? estimate_threshold(cursors, *bm25, k) : estimate_threshold(cursors, tfidf, k);
+        heap.clear(std::nextafter(estimate, 0.0f));
+      }
+      if (intra_pool && bm25) {
+        result_count = split_query(*bm25, cursors, heap);
+      } else if (intra_pool) {
+        result_count = split_query(tfidf, cursors, heap);
+      } else if (bm25) {
+        result_count = ranked_query(*bm25, cursors, heap, docid_range());
+      } else {
+        result_count = ranked_query(tfidf, cursors, heap, docid_range());
+      }
+    }
     do_not_optimize_away(result_count);
-    double stop = get_time_usecs() - start;
+    return result_count;
+  };
 
-    if (result_count > 0) {
-        query_times.push_back(stop);
+  // Filled in by whichever thread runs each query
+  std::vector<double> latencies(queries.size(), 0);
+  std::vector<size_t> results(queries.size(), 0);
+
+  double wall_start = get_time_usecs();
+  if (threads > 0) {
+    thread_pool pool(threads);
+    std::vector<topk_queue> heaps(pool.size(), topk_queue(k));
+    std::vector<std::vector<uint32_t>> recent_matches(pool.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+      pool.submit([&, i](size_t worker) {
+        double start = get_time_usecs();
+        results[i] = run_query(queries[i], heaps[worker], recent_matches[worker]);
+        latencies[i] = get_time_usecs() - start;
+      });
+    }
+    pool.wait();
+  } else {
+    topk_queue heap(k);
+    std::vector<uint32_t> recent_matches;
+    for (size_t i = 0; i < queries.size(); ++i) {
+      double start = get_time_usecs();
+      results[i] = run_query(queries[i], heap, recent_matches);
+      latencies[i] = get_time_usecs() - start;
+    }
+  }
+  double wall_time = get_time_usecs() - wall_start;
+
+  for (size_t i = 0; i < queries.size(); ++i) {
+    if (results[i] > 0) {
+        query_times.push_back(latencies[i]);
 
         if (verbose) {
-          std::cout << queries[i].m_id << " latency=" << stop << " matches=" << result_count << "\n";
+          std::cout << queries[i].m_id << " latency=" << latencies[i] << " matches=" << results[i] << "\n";
         }
     }
   }
@@ -85,6 +323,16 @@ int main(int argc, const char **argv) {
             << " p90: " << p90 
             << " p95: " << p95
             << " p99: " << p99 << "\n";
+  std::cerr << "Throughput -> QPS: " << queries.size() / (wall_time / 1000000)
+            << " (" << queries.size() << " queries in " << wall_time / 1000 << " ms on "
+            << std::max(threads, size_t(1)) << " thread" << (threads > 1 ? "s" : "") << ")\n";
+  if (cache_entries > 0) {
+    std::cerr << "Cache -> hits: " << cache.hits() << " partial hits: " << cache.partial_hits()
+              << " misses: " << cache.misses() << "\n";
+  }
+  if (intra_pool) {
+    std::cerr << "(each query split over " << intra_pool->size() << " threads)\n";
+  }
 
   return 0;
 }
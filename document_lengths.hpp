@@ -0,0 +1,130 @@
+#pragma once
+
+#include "util.hpp"
+
+// A compact array of document lengths, plus the collection statistics
+// which go with it. Documents arrive in docid order, so the lengths are
+// simply appended; the first docid is kept so that an index which does
+// not begin at docid 1 doesn't need to store a run of empty entries
+class document_lengths {
+
+  public:
+    document_lengths() : m_first_docid(0), m_total_length(0) {}
+
+    // Records the length of the next document
+    void add(const uint32_t docid, const uint32_t length) {
+      if (m_lengths.empty()) {
+        m_first_docid = docid;
+      }
+      // Any skipped docids are treated as empty documents
+      while (m_first_docid + m_lengths.size() < docid) {
+        m_lengths.push_back(0);
+      }
+      m_lengths.push_back(length);
+      m_total_length += length;
+    }
+
+    uint32_t length(const uint32_t docid) const {
+      return m_lengths[docid - m_first_docid];
+    }
+
+    // The number of documents we have seen
+    size_t num_docs() const {
+      return m_lengths.size();
+    }
+
+    uint32_t first_docid() const {
+      return m_first_docid;
+    }
+
+    // The last docid which has a length, or 0 if we have none
+    uint32_t last_docid() const {
+      if (m_lengths.empty()) {
+        return 0;
+      }
+      return m_first_docid + m_lengths.size() - 1;
+    }
+
+    // The total number of words in the collection
+    uint64_t total_length() const {
+      return m_total_length;
+    }
+
+    double average_length() const {
+      if (m_lengths.empty()) {
+        return 0;
+      }
+      return double(m_total_length) / m_lengths.size();
+    }
+
+    // Writes to disk
+    void serialize(std::ostream& out) {
+      size_t num_docs = m_lengths.size();
+      out.write(reinterpret_cast<char *>(&m_first_docid), sizeof(uint32_t));
+      out.write(reinterpret_cast<char *>(&m_total_length), sizeof(uint64_t));
+      out.write(reinterpret_cast<char *>(&num_docs), sizeof(size_t));
+      out.write(reinterpret_cast<char *>(m_lengths.data()), sizeof(uint32_t) * num_docs);
+    }
+
+    // Read back into memory; indexes written before lengths were kept
+    // simply end here, which leaves us empty
+    void load(std::ifstream& in) {
+      size_t num_docs = 0;
+      m_first_docid = 0;
+      m_total_length = 0;
+      m_lengths.clear();
+      if (in.peek() == EOF) {
+        return;
+      }
+      in.read(reinterpret_cast<char *>(&m_first_docid), sizeof(uint32_t));
+      in.read(reinterpret_cast<char *>(&m_total_length), sizeof(uint64_t));
+      in.read(reinterpret_cast<char *>(&num_docs), sizeof(size_t));
+      m_lengths.resize(num_docs);
+      in.read(reinterpret_cast<char *>(m_lengths.data()), sizeof(uint32_t) * num_docs);
+    }
+
+    // Writes the lengths of the documents after the first `from`, which a
+    // reader already has; for incremental checkpoints
+    void serialize_since(std::ostream& out, const size_t from) const {
+      size_t start = std::min(from, m_lengths.size());
+      size_t added = m_lengths.size() - start;
+      out.write(reinterpret_cast<const char *>(&m_first_docid), sizeof(uint32_t));
+      out.write(reinterpret_cast<const char *>(&added), sizeof(size_t));
+      out.write(reinterpret_cast<const char *>(m_lengths.data() + start), sizeof(uint32_t) * added);
+    }
+
+    // Appends the lengths written by serialize_since. False, leaving the
+    // lengths as they were, if they were cut short; without append, just
+    // checks that they are all there
+    bool load_since(std::istream& in, const bool append = true) {
+      uint32_t first_docid = 0;
+      size_t added = 0;
+      in.read(reinterpret_cast<char *>(&first_docid), sizeof(uint32_t));
+      in.read(reinterpret_cast<char *>(&added), sizeof(size_t));
+      if (!in || added > size_t(std::numeric_limits<std::streamsize>::max()) / sizeof(uint32_t)) {
+        return false;
+      }
+      if (!append) {
+        in.ignore(sizeof(uint32_t) * added);
+        return in.gcount() == std::streamsize(sizeof(uint32_t) * added);
+      }
+      std::vector<uint32_t> lengths(added);
+      in.read(reinterpret_cast<char *>(lengths.data()), sizeof(uint32_t) * added);
+      if (!in) {
+        return false;
+      }
+      if (m_lengths.empty()) {
+        m_first_docid = first_docid;
+      }
+      for (auto length : lengths) {
+        m_lengths.push_back(length);
+        m_total_length += length;
+      }
+      return true;
+    }
+
+  private:
+    uint32_t m_first_docid;
+    uint64_t m_total_length;
+    std::vector<uint32_t> m_lengths;
+};
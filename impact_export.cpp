@@ -0,0 +1,76 @@
+#include "util.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#else
+#include "immediate_index.hpp"
+#endif
+
+#include "ranking.hpp"
+#include "impact_index.hpp"
+
+int main(int argc, const char **argv) {
+
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <index> <output_file> [-s tfidf|bm25] [-b <bits>]\n";
+    return -1;
+  }
+
+  std::string scorer = "tfidf";
+  uint32_t bits = 8;
+  for (int i = 3; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-s" && i + 1 < argc)
+      scorer = argv[++i];
+    else if (arg == "-b" && i + 1 < argc)
+      bits = std::atol(argv[++i]);
+    else
+      std::cerr << "Ignoring unknown argument: " << arg << "\n";
+  }
+
+  if (scorer != "tfidf" && scorer != "bm25") {
+    std::cerr << "Unknown ranker: " << scorer << "\n";
+    return -1;
+  }
+  // Accumulators are 16 bits, so keep enough headroom for long queries
+  if (bits < 1 || bits > 8) {
+    std::cerr << "Impacts must be between 1 and 8 bits\n";
+    return -1;
+  }
+
+  std::cerr << "Index File: " << argv[1] << "\n";
+  std::cerr << "Output File: " << argv[2] << "\n";
+  std::cerr << "Ranker: " << scorer << "\n";
+  std::cerr << "Impact bits: " << bits << "\n";
+
+  std::cerr << "Reading the index...\n";
+  std::ifstream in_idx(argv[1], std::ios::binary);
+  immediate_index my_idx;
+  if (!my_idx.load(in_idx) || !my_idx.layout().expect_positions(false)) {
+    return -1;
+  }
+  std::cerr << "N = " << my_idx.num_docs() << "\n";
+  if (my_idx.num_docs() == 0) {
+    std::cerr << "The index has no document statistics; rebuild it to rank.\n";
+    return -1;
+  }
+
+  std::cerr << "Building the impact-ordered index...\n";
+  double start = get_time_usecs();
+  impact_index impacts;
+  if (scorer == "bm25") {
+    bm25_ranker ranker(my_idx.doc_lengths());
+    impacts.build(my_idx, ranker, bits);
+  } else {
+    tfidf_ranker ranker(my_idx.num_docs());
+    impacts.build(my_idx, ranker, bits);
+  }
+  double stop = get_time_usecs() - start;
+  std::cerr << "Built in " << stop / 1000000 << " seconds.\n";
+
+  std::cerr << "Writing to " << argv[2] << "\n";
+  std::ofstream out_idx(argv[2], std::ios::binary);
+  impacts.serialize(out_idx);
+
+  return 0;
+}
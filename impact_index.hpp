@@ -0,0 +1,293 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "util.hpp"
+#include "compress.hpp"
+#include "query.hpp"
+#include "ranking.hpp"
+#include "topk_queue.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#include "variable_postings_cursor.hpp"
+#else
+#include "immediate_index.hpp"
+#include "postings_cursor.hpp"
+#endif
+
+// A run of postings from one list which all share the same impact
+struct impact_segment {
+  uint32_t m_impact;   // the quantized score of every posting in the segment
+  uint32_t m_count;    // number of postings
+  uint64_t m_offset;   // byte offset of the vbyte d-gaps in the postings array
+};
+
+// Where a term's segments live
+struct impact_term {
+  uint32_t m_first_segment;
+  uint32_t m_segments;
+};
+
+// An impact-ordered index for score-at-a-time (SAAT) query processing,
+// in the style of JASS. Every posting of a frozen immediate_index is scored
+// and the score quantized into [1, 2^bits - 1]; each list is then stored as
+// a sequence of segments in decreasing impact order, and within a segment
+// the docids are increasing and d-gap/vbyte coded. Unlike the immediate
+// index this is static, and is built from a serialized index
+class impact_index {
+
+  public:
+    impact_index() : m_max_docid(0), m_bits(0), m_scale(0) {}
+
+    // Scores every posting with the given ranker and builds the segments
+    template <typename Ranker>
+    void build(immediate_index& index, Ranker& ranker, const uint32_t bits = 8) {
+      m_bits = bits;
+      m_max_docid = 0;
+      m_lexicon.clear();
+      m_segments.clear();
+      m_postings.clear();
+      auto terms = index.vocabulary();
+      std::sort(terms.begin(), terms.end());
+
+      // (1) A first pass finds the largest score so we can quantize
+      float max_score = 0;
+      for (const auto& term : terms) {
+        postings_cursor cursor(index, term);
+        float idf = ranker.idf_weight(cursor.doc_freq());
+        while (cursor.docid() != END_CHAIN) {
+          max_score = std::max(max_score, ranker.doc_term_weight(cursor.docid(), cursor.freq()) * idf);
+          m_max_docid = std::max(m_max_docid, cursor.docid());
+          cursor.next();
+        }
+      }
+      const uint32_t max_impact = (1 << m_bits) - 1;
+      m_scale = max_impact / max_score;
+
+      // (2) Then each list is bucketed by impact and written out from the
+      // highest impact down
+      std::vector<std::vector<uint32_t>> buckets(max_impact + 1);
+      uint8_t buffer[8];
+      for (const auto& term : terms) {
+        postings_cursor cursor(index, term);
+        float idf = ranker.idf_weight(cursor.doc_freq());
+        while (cursor.docid() != END_CHAIN) {
+          buckets[quantize(ranker.doc_term_weight(cursor.docid(), cursor.freq()) * idf)].push_back(cursor.docid());
+          cursor.next();
+        }
+        impact_term entry{static_cast<uint32_t>(m_segments.size()), 0};
+        for (uint32_t impact = max_impact; impact > 0; --impact) {
+          auto& docids = buckets[impact];
+          if (docids.empty()) {
+            continue;
+          }
+          m_segments.push_back({impact, static_cast<uint32_t>(docids.size()), m_postings.size()});
+          uint32_t prev_docid = 0;
+          for (auto docid : docids) {
+            size_t bytes = vbyte_encode(docid - prev_docid, buffer);
+            m_postings.insert(m_postings.end(), buffer, buffer + bytes);
+            prev_docid = docid;
+          }
+          entry.m_segments += 1;
+          docids.clear();
+        }
+        m_lexicon[term] = entry;
+      }
+    }
+
+    // Maps a score onto [1, 2^bits - 1]
+    uint32_t quantize(const float score) const {
+      uint32_t impact = std::lround(score * m_scale);
+      return std::max(impact, uint32_t(1));
+    }
+
+    // Writes to disk
+    void serialize(std::ofstream& out) {
+      // (1) Write the quantization parameters and the largest docid
+      out.write(reinterpret_cast<char *>(&m_max_docid), sizeof(uint32_t));
+      out.write(reinterpret_cast<char *>(&m_bits), sizeof(uint32_t));
+      out.write(reinterpret_cast<char *>(&m_scale), sizeof(float));
+      // (2) Write the lexicon
+      size_t terms = m_lexicon.size();
+      out.write(reinterpret_cast<char *>(&terms), sizeof(size_t));
+      for (auto& entry : m_lexicon) {
+        uint8_t word_length = entry.first.size();
+        out.write(reinterpret_cast<char *>(&word_length), sizeof(uint8_t));
+        out.write(entry.first.data(), word_length);
+        out.write(reinterpret_cast<char *>(&entry.second), sizeof(impact_term));
+      }
+      // (3) Write the segments
+      size_t segments = m_segments.size();
+      out.write(reinterpret_cast<char *>(&segments), sizeof(size_t));
+      out.write(reinterpret_cast<char *>(m_segments.data()), sizeof(impact_segment) * segments);
+      // (4) Write the postings
+      size_t bytes = m_postings.size();
+      out.write(reinterpret_cast<char *>(&bytes), sizeof(size_t));
+      out.write(reinterpret_cast<char *>(m_postings.data()), bytes);
+    }
+
+    // Read back into memory
+    void load(std::ifstream& in) {
+      // (1) Read the quantization parameters and the largest docid
+      in.read(reinterpret_cast<char *>(&m_max_docid), sizeof(uint32_t));
+      in.read(reinterpret_cast<char *>(&m_bits), sizeof(uint32_t));
+      in.read(reinterpret_cast<char *>(&m_scale), sizeof(float));
+      // (2) Read the lexicon
+      size_t terms = 0;
+      in.read(reinterpret_cast<char *>(&terms), sizeof(size_t));
+      m_lexicon.clear();
+      m_lexicon.reserve(terms);
+      for (size_t i = 0; i < terms; ++i) {
+        uint8_t word_length = 0;
+        in.read(reinterpret_cast<char *>(&word_length), sizeof(uint8_t));
+        std::string term(word_length, '\0');
+        in.read(&term[0], word_length);
+        impact_term entry;
+        in.read(reinterpret_cast<char *>(&entry), sizeof(impact_term));
+        m_lexicon[term] = entry;
+      }
+      // (3) Read the segments
+      size_t segments = 0;
+      in.read(reinterpret_cast<char *>(&segments), sizeof(size_t));
+      m_segments.resize(segments);
+      in.read(reinterpret_cast<char *>(m_segments.data()), sizeof(impact_segment) * segments);
+      // (4) Read the postings
+      size_t bytes = 0;
+      in.read(reinterpret_cast<char *>(&bytes), sizeof(size_t));
+      m_postings.resize(bytes);
+      in.read(reinterpret_cast<char *>(m_postings.data()), bytes);
+    }
+
+    // Appends the segments of a term to the given vector
+    void term_segments(const std::string& term, std::vector<impact_segment>& segments) const {
+      auto it = m_lexicon.find(term);
+      if (it == m_lexicon.end()) {
+        std::cerr << "Warning: Could not find term [" << term << "]\n";
+        return;
+      }
+      for (uint32_t i = 0; i < it->second.m_segments; ++i) {
+        segments.push_back(m_segments[it->second.m_first_segment + i]);
+      }
+    }
+
+    // Pointer to the start of a segment's d-gaps
+    const uint8_t* segment_data(const impact_segment& segment) const {
+      return m_postings.data() + segment.m_offset;
+    }
+
+    uint32_t max_docid() const {
+      return m_max_docid;
+    }
+
+    // Converts an accumulated impact back into (approximately) a score
+    float to_score(const uint32_t impact) const {
+      return impact / m_scale;
+    }
+
+  private:
+    uint32_t m_max_docid;
+    uint32_t m_bits;
+    float m_scale;
+    std::unordered_map<std::string, impact_term> m_lexicon;
+    std::vector<impact_segment> m_segments;
+    std::vector<uint8_t> m_postings;
+};
+
+// The accumulators for score-at-a-time processing: one 16-bit counter per
+// document in a flat array, which is friendly to vectorized scanning. So
+// that we don't need to clear the whole array for every query, it is split
+// into pages which are zeroed lazily the first time they are touched
+class saat_accumulators {
+
+  public:
+    static const size_t PAGE_BITS = 12;
+    static const size_t PAGE_SIZE = 1 << PAGE_BITS;
+
+    explicit saat_accumulators(const uint32_t max_docid) {
+      size_t pages = (max_docid >> PAGE_BITS) + 1;
+      m_scores.resize(pages * PAGE_SIZE);
+      m_dirty.resize(pages, 0);
+    }
+
+    // Adds an impact to a document
+    void add(const uint32_t docid, const uint16_t impact) {
+      size_t page = docid >> PAGE_BITS;
+      if (!m_dirty[page]) {
+        std::fill(m_scores.begin() + (page << PAGE_BITS), m_scores.begin() + ((page + 1) << PAGE_BITS), 0);
+        m_dirty[page] = 1;
+      }
+      m_scores[docid] += impact;
+    }
+
+    // Pushes the top-k documents into the heap, then resets for the next query
+    template <typename Converter>
+    void extract(topk_queue& results, Converter to_score) {
+      const size_t CHUNK = 16;
+      float chunk_scores[CHUNK];
+      uint32_t chunk_docids[CHUNK];
+      for (size_t page = 0; page < m_dirty.size(); ++page) {
+        if (!m_dirty[page]) {
+          continue;
+        }
+        m_dirty[page] = 0;
+        const uint16_t* scores = m_scores.data() + (page << PAGE_BITS);
+        for (size_t chunk = 0; chunk < PAGE_SIZE; chunk += CHUNK) {
+          // Skip any chunk which can't enter the heap; this loop vectorizes
+          uint16_t chunk_max = 0;
+          for (size_t i = 0; i < CHUNK; ++i) {
+            chunk_max = std::max(chunk_max, scores[chunk + i]);
+          }
+          if (chunk_max == 0 || !results.would_enter(to_score(chunk_max))) {
+            continue;
+          }
+          // Unscored documents convert to 0, which never enters the heap
+          for (size_t i = 0; i < CHUNK; ++i) {
+            chunk_scores[i] = to_score(scores[chunk + i]);
+            chunk_docids[i] = (page << PAGE_BITS) + chunk + i;
+          }
+          results.insert(chunk_scores, chunk_docids, CHUNK);
+        }
+      }
+    }
+
+  private:
+    std::vector<uint16_t> m_scores;
+    std::vector<uint8_t> m_dirty;
+};
+
+// Score-at-a-time query processing: the segments of every query term are
+// processed from the highest impact down, until either everything has been
+// processed, or the postings budget (the anytime cutoff) is spent. Returns
+// the number of postings processed
+size_t score_at_a_time(const impact_index& index, const query& in_query, saat_accumulators& accumulators,
+                       topk_queue& results, const size_t postings_budget = std::numeric_limits<size_t>::max()) {
+
+  std::vector<impact_segment> segments;
+  for (const auto& term : in_query.m_terms) {
+    index.term_segments(term, segments);
+  }
+  std::sort(segments.begin(), segments.end(), [](const impact_segment& l, const impact_segment& r) {
+    return l.m_impact > r.m_impact;
+  });
+
+  size_t processed = 0;
+  for (const auto& segment : segments) {
+    size_t count = std::min(size_t(segment.m_count), postings_budget - processed);
+    uint8_t* data = const_cast<uint8_t*>(index.segment_data(segment));
+    size_t offset = 0;
+    uint32_t docid = 0;
+    for (size_t i = 0; i < count; ++i) {
+      docid += vbyte_decode(data + offset, offset);
+      accumulators.add(docid, segment.m_impact);
+    }
+    processed += count;
+    if (processed == postings_budget) {
+      break;
+    }
+  }
+
+  accumulators.extract(results, [&index](uint32_t impact) { return index.to_score(impact); });
+  results.finalize();
+  return processed;
+}
@@ -60,6 +60,7 @@ int main(int argc, const char **argv) {
         my_idx.insert(i+1, doc.m_terms[j]);
       }
     }
+    my_idx.add_document(i+1, doc.length());
   }
   auto time_micro = (get_time_usecs() - start);
   std::cerr << "Added " << collection.size() << " documents in " 
@@ -71,7 +72,7 @@ int main(int argc, const char **argv) {
   std::cerr << "Serializing index...\n";
   start = get_time_usecs();
   my_idx.serialize(out_idx);
-  //my_idx.serialize_pack(out_idx); 
+  //my_idx.serialize_pack(argv[2]); 
   time_micro = (get_time_usecs() - start);
   std::cerr << "Serialized Index in " << time_micro/1000 << " milliseconds [to SSD or spinning disk?]\n";
 
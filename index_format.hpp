@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string.h>
+
+#include "util.hpp"
+
+// Every index file starts with a magic number and the version of its
+// format, then the number of blocks in use and the size of the hash
+// table. An index whose blocks are laid out differently (such as one
+// written before the head blocks kept their maxima) is refused rather
+// than misread; bump the version whenever the blocks or the header change
+const uint32_t INDEX_MAGIC = 0x58444e49; // "INDX"
+const uint32_t INDEX_VERSION = 2; // 2: the layout record says if there are positions
+
+// The bytes before the hash table
+const size_t INDEX_HEADER_BYTES = 2 * sizeof(uint32_t) + 2 * sizeof(size_t);
+
+inline void write_index_header(std::ostream& out, const size_t blocks, const size_t ht_size) {
+  out.write(reinterpret_cast<const char *>(&INDEX_MAGIC), sizeof(uint32_t));
+  out.write(reinterpret_cast<const char *>(&INDEX_VERSION), sizeof(uint32_t));
+  out.write(reinterpret_cast<const char *>(&blocks), sizeof(size_t));
+  out.write(reinterpret_cast<const char *>(&ht_size), sizeof(size_t));
+}
+
+// Reads the header from the first INDEX_HEADER_BYTES of a file. False
+// (with a message) if it isn't an index this build can read
+inline bool parse_index_header(const uint8_t* bytes, size_t& blocks, size_t& ht_size) {
+  uint32_t magic = 0;
+  uint32_t version = 0;
+  memcpy(&magic, bytes, sizeof(uint32_t));
+  memcpy(&version, bytes + sizeof(uint32_t), sizeof(uint32_t));
+  if (magic != INDEX_MAGIC || version != INDEX_VERSION) {
+    std::cerr << "__ERROR__: Not an index of this format (version " << INDEX_VERSION
+              << "); indexes from older builds must be rebuilt.\n";
+    return false;
+  }
+  memcpy(&blocks, bytes + 2 * sizeof(uint32_t), sizeof(size_t));
+  memcpy(&ht_size, bytes + 2 * sizeof(uint32_t) + sizeof(size_t), sizeof(size_t));
+  return true;
+}
+
+inline bool read_index_header(std::istream& in, size_t& blocks, size_t& ht_size) {
+  uint8_t bytes[INDEX_HEADER_BYTES] = {};
+  in.read(reinterpret_cast<char *>(bytes), INDEX_HEADER_BYTES);
+  if (!in) {
+    std::cerr << "__ERROR__: Not an index: the header is cut short.\n";
+    return false;
+  }
+  return parse_index_header(bytes, blocks, ht_size);
+}
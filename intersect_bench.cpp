@@ -0,0 +1,134 @@
+#include <random>
+
+#include "util.hpp"
+#include "intersection_kernels.hpp"
+
+// Microbenchmarks for the intersection kernels: two random sorted lists
+// are intersected at a range of length ratios, and each kernel reports
+// the time per intersection and the number of matches (which must agree)
+
+// A sorted list of n unique docids drawn from [1, universe]
+std::vector<uint32_t> random_list(const size_t n, const uint32_t universe, std::mt19937& rng) {
+  std::uniform_int_distribution<uint32_t> dist(1, universe);
+  std::unordered_set<uint32_t> seen;
+  while (seen.size() < n) {
+    seen.insert(dist(rng));
+  }
+  std::vector<uint32_t> list(seen.begin(), seen.end());
+  std::sort(list.begin(), list.end());
+  return list;
+}
+
+template <typename Kernel>
+void run(const std::string& name, Kernel kernel, const size_t repeats, const size_t expected) {
+  size_t count = 0;
+  double start = get_time_usecs();
+  for (size_t r = 0; r < repeats; ++r) {
+    count = kernel();
+    do_not_optimize_away(count);
+  }
+  double stop = get_time_usecs() - start;
+  std::cout << "  " << name << ": " << 1000 * stop / repeats << " ns"
+            << (count == expected ? "" : "  MISMATCH") << "\n";
+  if (count != expected) {
+    std::cerr << "Error: " << name << " found " << count << " matches, expected " << expected << "\n";
+    exit(EXIT_FAILURE);
+  }
+}
+
+// The fused kernels must line the freqs up with the docids: each posting's
+// freq is derived from its docid (differently on each side), so a freq
+// gathered from the wrong lane can't pass for the right one
+typedef size_t (*fused_kernel)(const uint32_t*, const uint32_t*, const size_t, const uint32_t*, const uint32_t*,
+                               const size_t, uint32_t*, uint32_t*, uint32_t*);
+
+void check_fused(const std::string& name, fused_kernel kernel, const std::vector<uint32_t>& a,
+                 const std::vector<uint32_t>& fa, const std::vector<uint32_t>& b, const std::vector<uint32_t>& fb) {
+  std::vector<uint32_t> expected(a.size() + INTERSECT_PADDING);
+  size_t matches = intersect_scalar(a.data(), a.size(), b.data(), b.size(), expected.data());
+  std::vector<uint32_t> out(expected.size()), out_fa(out.size()), out_fb(out.size());
+  size_t fused = kernel(a.data(), fa.data(), a.size(), b.data(), fb.data(), b.size(),
+                        out.data(), out_fa.data(), out_fb.data());
+  bool ok = fused == matches;
+  for (size_t i = 0; ok && i < fused; ++i) {
+    ok = out[i] == expected[i] && out_fa[i] == expected[i] && out_fb[i] == 2 * expected[i] + 1;
+  }
+  if (!ok) {
+    std::cerr << "Error: " << name << " gathered the wrong docids or freqs\n";
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, const char **argv) {
+
+  size_t short_length = 256;
+  if (argc > 1) {
+    short_length = std::atol(argv[1]);
+  }
+  const size_t total_postings = 1 << 24;
+
+  std::mt19937 rng(1234);
+  for (size_t ratio = 1; ratio <= 1024; ratio *= 2) {
+    size_t long_length = short_length * ratio;
+    // Dense enough that a good fraction of the short list matches
+    uint32_t universe = long_length * 4;
+    auto a = random_list(short_length, universe, rng);
+    auto b = random_list(long_length, universe, rng);
+    std::vector<uint32_t> fa(a), fb(b.size());
+    for (size_t i = 0; i < b.size(); ++i) {
+      fb[i] = 2 * b[i] + 1;
+    }
+    std::vector<uint32_t> out(short_length + INTERSECT_PADDING), out_fa(out.size()), out_fb(out.size());
+    size_t repeats = std::max(total_postings / (short_length + long_length), size_t(1));
+
+    size_t expected = intersect_scalar(a.data(), a.size(), b.data(), b.size(), out.data());
+    std::cout << "|a| = " << a.size() << " |b| = " << b.size() << " ratio = " << ratio
+              << " matches = " << expected << "\n";
+
+    run("scalar", [&]() { return intersect_scalar(a.data(), a.size(), b.data(), b.size(), out.data()); },
+        repeats, expected);
+    run("gallop", [&]() { return intersect_gallop(a.data(), a.size(), b.data(), b.size(), out.data()); },
+        repeats, expected);
+#ifdef __SSE4_1__
+    run("sse", [&]() { return intersect_sse(a.data(), a.size(), b.data(), b.size(), out.data()); },
+        repeats, expected);
+#endif
+#ifdef __AVX2__
+    run("avx2", [&]() { return intersect_avx2(a.data(), a.size(), b.data(), b.size(), out.data()); },
+        repeats, expected);
+#endif
+    run("auto", [&]() { return intersect(a.data(), a.size(), b.data(), b.size(), out.data()); },
+        repeats, expected);
+    run("fused scalar", [&]() {
+          return intersect_with_freqs_scalar(a.data(), fa.data(), a.size(), b.data(), fb.data(), b.size(),
+                                             out.data(), out_fa.data(), out_fb.data());
+        }, repeats, expected);
+#ifdef __SSE4_1__
+    run("fused sse", [&]() {
+          return intersect_with_freqs_sse(a.data(), fa.data(), a.size(), b.data(), fb.data(), b.size(),
+                                          out.data(), out_fa.data(), out_fb.data());
+        }, repeats, expected);
+#endif
+#ifdef __AVX2__
+    run("fused avx2", [&]() {
+          return intersect_with_freqs_avx2(a.data(), fa.data(), a.size(), b.data(), fb.data(), b.size(),
+                                           out.data(), out_fa.data(), out_fb.data());
+        }, repeats, expected);
+#endif
+    run("fused auto", [&]() {
+          return intersect_with_freqs(a.data(), fa.data(), a.size(), b.data(), fb.data(), b.size(),
+                                      out.data(), out_fa.data(), out_fb.data());
+        }, repeats, expected);
+
+    check_fused("fused scalar", intersect_with_freqs_scalar, a, fa, b, fb);
+    check_fused("fused gallop", intersect_with_freqs_gallop, a, fa, b, fb);
+#ifdef __SSE4_1__
+    check_fused("fused sse", intersect_with_freqs_sse, a, fa, b, fb);
+#endif
+#ifdef __AVX2__
+    check_fused("fused avx2", intersect_with_freqs_avx2, a, fa, b, fb);
+#endif
+    check_fused("fused auto", intersect_with_freqs, a, fa, b, fb);
+  }
+  return 0;
+}
@@ -0,0 +1,453 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "util.hpp"
+#include "compress.hpp"
+#include "ranking.hpp"
+#include "topk_queue.hpp"
+#include "query_processing.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#include "variable_postings_cursor.hpp"
+#else
+#include "immediate_index.hpp"
+#include "postings_cursor.hpp"
+#endif
+
+// A materialised intersection of two postings lists. Each document is kept
+// as three vbytes: the d-gap, then the f_dt of the first and second terms
+// (in sorted term order). Like the result cache, the pair is tagged with
+// the largest docid it covers, and new documents are appended to it
+struct cached_pair {
+  std::string m_first;
+  std::string m_second;
+  uint32_t m_watermark;    // the intersection covers docids up to here
+  uint32_t m_last_docid;   // the d-gaps are taken from this
+  size_t m_size;           // number of documents
+  std::vector<uint8_t> m_data;
+
+  void append(const uint32_t docid, const uint32_t first_freq, const uint32_t second_freq) {
+    uint8_t buffer[16];
+    size_t bytes = vbyte_encode(docid - m_last_docid, buffer);
+    bytes += vbyte_encode(first_freq, buffer + bytes);
+    bytes += vbyte_encode(second_freq, buffer + bytes);
+    m_data.insert(m_data.end(), buffer, buffer + bytes);
+    m_last_docid = docid;
+    m_size += 1;
+  }
+};
+
+// Walks a cached pair a document at a time
+class pair_cursor {
+
+  public:
+    explicit pair_cursor(const cached_pair& pair) : m_pair(pair),
+                                                    m_offset(0),
+                                                    m_read(0),
+                                                    m_docid(0),
+                                                    m_first_freq(0),
+                                                    m_second_freq(0) {
+      next();
+    }
+
+    uint32_t docid() const {
+      return m_docid;
+    }
+
+    uint32_t first_freq() const {
+      return m_first_freq;
+    }
+
+    uint32_t second_freq() const {
+      return m_second_freq;
+    }
+
+    void next() {
+      if (m_read == m_pair.m_size) {
+        m_docid = END_CHAIN;
+        return;
+      }
+      uint8_t* data = const_cast<uint8_t*>(m_pair.m_data.data());
+      m_docid += vbyte_decode(data + m_offset, m_offset);
+      m_first_freq = vbyte_decode(data + m_offset, m_offset);
+      m_second_freq = vbyte_decode(data + m_offset, m_offset);
+      m_read += 1;
+    }
+
+    // The pair is a short list, so a linear walk is fine
+    void next_geq(const uint32_t target_docid) {
+      while (m_docid < target_docid) {
+        next();
+      }
+    }
+
+  private:
+    const cached_pair& m_pair;
+    size_t m_offset;
+    size_t m_read;
+    uint32_t m_docid;
+    uint32_t m_first_freq;
+    uint32_t m_second_freq;
+};
+
+// A cache of pairwise intersections for the term pairs which keep turning
+// up together in conjunctive queries. Every pair in every query is
+// counted; a pair is admitted once it has been seen admit_after times, if
+// room can be made by evicting pairs which have been seen less often. So
+// that the counts follow the traffic (and stay bounded), they are halved
+// whenever too many distinct pairs are being tracked
+class intersection_cache {
+
+  public:
+    // The pairs are charged what their vbytes take, which is three to
+    // fifteen bytes a document, and kept within capacity_bytes
+    explicit intersection_cache(const size_t capacity_bytes, const uint32_t admit_after = 2,
+                                const size_t max_tracked = 1 << 16) : m_capacity(capacity_bytes),
+                                                                      m_admit_after(admit_after),
+                                                                      m_max_tracked(max_tracked),
+                                                                      m_bytes(0),
+                                                                      m_hits(0),
+                                                                      m_misses(0),
+                                                                      m_admissions(0),
+                                                                      m_evictions(0) {}
+
+    // Notes the pairs of terms of a query, admitting any which have become
+    // frequent, and returns the cached pair with the fewest documents among
+    // them (brought up to the watermark), or nullptr if there is none. first
+    // and second are set to the positions of its terms in `cursors`
+    const cached_pair* lookup(immediate_index& index, std::vector<postings_cursor>& cursors, const uint32_t watermark,
+                              size_t& first, size_t& second) {
+
+      if (m_frequency.size() > m_max_tracked) {
+        age();
+      }
+
+      // (1) Count the pairs, admitting any which are now frequent enough
+      for (size_t i = 0; i < cursors.size(); ++i) {
+        for (size_t j = i + 1; j < cursors.size(); ++j) {
+          std::string key = pair_key(cursors[i].term(), cursors[j].term());
+          uint32_t frequency = ++m_frequency[key];
+          if (frequency >= m_admit_after && m_pairs.find(key) == m_pairs.end()) {
+            admit(index, key, cursors[i].term(), cursors[j].term(), frequency, watermark);
+          }
+        }
+      }
+
+      // (2) Then pick the shortest cached pair
+      cached_pair* best = nullptr;
+      for (size_t i = 0; i < cursors.size(); ++i) {
+        for (size_t j = i + 1; j < cursors.size(); ++j) {
+          auto it = m_pairs.find(pair_key(cursors[i].term(), cursors[j].term()));
+          if (it != m_pairs.end() && (best == nullptr || it->second.m_size < best->m_size)) {
+            best = &it->second;
+            first = i;
+            second = j;
+          }
+        }
+      }
+      if (best != nullptr && best->m_watermark < watermark) {
+        std::string key = pair_key(best->m_first, best->m_second);
+        m_bytes -= best->m_data.size();
+        extend(index, *best, watermark);
+        m_bytes += best->m_data.size();
+        // The new documents may have taken us over budget: make room from
+        // the pairs seen less often, or else give this one up
+        if (m_bytes > m_capacity && !make_room(0, frequency(key), key)) {
+          m_bytes -= best->m_data.size();
+          m_pairs.erase(key);
+          m_evictions += 1;
+          best = nullptr;
+        }
+      }
+      if (best == nullptr) {
+        m_misses += 1;
+        return nullptr;
+      }
+      m_hits += 1;
+      // The pair is kept in sorted term order
+      if (cursors[first].term() != best->m_first) {
+        std::swap(first, second);
+      }
+      return best;
+    }
+
+    size_t hits() const {
+      return m_hits;
+    }
+
+    size_t misses() const {
+      return m_misses;
+    }
+
+    size_t admissions() const {
+      return m_admissions;
+    }
+
+    size_t evictions() const {
+      return m_evictions;
+    }
+
+    size_t bytes() const {
+      return m_bytes;
+    }
+
+  private:
+    static std::string pair_key(const std::string& a, const std::string& b) {
+      return a < b ? a + ' ' + b : b + ' ' + a;
+    }
+
+    uint32_t frequency(const std::string& key) const {
+      auto it = m_frequency.find(key);
+      return it == m_frequency.end() ? 0 : it->second;
+    }
+
+    // Halves every count, forgetting the pairs which drop to zero
+    void age() {
+      for (auto it = m_frequency.begin(); it != m_frequency.end(); ) {
+        it->second /= 2;
+        if (it->second == 0) {
+          it = m_frequency.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    // The bytes a pair seen this often could have: the free space, and
+    // that of the pairs (other than `keep`) which have been seen less often
+    size_t room_for(const uint32_t newcomer_frequency, const std::string& keep = std::string()) const {
+      size_t room = m_capacity - std::min(m_bytes, m_capacity);
+      for (const auto& entry : m_pairs) {
+        if (entry.first != keep && frequency(entry.first) < newcomer_frequency) {
+          room += entry.second.m_data.size();
+        }
+      }
+      return room;
+    }
+
+    // Evicts pairs (other than `keep`) seen less often than the newcomer
+    // until it fits. Returns false (evicting nothing) if it can't be made
+    // to fit
+    bool make_room(const size_t bytes, const uint32_t newcomer_frequency, const std::string& keep = std::string()) {
+      if (bytes > m_capacity) {
+        return false;
+      }
+      std::vector<std::pair<uint32_t, std::string>> victims;
+      for (const auto& entry : m_pairs) {
+        if (entry.first != keep) {
+          victims.emplace_back(frequency(entry.first), entry.first);
+        }
+      }
+      std::sort(victims.begin(), victims.end());
+      size_t freed = 0;
+      size_t needed = 0;
+      while (m_bytes - freed + bytes > m_capacity) {
+        if (needed == victims.size() || victims[needed].first >= newcomer_frequency) {
+          return false;
+        }
+        freed += m_pairs[victims[needed].second].m_data.size();
+        needed += 1;
+      }
+      for (size_t i = 0; i < needed; ++i) {
+        m_bytes -= m_pairs[victims[i].second].m_data.size();
+        m_pairs.erase(victims[i].second);
+        m_evictions += 1;
+      }
+      return true;
+    }
+
+    // Materialises a pair, and keeps it if room can be made for it. Its
+    // size isn't known until then, but the intersection stops as soon as
+    // it outgrows the room there is
+    void admit(immediate_index& index, const std::string& key, const std::string& a, const std::string& b,
+               const uint32_t newcomer_frequency, const uint32_t watermark) {
+      size_t room = room_for(newcomer_frequency);
+      cached_pair pair{std::min(a, b), std::max(a, b), 0, 0, 0, {}};
+      if (!extend(index, pair, watermark, room) || !make_room(pair.m_data.size(), newcomer_frequency)) {
+        return;
+      }
+      m_bytes += pair.m_data.size();
+      m_pairs.emplace(key, std::move(pair));
+      m_admissions += 1;
+    }
+
+    // Intersects the two lists past the pair's watermark, and appends.
+    // False, leaving the pair part done, if it grows past max_bytes
+    bool extend(immediate_index& index, cached_pair& pair, const uint32_t watermark,
+                const size_t max_bytes = std::numeric_limits<size_t>::max()) {
+      postings_cursor first(index, pair.m_first);
+      postings_cursor second(index, pair.m_second);
+      first.next_geq(pair.m_watermark + 1);
+      while (first.docid() != END_CHAIN) {
+        second.next_geq(first.docid());
+        if (second.docid() == END_CHAIN) {
+          break;
+        }
+        if (second.docid() == first.docid()) {
+          pair.append(first.docid(), first.freq(), second.freq());
+          if (pair.m_data.size() > max_bytes) {
+            return false;
+          }
+          first.next();
+        } else {
+          first.next_geq(second.docid());
+        }
+      }
+      pair.m_watermark = watermark;
+      return true;
+    }
+
+    size_t m_capacity;
+    uint32_t m_admit_after;
+    size_t m_max_tracked;
+    size_t m_bytes;
+    std::unordered_map<std::string, uint32_t> m_frequency;
+    std::unordered_map<std::string, cached_pair> m_pairs;
+    size_t m_hits;
+    size_t m_misses;
+    size_t m_admissions;
+    size_t m_evictions;
+};
+
+// A Boolean conjunction with a cached pair standing in for two of the
+// lists (at first and second): the pair supplies the candidates, and the
+// other lists are probed short to long
+size_t pair_conjunction(const cached_pair& pair, std::vector<postings_cursor>& cursors,
+                        const size_t first, const size_t second) {
+
+  std::vector<postings_cursor*> others;
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    if (i != first && i != second) {
+      others.push_back(&cursors[i]);
+    }
+  }
+  std::sort(others.begin(), others.end(), [](postings_cursor* l, postings_cursor* r) {
+    return l->doc_freq() < r->doc_freq();
+  });
+
+  size_t matches = 0;
+  pair_cursor candidates(pair);
+  while (candidates.docid() != END_CHAIN) {
+    uint32_t candidate = candidates.docid();
+    uint32_t next_doc = candidate;
+    for (auto cursor : others) {
+      cursor->next_geq(candidate);
+      if (cursor->docid() != candidate) {
+        next_doc = cursor->docid();
+        break;
+      }
+    }
+    if (next_doc == candidate) {
+      matches += 1;
+      candidates.next();
+    } else if (next_doc == END_CHAIN) {
+      break;
+    } else {
+      candidates.next_geq(next_doc);
+    }
+  }
+  return matches;
+}
+
+// As above, but ranked. The score of the pair is known from the cache, so
+// a candidate is dropped without probing the other lists when that and the
+// bounds of the others can't make the heap. As in ranked_conjunction, the
+// final score is summed in the order of `cursors`
+template <typename Ranker>
+size_t ranked_pair_conjunction(const cached_pair& pair, std::vector<postings_cursor>& cursors,
+                               const size_t first, const size_t second, Ranker& ranker, topk_queue& results) {
+
+  std::vector<float> idf_weights(cursors.size());
+  float others_bound = 0;
+  std::vector<postings_cursor*> others;
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    idf_weights[i] = ranker.idf_weight(cursors[i].doc_freq());
+    if (i != first && i != second) {
+      others.push_back(&cursors[i]);
+      others_bound += ranker.term_weight_bound(cursors[i].max_freq()) * idf_weights[i];
+    }
+  }
+  std::sort(others.begin(), others.end(), [](postings_cursor* l, postings_cursor* r) {
+    return l->doc_freq() < r->doc_freq();
+  });
+
+  pair_cursor candidates(pair);
+
+  // As in ranked_conjunction, when the other lists are about as short as
+  // the pair (which is rare), the candidates which may make the heap are
+  // gathered from the pair and filtered through the others in batches
+  if (!others.empty() && batch_pays(pair.m_size, others.back()->doc_freq())) {
+    candidate_batch batch(cursors.size());
+    std::vector<batch_list> lists;
+    for (auto cursor : others) {
+      lists.emplace_back(*cursor);
+    }
+    while (candidates.docid() != END_CHAIN) {
+      batch.clear();
+      while (candidates.docid() != END_CHAIN && batch.size() < RANKED_BATCH) {
+        uint32_t candidate = candidates.docid();
+        float pair_score = ranker.doc_term_weight(candidate, candidates.first_freq()) * idf_weights[first] +
+                           ranker.doc_term_weight(candidate, candidates.second_freq()) * idf_weights[second];
+        if (results.would_enter(pair_score + others_bound)) {
+          uint32_t* freqs = batch.add(candidate);
+          freqs[first] = candidates.first_freq();
+          freqs[second] = candidates.second_freq();
+        }
+        candidates.next();
+      }
+      for (size_t i = 0; i < lists.size() && batch.size() > 0; ++i) {
+        batch_intersect(batch, lists[i], others[i] - cursors.data());
+      }
+      for (size_t c = 0; c < batch.size(); ++c) {
+        const uint32_t* freqs = batch.freqs(c);
+        float score = 0;
+        for (size_t i = 0; i < cursors.size(); ++i) {
+          score += ranker.doc_term_weight(batch.m_docids[c], freqs[i]) * idf_weights[i];
+        }
+        results.insert(score, batch.m_docids[c]);
+      }
+    }
+    results.finalize();
+    return results.size();
+  }
+
+  while (candidates.docid() != END_CHAIN) {
+    uint32_t candidate = candidates.docid();
+    float pair_score = ranker.doc_term_weight(candidate, candidates.first_freq()) * idf_weights[first] +
+                       ranker.doc_term_weight(candidate, candidates.second_freq()) * idf_weights[second];
+    if (!results.would_enter(pair_score + others_bound)) {
+      candidates.next();
+      continue;
+    }
+    uint32_t next_doc = candidate;
+    for (auto cursor : others) {
+      cursor->next_geq(candidate);
+      if (cursor->docid() != candidate) {
+        next_doc = cursor->docid();
+        break;
+      }
+    }
+    if (next_doc == candidate) {
+      float score = 0;
+      for (size_t i = 0; i < cursors.size(); ++i) {
+        uint32_t freq = cursors[i].freq();
+        if (i == first) {
+          freq = candidates.first_freq();
+        } else if (i == second) {
+          freq = candidates.second_freq();
+        }
+        score += ranker.doc_term_weight(candidate, freq) * idf_weights[i];
+      }
+      results.insert(score, candidate);
+      candidates.next();
+    } else if (next_doc == END_CHAIN) {
+      break;
+    } else {
+      candidates.next_geq(next_doc);
+    }
+  }
+  results.finalize();
+  return results.size();
+}
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include "util.hpp"
+
+// Kernels which intersect two sorted arrays of docids, such as the
+// decoded contents of postings blocks. The SIMD kernels compare a
+// vector of docids from each side against every rotation of the other
+// (the "shuffle-compare" approach of Katsov, and Lemire et al.), then use
+// a lookup table of shuffles to compact the matches into the output.
+//
+// All kernels write the matches to out in increasing order and return how
+// many there are. The SIMD kernels store whole vectors, so out must have
+// room for min(na, nb) + INTERSECT_PADDING values.
+
+const size_t INTERSECT_PADDING = 8;
+
+// Past this length ratio the SIMD kernels compare mostly non-matching
+// vectors, so we gallop through the longer list instead
+const size_t GALLOP_RATIO = 16;
+
+// The simplest merge
+size_t intersect_scalar(const uint32_t* a, const size_t na, const uint32_t* b, const size_t nb, uint32_t* out) {
+  size_t i = 0, j = 0, count = 0;
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      ++i;
+    } else if (b[j] < a[i]) {
+      ++j;
+    } else {
+      out[count++] = a[i];
+      ++i;
+      ++j;
+    }
+  }
+  return count;
+}
+
+// Finds the first position in [lo, n) with b[pos] >= target, by doubling
+// the step from lo and then binary searching the last step
+size_t gallop_to(const uint32_t* b, size_t lo, const size_t n, const uint32_t target) {
+  size_t step = 1;
+  size_t hi = lo;
+  while (hi < n && b[hi] < target) {
+    lo = hi + 1;
+    hi += step;
+    step <<= 1;
+  }
+  return std::lower_bound(b + lo, b + std::min(hi, n), target) - b;
+}
+
+// For lists of very different length: a must be the shorter
+size_t intersect_gallop(const uint32_t* a, const size_t na, const uint32_t* b, const size_t nb, uint32_t* out) {
+  size_t j = 0, count = 0;
+  for (size_t i = 0; i < na && j < nb; ++i) {
+    j = gallop_to(b, j, nb, a[i]);
+    if (j < nb && b[j] == a[i]) {
+      out[count++] = a[i];
+    }
+  }
+  return count;
+}
+
+#ifdef __SSE4_1__
+// One shuffle per 4-bit match mask, which moves the matching lanes to the front
+struct sse_shuffle_table {
+  __m128i m_shuffles[16];
+
+  sse_shuffle_table() {
+    for (int mask = 0; mask < 16; ++mask) {
+      uint8_t bytes[16];
+      std::fill(bytes, bytes + 16, 0x80);
+      int lane = 0;
+      for (int i = 0; i < 4; ++i) {
+        if (mask & (1 << i)) {
+          for (int b = 0; b < 4; ++b) {
+            bytes[lane * 4 + b] = i * 4 + b;
+          }
+          ++lane;
+        }
+      }
+      m_shuffles[mask] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+    }
+  }
+};
+
+const sse_shuffle_table& sse_shuffles() {
+  static const sse_shuffle_table table;
+  return table;
+}
+
+// Which lanes of va are found anywhere in vb
+inline int sse_match_mask(const __m128i va, const __m128i vb) {
+  __m128i m0 = _mm_cmpeq_epi32(va, vb);
+  __m128i m1 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)));
+  __m128i m2 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2)));
+  __m128i m3 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)));
+  __m128i any = _mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3));
+  return _mm_movemask_ps(_mm_castsi128_ps(any));
+}
+
+// 4x4 shuffle-compare
+size_t intersect_sse(const uint32_t* a, const size_t na, const uint32_t* b, const size_t nb, uint32_t* out) {
+  const auto& table = sse_shuffles();
+  size_t i = 0, j = 0, count = 0;
+  const size_t na4 = na & ~size_t(3);
+  const size_t nb4 = nb & ~size_t(3);
+  while (i < na4 && j < nb4) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+    int mask = sse_match_mask(va, vb);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + count), _mm_shuffle_epi8(va, table.m_shuffles[mask]));
+    count += __builtin_popcount(mask);
+    // Move on whichever side (or both) has the smaller maximum
+    uint32_t a_max = a[i + 3];
+    uint32_t b_max = b[j + 3];
+    i += (a_max <= b_max) ? 4 : 0;
+    j += (b_max <= a_max) ? 4 : 0;
+  }
+  return count + intersect_scalar(a + i, na - i, b + j, nb - j, out + count);
+}
+#endif
+
+#ifdef __AVX2__
+// One lane permutation per 8-bit match mask
+struct avx2_permute_table {
+  __m256i m_permutes[256];
+
+  avx2_permute_table() {
+    for (int mask = 0; mask < 256; ++mask) {
+      uint32_t lanes[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+      int lane = 0;
+      for (int i = 0; i < 8; ++i) {
+        if (mask & (1 << i)) {
+          lanes[lane++] = i;
+        }
+      }
+      m_permutes[mask] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes));
+    }
+  }
+};
+
+const avx2_permute_table& avx2_permutes() {
+  static const avx2_permute_table table;
+  return table;
+}
+
+// Which lanes of va are found anywhere in vb
+inline int avx2_match_mask(const __m256i va, const __m256i vb) {
+  const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+  __m256i any = _mm256_cmpeq_epi32(va, vb);
+  __m256i rotated = vb;
+  for (int r = 1; r < 8; ++r) {
+    rotated = _mm256_permutevar8x32_epi32(rotated, rotate);
+    any = _mm256_or_si256(any, _mm256_cmpeq_epi32(va, rotated));
+  }
+  return _mm256_movemask_ps(_mm256_castsi256_ps(any));
+}
+
+// 8x8 shuffle-compare
+size_t intersect_avx2(const uint32_t* a, const size_t na, const uint32_t* b, const size_t nb, uint32_t* out) {
+  const auto& table = avx2_permutes();
+  size_t i = 0, j = 0, count = 0;
+  const size_t na8 = na & ~size_t(7);
+  const size_t nb8 = nb & ~size_t(7);
+  while (i < na8 && j < nb8) {
+    __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+    int mask = avx2_match_mask(va, vb);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + count), _mm256_permutevar8x32_epi32(va, table.m_permutes[mask]));
+    count += __builtin_popcount(mask);
+    uint32_t a_max = a[i + 7];
+    uint32_t b_max = b[j + 7];
+    i += (a_max <= b_max) ? 8 : 0;
+    j += (b_max <= a_max) ? 8 : 0;
+  }
+  return count + intersect_scalar(a + i, na - i, b + j, nb - j, out + count);
+}
+#endif
+
+// The fused kernels also gather the freqs of each match from both sides,
+// so that the result can be scored without going back to the lists. The
+// matching values appear in the same order on both sides, so each side
+// is compacted by its own match mask
+size_t intersect_with_freqs_scalar(const uint32_t* a, const uint32_t* fa, const size_t na,
+                                   const uint32_t* b, const uint32_t* fb, const size_t nb,
+                                   uint32_t* out, uint32_t* out_fa, uint32_t* out_fb) {
+  size_t i = 0, j = 0, count = 0;
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      ++i;
+    } else if (b[j] < a[i]) {
+      ++j;
+    } else {
+      out[count] = a[i];
+      out_fa[count] = fa[i];
+      out_fb[count] = fb[j];
+      ++count;
+      ++i;
+      ++j;
+    }
+  }
+  return count;
+}
+
+size_t intersect_with_freqs_gallop(const uint32_t* a, const uint32_t* fa, const size_t na,
+                                   const uint32_t* b, const uint32_t* fb, const size_t nb,
+                                   uint32_t* out, uint32_t* out_fa, uint32_t* out_fb) {
+  size_t j = 0, count = 0;
+  for (size_t i = 0; i < na && j < nb; ++i) {
+    j = gallop_to(b, j, nb, a[i]);
+    if (j < nb && b[j] == a[i]) {
+      out[count] = a[i];
+      out_fa[count] = fa[i];
+      out_fb[count] = fb[j];
+      ++count;
+    }
+  }
+  return count;
+}
+
+#ifdef __SSE4_1__
+size_t intersect_with_freqs_sse(const uint32_t* a, const uint32_t* fa, const size_t na,
+                                const uint32_t* b, const uint32_t* fb, const size_t nb,
+                                uint32_t* out, uint32_t* out_fa, uint32_t* out_fb) {
+  const auto& table = sse_shuffles();
+  size_t i = 0, j = 0, count = 0;
+  const size_t na4 = na & ~size_t(3);
+  const size_t nb4 = nb & ~size_t(3);
+  while (i < na4 && j < nb4) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+    int mask_a = sse_match_mask(va, vb);
+    if (mask_a) {
+      int mask_b = sse_match_mask(vb, va);
+      __m128i vfa = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fa + i));
+      __m128i vfb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fb + j));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + count), _mm_shuffle_epi8(va, table.m_shuffles[mask_a]));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out_fa + count), _mm_shuffle_epi8(vfa, table.m_shuffles[mask_a]));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out_fb + count), _mm_shuffle_epi8(vfb, table.m_shuffles[mask_b]));
+      count += __builtin_popcount(mask_a);
+    }
+    uint32_t a_max = a[i + 3];
+    uint32_t b_max = b[j + 3];
+    i += (a_max <= b_max) ? 4 : 0;
+    j += (b_max <= a_max) ? 4 : 0;
+  }
+  return count + intersect_with_freqs_scalar(a + i, fa + i, na - i, b + j, fb + j, nb - j,
+                                             out + count, out_fa + count, out_fb + count);
+}
+#endif
+
+#ifdef __AVX2__
+size_t intersect_with_freqs_avx2(const uint32_t* a, const uint32_t* fa, const size_t na,
+                                 const uint32_t* b, const uint32_t* fb, const size_t nb,
+                                 uint32_t* out, uint32_t* out_fa, uint32_t* out_fb) {
+  const auto& table = avx2_permutes();
+  size_t i = 0, j = 0, count = 0;
+  const size_t na8 = na & ~size_t(7);
+  const size_t nb8 = nb & ~size_t(7);
+  while (i < na8 && j < nb8) {
+    __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+    int mask_a = avx2_match_mask(va, vb);
+    if (mask_a) {
+      int mask_b = avx2_match_mask(vb, va);
+      __m256i vfa = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fa + i));
+      __m256i vfb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fb + j));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + count), _mm256_permutevar8x32_epi32(va, table.m_permutes[mask_a]));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out_fa + count), _mm256_permutevar8x32_epi32(vfa, table.m_permutes[mask_a]));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out_fb + count), _mm256_permutevar8x32_epi32(vfb, table.m_permutes[mask_b]));
+      count += __builtin_popcount(mask_a);
+    }
+    uint32_t a_max = a[i + 7];
+    uint32_t b_max = b[j + 7];
+    i += (a_max <= b_max) ? 8 : 0;
+    j += (b_max <= a_max) ? 8 : 0;
+  }
+  return count + intersect_with_freqs_scalar(a + i, fa + i, na - i, b + j, fb + j, nb - j,
+                                             out + count, out_fa + count, out_fb + count);
+}
+#endif
+
+// Picks the best kernel for the lengths (and the instruction set we were
+// built for)
+size_t intersect(const uint32_t* a, const size_t na, const uint32_t* b, const size_t nb, uint32_t* out) {
+  if (na * GALLOP_RATIO < nb) {
+    return intersect_gallop(a, na, b, nb, out);
+  }
+  if (nb * GALLOP_RATIO < na) {
+    return intersect_gallop(b, nb, a, na, out);
+  }
+#if defined(__AVX2__)
+  return intersect_avx2(a, na, b, nb, out);
+#elif defined(__SSE4_1__)
+  return intersect_sse(a, na, b, nb, out);
+#else
+  return intersect_scalar(a, na, b, nb, out);
+#endif
+}
+
+size_t intersect_with_freqs(const uint32_t* a, const uint32_t* fa, const size_t na,
+                            const uint32_t* b, const uint32_t* fb, const size_t nb,
+                            uint32_t* out, uint32_t* out_fa, uint32_t* out_fb) {
+  if (na * GALLOP_RATIO < nb) {
+    return intersect_with_freqs_gallop(a, fa, na, b, fb, nb, out, out_fa, out_fb);
+  }
+  if (nb * GALLOP_RATIO < na) {
+    return intersect_with_freqs_gallop(b, fb, nb, a, fa, na, out, out_fb, out_fa);
+  }
+#if defined(__AVX2__)
+  return intersect_with_freqs_avx2(a, fa, na, b, fb, nb, out, out_fa, out_fb);
+#elif defined(__SSE4_1__)
+  return intersect_with_freqs_sse(a, fa, na, b, fb, nb, out, out_fa, out_fb);
+#else
+  return intersect_with_freqs_scalar(a, fa, na, b, fb, nb, out, out_fa, out_fb);
+#endif
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "util.hpp"
+
+// A read-only memory mapping of a whole file. The pages are those of the
+// page cache, so mapping an index costs next to nothing up front, and any
+// number of processes serving the same index share a single copy of it
+class mapped_file {
+
+  public:
+    mapped_file() : m_data(nullptr), m_size(0) {}
+
+    ~mapped_file() {
+      if (m_data != nullptr) {
+        munmap(m_data, m_size);
+      }
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    // Maps the file; false (with a message) if it can't be
+    bool open(const std::string& filename) {
+      int fd = ::open(filename.c_str(), O_RDONLY);
+      if (fd < 0) {
+        std::cerr << "Could not open " << filename << "\n";
+        return false;
+      }
+      struct stat info;
+      if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        std::cerr << "Could not map " << filename << ": empty or unreadable\n";
+        close(fd);
+        return false;
+      }
+      void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      // The mapping holds its own reference to the file
+      close(fd);
+      if (data == MAP_FAILED) {
+        std::cerr << "Could not map " << filename << "\n";
+        return false;
+      }
+      m_data = static_cast<uint8_t*>(data);
+      m_size = info.st_size;
+      return true;
+    }
+
+    const uint8_t* data() const {
+      return m_data;
+    }
+
+    size_t size() const {
+      return m_size;
+    }
+
+    // Passes a hint about [offset, offset + bytes) on to the kernel; the
+    // range is widened to whole pages, as madvise wants
+    void advise(const size_t offset, const size_t bytes, const int advice) const {
+      static const size_t page = sysconf(_SC_PAGESIZE);
+      size_t begin = offset / page * page;
+      size_t end = std::min(offset + bytes, m_size);
+      if (begin < end) {
+        madvise(m_data + begin, end - begin, advice);
+      }
+    }
+
+  private:
+    uint8_t* m_data;
+    size_t m_size;
+};
+
+// Writes all of a buffer at an offset in a file, which several threads
+// can do at once to different parts of the file
+inline bool write_at(const int fd, const void* data, size_t bytes, size_t offset) {
+  const char* from = static_cast<const char*>(data);
+  while (bytes > 0) {
+    ssize_t written = pwrite(fd, from, bytes, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    from += written;
+    bytes -= written;
+    offset += written;
+  }
+  return true;
+}
+
+// Flushes a file which has been written and closed to disk
+inline bool sync_file(const std::string& filename) {
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool synced = fsync(fd) == 0;
+  close(fd);
+  return synced;
+}
+
+// Replaces filename with a complete temporary file, durably: the file is
+// flushed before the rename, so a crash can't leave a name pointing at
+// half of it, and the directory after, so the rename itself survives one
+inline bool rename_synced(const std::string& partial, const std::string& filename) {
+  if (!sync_file(partial) || std::rename(partial.c_str(), filename.c_str()) != 0) {
+    return false;
+  }
+  size_t slash = filename.find_last_of('/');
+  std::string directory = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+  return sync_file(directory);
+}
+
+// An array which either owns its elements (as a vector) or is a view over
+// memory held elsewhere, such as a mapped index file. Views are read-only
+// in practice: the mapping is, so writing through one faults
+template <typename T>
+class mappable_array {
+
+  public:
+    mappable_array() : m_ptr(nullptr), m_size(0) {}
+
+    mappable_array(const mappable_array& other) : m_owned(other.m_owned) {
+      m_ptr = other.is_view() ? other.m_ptr : m_owned.data();
+      m_size = other.m_size;
+    }
+
+    // Moving keeps the elements where they are, so a view stays a view
+    mappable_array(mappable_array&& other) : m_owned(std::move(other.m_owned)),
+                                             m_ptr(other.m_ptr),
+                                             m_size(other.m_size) {
+      other.m_ptr = nullptr;
+      other.m_size = 0;
+    }
+
+    mappable_array& operator=(mappable_array&& other) {
+      m_owned = std::move(other.m_owned);
+      m_ptr = other.m_ptr;
+      m_size = other.m_size;
+      other.m_ptr = nullptr;
+      other.m_size = 0;
+      return *this;
+    }
+
+    mappable_array& operator=(const mappable_array& other) {
+      m_owned = other.m_owned;
+      m_ptr = other.is_view() ? other.m_ptr : m_owned.data();
+      m_size = other.m_size;
+      return *this;
+    }
+
+    void resize(const size_t n) {
+      take_ownership();
+      m_owned.resize(n);
+      m_ptr = m_owned.data();
+      m_size = n;
+    }
+
+    void resize(const size_t n, const T& value) {
+      take_ownership();
+      m_owned.resize(n, value);
+      m_ptr = m_owned.data();
+      m_size = n;
+    }
+
+    // Points at n elements which we don't own
+    void view(const void* data, const size_t n) {
+      m_owned = std::vector<T>();
+      m_ptr = const_cast<T*>(static_cast<const T*>(data));
+      m_size = n;
+    }
+
+    bool is_view() const {
+      return m_ptr != nullptr && m_ptr != m_owned.data();
+    }
+
+    size_t size() const {
+      return m_size;
+    }
+
+    T* data() {
+      return m_ptr;
+    }
+
+    const T* data() const {
+      return m_ptr;
+    }
+
+    T& operator[](const size_t i) {
+      return m_ptr[i];
+    }
+
+    const T& operator[](const size_t i) const {
+      return m_ptr[i];
+    }
+
+  private:
+    // Resizing a view copies it into memory of our own first
+    void take_ownership() {
+      if (is_view()) {
+        m_owned.assign(m_ptr, m_ptr + m_size);
+      }
+    }
+
+    std::vector<T> m_owned;
+    T* m_ptr;
+    size_t m_size;
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "util.hpp"
+#include "query_processing.hpp"
+#include "thread_pool.hpp"
+
+// Intra-query parallelism: a single (long) query is split into docid
+// ranges, each of which is processed on the pool with its own copy of the
+// cursors and its own heap. More ranges than threads are used so that work
+// stealing can even out ranges which turn out to be heavier than others
+const size_t RANGES_PER_THREAD = 2;
+
+// Splits the docids [1, max_docid] into equal ranges; the last range is
+// left open so that nothing past max_docid is lost
+std::vector<docid_range> split_docids(const uint32_t max_docid, const size_t parts, shared_threshold* threshold) {
+  std::vector<docid_range> ranges;
+  uint32_t width = std::max(max_docid / uint32_t(parts), uint32_t(1));
+  uint32_t begin = 1;
+  for (size_t i = 0; i < parts && begin <= max_docid; ++i) {
+    uint32_t end = (i + 1 == parts) ? END_CHAIN : begin + width;
+    ranges.push_back({begin, end, threshold});
+    begin = end;
+  }
+  if (ranges.empty()) {
+    ranges.push_back({0, END_CHAIN, threshold});
+  }
+  ranges.back().m_end = END_CHAIN;
+  return ranges;
+}
+
+// Merges the heaps of the ranges into the final top-k. As with a single
+// heap, documents which tie on the k-th score may be kept or dropped
+void merge_topk(std::vector<topk_queue>& heaps, topk_queue& results) {
+  for (auto& heap : heaps) {
+    for (const auto& entry : heap.topk()) {
+      results.insert(entry.first, entry.second);
+    }
+  }
+  results.finalize();
+}
+
+// Runs a ranked algorithm (any of ranked_disjunction, maxscore_disjunction
+// or block_max_wand, called as algorithm(cursors, heap, range)) over the
+// ranges in parallel, and merges the results into the heap
+template <typename Algorithm>
+size_t range_parallel_ranked(std::vector<postings_cursor>& cursors, const uint32_t max_docid, thread_pool& pool,
+                             topk_queue& results, Algorithm algorithm) {
+
+  if (cursors.size() == 0) {
+    return 0;
+  }
+
+  shared_threshold threshold;
+  auto ranges = split_docids(max_docid, pool.size() * RANGES_PER_THREAD, &threshold);
+  std::vector<topk_queue> heaps(ranges.size(), topk_queue(results.capacity(), results.initial_threshold()));
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    pool.submit([&, i](size_t) {
+      // Each range needs its own cursors to seek with
+      std::vector<postings_cursor> range_cursors(cursors);
+      algorithm(range_cursors, heaps[i], ranges[i]);
+    });
+  }
+  pool.wait();
+
+  merge_topk(heaps, results);
+  return results.size();
+}
+
+// As above for a Boolean conjunction; the matches of the ranges are summed
+size_t range_parallel_conjunction(std::vector<postings_cursor>& cursors, const uint32_t max_docid, thread_pool& pool) {
+
+  if (cursors.size() == 0) {
+    return 0;
+  }
+
+  auto ranges = split_docids(max_docid, pool.size() * RANGES_PER_THREAD, nullptr);
+  std::vector<size_t> matches(ranges.size(), 0);
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    pool.submit([&, i](size_t) {
+      std::vector<postings_cursor> range_cursors(cursors);
+      matches[i] = boolean_conjunction(range_cursors, ranges[i]);
+    });
+  }
+  pool.wait();
+
+  return std::accumulate(matches.begin(), matches.end(), size_t(0));
+}
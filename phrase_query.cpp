@@ -0,0 +1,103 @@
+#include "util.hpp"
+#include "query.hpp"
+#include "query_processing.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#else
+#include "immediate_index.hpp"
+#endif
+#include "positional_cursor.hpp"
+
+
+int main(int argc, const char **argv) {
+
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <positional_index> <query_file> [-v] [-w <window>]\n";
+    return -1;
+  }
+
+  std::cerr << "Index File: " << argv[1] << "\n";
+  std::cerr << "Query File: " << argv[2] << "\n";
+
+  bool verbose = false;
+  uint32_t window = 0; // If set, match the terms in any order within this many words
+  for (int i = 3; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-v")
+      verbose = true;
+    else if (arg == "-w" && i + 1 < argc)
+      window = std::atol(argv[++i]);
+    else
+      std::cerr << "Ignoring unknown argument: " << arg << "\n";
+  }
+  if (window > 0) {
+    std::cerr << "Proximity: all terms within " << window << " words\n";
+  } else {
+    std::cerr << "Exact phrases\n";
+  }
+
+  std::cerr << "Reading the index...\n";
+  std::ifstream in_idx(argv[1], std::ios::binary);
+
+  immediate_index my_idx;
+  if (!my_idx.load(in_idx) || !my_idx.layout().expect_positions(true)) {
+    return -1;
+  }
+
+  std::cerr << "Reading the query file...\n";
+  std::ifstream in_q(argv[2]);
+  auto queries = read_ordered_queries(in_q);
+
+  std::vector<double> query_times;
+  std::vector<size_t> match_counts;
+  std::vector<uint32_t> matches;
+
+  for (size_t i = 0; i < queries.size(); ++i) {
+    double start = get_time_usecs();
+    auto cursors = query_to_positional_cursors(my_idx, queries[i]);
+    size_t result_count = 0;
+    if (window > 0) {
+      result_count = window_query(cursors, window, matches);
+    } else {
+      result_count = phrase_query(cursors, matches);
+    }
+    do_not_optimize_away(result_count);
+    double stop = get_time_usecs() - start;
+    // XXX We're only counting queries with matches
+    if (result_count > 0) {
+      if (verbose) {
+        std::cout << queries[i].m_id << " latency=" << stop << " matches=" << result_count << "\n";
+      }
+      query_times.push_back(stop);
+      match_counts.push_back(result_count);
+    }
+  }
+
+  std::cerr << "Statistics computed over " << match_counts.size() << " queries with at least one match.\n";
+  if (match_counts.empty()) {
+    return 0;
+  }
+
+  std::sort(query_times.begin(), query_times.end());
+  double average = std::accumulate(query_times.begin(), query_times.end(), double()) / query_times.size();
+  double p50 = query_times[query_times.size() / 2];
+  double p90 = query_times[90 * query_times.size() / 100];
+  double p95 = query_times[95 * query_times.size() / 100];
+  double p99 = query_times[99 * query_times.size() / 100];
+
+  std::cerr << "Latency -> Mean: " << average
+            << " Median: " << p50
+            << " p90: " << p90
+            << " p95: " << p95
+            << " p99: " << p99 << "\n";
+
+  std::sort(match_counts.begin(), match_counts.end());
+  double maverage = std::accumulate(match_counts.begin(), match_counts.end(), double()) / match_counts.size();
+  std::cerr << "Matches -> Mean: " << maverage
+            << " min: " << match_counts[0]
+            << " p50: " << match_counts[match_counts.size() / 2]
+            << " max: " << match_counts[match_counts.size() - 1] << "\n";
+
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include "util.hpp"
+#include "query.hpp"
+#include "query_processing.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#else
+#include "immediate_index.hpp"
+#endif
+#include "positional_cursor.hpp"
+
+// Checks phrase and window queries over a handful of documents, most of
+// all queries which give a term more than once: each occurrence in the
+// query must be matched by an occurrence of its own in the document
+
+size_t failures = 0;
+
+void check(immediate_index& index, const std::string& text, const uint32_t window,
+           const std::vector<uint32_t>& expected) {
+  std::vector<std::string> terms;
+  std::istringstream in(text);
+  std::string term;
+  while (in >> term) {
+    terms.push_back(term);
+  }
+  query q("0", terms);
+  auto cursors = query_to_positional_cursors(index, q);
+  std::vector<uint32_t> matches;
+  if (window > 0) {
+    window_query(cursors, window, matches);
+  } else {
+    phrase_query(cursors, matches);
+  }
+  std::cout << (window > 0 ? "window " + std::to_string(window) : std::string("phrase")) << " [" << text << "]: ";
+  if (matches == expected) {
+    std::cout << "ok\n";
+    return;
+  }
+  std::cout << "FAILED, matched";
+  for (auto docid : matches) {
+    std::cout << " " << docid;
+  }
+  std::cout << "\n";
+  failures += 1;
+}
+
+int main() {
+
+  const std::vector<std::string> documents = {
+    "a b c",           // 1: a once
+    "a b a",           // 2
+    "a x x x x x b a", // 3: both a, but not within 5 words of each other
+    "b a x a",         // 4
+    "x a a b",         // 5
+  };
+  immediate_index index(1024, 1024);
+  for (size_t i = 0; i < documents.size(); ++i) {
+    std::unordered_map<std::string, std::vector<uint32_t>> term_to_pos;
+    std::istringstream in(documents[i]);
+    std::string term;
+    uint32_t position = 1;
+    while (in >> term) {
+      term_to_pos[term].push_back(position++);
+    }
+    for (auto& element : term_to_pos) {
+      index.insert_positions(i + 1, element.first, element.second);
+    }
+    index.add_document(i + 1, position - 1);
+  }
+
+  check(index, "a b", 0, {1, 2, 5});
+  check(index, "a b a", 0, {2});
+  check(index, "a a", 0, {5});
+  check(index, "a b", 5, {1, 2, 3, 4, 5});
+  check(index, "a b a", 5, {2, 4, 5});
+  check(index, "a a b", 5, {2, 4, 5});
+  check(index, "a a a", 5, {});
+  check(index, "a a", 2, {5});
+
+  if (failures > 0) {
+    std::cerr << "Error: " << failures << " checks failed\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
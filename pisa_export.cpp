@@ -0,0 +1,64 @@
+#include "util.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#else
+#include "immediate_index.hpp"
+#endif
+
+#include "pisa_export.hpp"
+
+int main(int argc, const char **argv) {
+
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <index> <output_basename> [-f pisa|ciff] [-t <threads>]\n";
+    return -1;
+  }
+
+  std::string format = "pisa";
+  size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+  for (int i = 3; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-f" && i + 1 < argc)
+      format = argv[++i];
+    else if (arg == "-t" && i + 1 < argc)
+      threads = std::atol(argv[++i]);
+    else
+      std::cerr << "Ignoring unknown argument: " << arg << "\n";
+  }
+
+  if (format != "pisa" && format != "ciff") {
+    std::cerr << "Unknown format: " << format << "\n";
+    return -1;
+  }
+
+  std::cerr << "Index File: " << argv[1] << "\n";
+  std::cerr << "Output: " << argv[2] << (format == "ciff" ? ".ciff" : ".{docs,freqs,sizes,terms,documents}") << "\n";
+  std::cerr << "Threads: " << threads << "\n";
+
+  // Mapping is enough, as the lists are only read once
+  immediate_index my_idx;
+  if (!my_idx.map(argv[1]) || !my_idx.layout().expect_positions(false)) {
+    return -1;
+  }
+  std::cerr << "N = " << my_idx.num_docs() << "\n";
+  if (my_idx.num_docs() == 0) {
+    std::cerr << "The index has no document lengths; rebuild it to export.\n";
+    return -1;
+  }
+
+  std::cerr << "Exporting...\n";
+  double start = get_time_usecs();
+  bool exported = false;
+  if (format == "ciff") {
+    exported = export_ciff(my_idx, std::string(argv[2]) + ".ciff", threads, "Exported from " + std::string(argv[1]));
+  } else {
+    exported = export_pisa(my_idx, argv[2], threads);
+  }
+  if (!exported) {
+    return -1;
+  }
+  std::cerr << "Exported in " << (get_time_usecs() - start) / 1000 << " ms\n";
+
+  return 0;
+}
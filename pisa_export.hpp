@@ -0,0 +1,310 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "util.hpp"
+#include "thread_pool.hpp"
+#include "mapped_file.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#include "variable_postings_cursor.hpp"
+#else
+#include "immediate_index.hpp"
+#include "postings_cursor.hpp"
+#endif
+
+// Exports an immediate_index as a PISA binary collection or as CIFF by
+// walking its chains, so there is no need to go back to the docstream.
+// The index may be loaded, mapped, or live, so long as nothing is added
+// to it meanwhile: a live index can be exported from a forked child, see
+// background_snapshot::run. Both formats want the lists in term order
+// and docids from 0, so docid d is written as d - first_docid.
+//
+// The lists are cut into runs of about EXPORT_RUN_POSTINGS postings which
+// are decoded on a pool. For PISA, every list's place in the output is
+// known from its f_t, so each run is written in place with pwrite; CIFF
+// is variable length, so runs are encoded a wave at a time (the pool's
+// worth) and then written in order, which bounds the memory taken
+const size_t EXPORT_RUN_POSTINGS = size_t(1) << 20;
+const size_t EXPORT_RUNS_PER_THREAD = 4;
+const size_t EXPORT_BUFFER_BYTES = size_t(4) << 20;
+
+// A list to export: its term and f_t
+struct export_list {
+  std::string m_term;
+  uint32_t m_doc_freq;
+};
+
+// The lists of the index, in term order
+std::vector<export_list> export_lists(immediate_index& index) {
+  std::vector<export_list> lists;
+  for (auto& term : index.vocabulary()) {
+    uint32_t head_idx = index.get_offset(index.found_or_empty_offset(term));
+    lists.push_back(export_list{std::move(term), index.doc_freq(head_idx)});
+  }
+  std::sort(lists.begin(), lists.end(), [](const export_list& l, const export_list& r) {
+    return l.m_term < r.m_term;
+  });
+  return lists;
+}
+
+// Cuts lists into runs of about run_postings postings, given the f_t of
+// each; returns the first list of each run, and then the number of lists.
+// Also used to bulk-load an index, see pisa_import.hpp
+template <typename List, typename DocFreq>
+std::vector<size_t> split_runs(const std::vector<List>& lists, const size_t run_postings, DocFreq doc_freq) {
+  std::vector<size_t> run_starts(1, 0);
+  size_t postings = 0;
+  for (size_t i = 0; i < lists.size(); ++i) {
+    if (postings >= run_postings) {
+      run_starts.push_back(i);
+      postings = 0;
+    }
+    postings += doc_freq(lists[i]);
+  }
+  run_starts.push_back(lists.size());
+  return run_starts;
+}
+
+// Cuts the lists into runs of about EXPORT_RUN_POSTINGS postings
+std::vector<size_t> split_export_runs(const std::vector<export_list>& lists) {
+  return split_runs(lists, EXPORT_RUN_POSTINGS, [](const export_list& list) { return list.m_doc_freq; });
+}
+
+// Buffers bytes bound for consecutive offsets of a file, and writes them
+// out with pwrite a large buffer at a time
+class offset_writer {
+
+  public:
+    offset_writer(const int fd, const size_t offset) : m_fd(fd), m_offset(offset), m_ok(true) {
+      m_buffer.reserve(EXPORT_BUFFER_BYTES);
+    }
+
+    void append(const void* data, const size_t bytes) {
+      if (m_buffer.size() + bytes > EXPORT_BUFFER_BYTES) {
+        flush();
+      }
+      const char* from = static_cast<const char*>(data);
+      m_buffer.insert(m_buffer.end(), from, from + bytes);
+    }
+
+    void append_u32(const uint32_t value) {
+      append(&value, sizeof(uint32_t));
+    }
+
+    // False if any write failed
+    bool flush() {
+      m_ok = m_ok && write_at(m_fd, m_buffer.data(), m_buffer.size(), m_offset);
+      m_offset += m_buffer.size();
+      m_buffer.clear();
+      return m_ok;
+    }
+
+  private:
+    int m_fd;
+    size_t m_offset;
+    bool m_ok;
+    std::vector<char> m_buffer;
+};
+
+// Writes <basename>.docs, .freqs and .sizes, the PISA binary collection,
+// along with the lexicon (.terms) and document map (.documents) as text.
+// The lists of .docs follow a header list holding |D|, and each list is
+// its length and then its docids (or f_dt)
+bool export_pisa(immediate_index& index, const std::string& basename, const size_t threads) {
+  const auto& lengths = index.doc_lengths();
+  const uint32_t first_docid = lengths.first_docid();
+  auto lists = export_lists(index);
+  auto run_starts = split_export_runs(lists);
+
+  // Each list takes 1 + f_t integers in both files
+  std::vector<size_t> list_offsets(lists.size() + 1, 0);
+  for (size_t i = 0; i < lists.size(); ++i) {
+    list_offsets[i + 1] = list_offsets[i] + sizeof(uint32_t) * (size_t(1) + lists[i].m_doc_freq);
+  }
+  const size_t docs_header = 2 * sizeof(uint32_t);
+
+  int docs_fd = ::open((basename + ".docs").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int freqs_fd = ::open((basename + ".freqs").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (docs_fd < 0 || freqs_fd < 0) {
+    std::cerr << "Could not open " << basename << ".docs or .freqs for writing\n";
+    return false;
+  }
+  std::atomic<bool> failed(false);
+  {
+    thread_pool pool(threads);
+    for (size_t r = 0; r + 1 < run_starts.size(); ++r) {
+      pool.submit([&, r](size_t) {
+        offset_writer docs(docs_fd, docs_header + list_offsets[run_starts[r]]);
+        offset_writer freqs(freqs_fd, list_offsets[run_starts[r]]);
+        for (size_t i = run_starts[r]; i < run_starts[r + 1]; ++i) {
+          docs.append_u32(lists[i].m_doc_freq);
+          freqs.append_u32(lists[i].m_doc_freq);
+          postings_cursor cursor(index, lists[i].m_term);
+          while (cursor.docid() != END_CHAIN) {
+            docs.append_u32(cursor.docid() - first_docid);
+            freqs.append_u32(cursor.freq());
+            cursor.next();
+          }
+        }
+        if (!docs.flush() || !freqs.flush()) {
+          failed = true;
+        }
+      });
+    }
+    pool.wait();
+  }
+
+  // The header list of .docs, and the document lengths
+  std::vector<uint32_t> header = {1, uint32_t(lengths.num_docs())};
+  std::vector<uint32_t> sizes(1, lengths.num_docs());
+  for (size_t i = 0; i < lengths.num_docs(); ++i) {
+    sizes.push_back(lengths.length(first_docid + i));
+  }
+  bool written = !failed && write_at(docs_fd, header.data(), docs_header, 0);
+  written = (close(docs_fd) == 0) && written;
+  written = (close(freqs_fd) == 0) && written;
+  std::ofstream out_sizes(basename + ".sizes", std::ios::binary);
+  out_sizes.write(reinterpret_cast<const char *>(sizes.data()), sizeof(uint32_t) * sizes.size());
+
+  // Text: one term per line, in list order, and the docid of each document
+  std::ofstream out_terms(basename + ".terms");
+  for (const auto& list : lists) {
+    out_terms << list.m_term << "\n";
+  }
+  std::ofstream out_documents(basename + ".documents");
+  for (size_t i = 0; i < lengths.num_docs(); ++i) {
+    out_documents << first_docid + i << "\n";
+  }
+  out_sizes.close();
+  out_terms.close();
+  out_documents.close();
+  if (!written || !out_sizes || !out_terms || !out_documents) {
+    std::cerr << "Could not write the collection " << basename << "\n";
+    return false;
+  }
+  return true;
+}
+
+// Just enough of the protobuf wire format to write CIFF. As in proto3,
+// scalar fields which are zero (and empty strings) are left out
+inline void put_varint(std::string& out, uint64_t value) {
+  while (value >= 128) {
+    out.push_back(char((value & 127) | 128));
+    value >>= 7;
+  }
+  out.push_back(char(value));
+}
+
+inline void put_varint_field(std::string& out, const uint32_t field, const uint64_t value) {
+  if (value != 0) {
+    put_varint(out, field << 3);
+    put_varint(out, value);
+  }
+}
+
+inline void put_bytes_field(std::string& out, const uint32_t field, const std::string& bytes) {
+  if (!bytes.empty()) {
+    put_varint(out, (field << 3) | 2);
+    put_varint(out, bytes.size());
+    out += bytes;
+  }
+}
+
+inline void put_double_field(std::string& out, const uint32_t field, const double value) {
+  if (value != 0) {
+    put_varint(out, (field << 3) | 1);
+    out.append(reinterpret_cast<const char *>(&value), sizeof(double));
+  }
+}
+
+// A message as CIFF strings them together: its length, then the message
+inline void put_delimited(std::string& out, const std::string& message) {
+  put_varint(out, message.size());
+  out += message;
+}
+
+// Writes the index as a CIFF file: a Header, a PostingsList per term (with
+// d-gapped docids) and then a DocRecord per document
+bool export_ciff(immediate_index& index, const std::string& filename, const size_t threads,
+                 const std::string& description) {
+  const auto& lengths = index.doc_lengths();
+  const uint32_t first_docid = lengths.first_docid();
+  auto lists = export_lists(index);
+  auto run_starts = split_export_runs(lists);
+  std::ofstream out(filename, std::ios::binary);
+
+  std::string header;
+  put_varint_field(header, 1, 1); // version
+  put_varint_field(header, 2, lists.size());
+  put_varint_field(header, 3, lengths.num_docs());
+  put_varint_field(header, 4, lists.size());
+  put_varint_field(header, 5, lengths.num_docs());
+  put_varint_field(header, 6, lengths.total_length());
+  put_double_field(header, 7, lengths.average_length());
+  put_bytes_field(header, 8, description);
+  std::string encoded;
+  put_delimited(encoded, header);
+  out.write(encoded.data(), encoded.size());
+
+  // The lists, a wave of runs at a time
+  thread_pool pool(threads);
+  const size_t wave = pool.size() * EXPORT_RUNS_PER_THREAD;
+  const size_t num_runs = run_starts.size() - 1;
+  for (size_t first_run = 0; first_run < num_runs; first_run += wave) {
+    const size_t runs = std::min(wave, num_runs - first_run);
+    std::vector<std::string> encoded_runs(runs);
+    for (size_t r = 0; r < runs; ++r) {
+      pool.submit([&, r](size_t) {
+        std::string list;
+        std::string posting;
+        for (size_t i = run_starts[first_run + r]; i < run_starts[first_run + r + 1]; ++i) {
+          list.clear();
+          put_bytes_field(list, 1, lists[i].m_term);
+          put_varint_field(list, 2, lists[i].m_doc_freq);
+          uint64_t collection_freq = 0;
+          std::string postings;
+          uint32_t prev_docid = first_docid;
+          postings_cursor cursor(index, lists[i].m_term);
+          while (cursor.docid() != END_CHAIN) {
+            posting.clear();
+            put_varint_field(posting, 1, cursor.docid() - prev_docid);
+            put_varint_field(posting, 2, cursor.freq());
+            put_varint(postings, (4 << 3) | 2);
+            put_delimited(postings, posting);
+            collection_freq += cursor.freq();
+            prev_docid = cursor.docid();
+            cursor.next();
+          }
+          put_varint_field(list, 3, collection_freq);
+          list += postings;
+          put_delimited(encoded_runs[r], list);
+        }
+      });
+    }
+    pool.wait();
+    for (const auto& run : encoded_runs) {
+      out.write(run.data(), run.size());
+    }
+  }
+
+  std::string record;
+  for (size_t i = 0; i < lengths.num_docs(); ++i) {
+    record.clear();
+    encoded.clear();
+    put_varint_field(record, 1, i);
+    put_bytes_field(record, 2, std::to_string(first_docid + i));
+    put_varint_field(record, 3, lengths.length(first_docid + i));
+    put_delimited(encoded, record);
+    out.write(encoded.data(), encoded.size());
+  }
+  out.close();
+  if (!out) {
+    std::cerr << "Could not write " << filename << "\n";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,74 @@
+#include "util.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#else
+#include "immediate_index.hpp"
+#endif
+
+#include "pisa_import.hpp"
+
+int main(int argc, const char **argv) {
+
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <input> <output_index> [-f pisa|ciff] [-t <threads>] [-h <hash_slots>] [-L <layout>]\n";
+    std::cerr << "The input is the basename of a PISA collection, or a CIFF file\n";
+    return -1;
+  }
+
+  std::string format = "pisa";
+  size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+  size_t hash_slots = 0;
+  std::string layout_spec;
+  for (int i = 3; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-f" && i + 1 < argc)
+      format = argv[++i];
+    else if (arg == "-t" && i + 1 < argc)
+      threads = std::atol(argv[++i]);
+    else if (arg == "-h" && i + 1 < argc)
+      hash_slots = std::atol(argv[++i]);
+    else if (arg == "-L" && i + 1 < argc)
+      layout_spec = argv[++i];
+    else
+      std::cerr << "Ignoring unknown argument: " << arg << "\n";
+  }
+
+  if (format != "pisa" && format != "ciff") {
+    std::cerr << "Unknown format: " << format << "\n";
+    return -1;
+  }
+  block_layout layout;
+  if (!layout_spec.empty() && !block_layout::parse(layout_spec, layout)) {
+    return -1;
+  }
+
+  std::cerr << "Input: " << argv[1] << (format == "ciff" ? "" : ".{docs,freqs,sizes,terms}") << "\n";
+  std::cerr << "Index File: " << argv[2] << "\n";
+  std::cerr << "Threads: " << threads << "\n";
+  std::cerr << "Layout: " << layout.name() << "\n";
+
+  double start = get_time_usecs();
+  pisa_source pisa;
+  ciff_source ciff;
+  bool opened = format == "ciff" ? ciff.open(argv[1]) : pisa.open(argv[1]);
+  if (!opened) {
+    return -1;
+  }
+  size_t terms = format == "ciff" ? ciff.lists().size() : pisa.lists().size();
+  size_t docs = format == "ciff" ? ciff.doc_lengths().num_docs() : pisa.doc_lengths().num_docs();
+  if (hash_slots == 0) {
+    hash_slots = HASH_VOCAB_SIZE * terms + 1;
+  }
+  std::cerr << "N = " << docs << ", |V| = " << terms << ", hash slots = " << hash_slots << "\n";
+
+  std::cerr << "Loading...\n";
+  bool loaded = format == "ciff" ? bulk_load(ciff, argv[2], hash_slots, threads, layout)
+                                 : bulk_load(pisa, argv[2], hash_slots, threads, layout);
+  if (!loaded) {
+    return -1;
+  }
+  std::cerr << "Loaded in " << (get_time_usecs() - start) / 1000 << " ms\n";
+
+  return 0;
+}
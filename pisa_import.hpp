@@ -0,0 +1,399 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "util.hpp"
+#include "thread_pool.hpp"
+#include "mapped_file.hpp"
+#include "document_lengths.hpp"
+#include "pisa_export.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#else
+#include "immediate_index.hpp"
+#endif
+
+// Bulk-loads a packed immediate_index straight from postings lists, a PISA
+// binary collection or a CIFF file (as pisa_export.hpp writes them), so a
+// node can be rebuilt without going back to the docstream. Docids in both
+// formats start from 0, and are loaded as d + 1.
+//
+// The lists are cut into runs of about IMPORT_RUN_POSTINGS postings, and
+// a wave of runs (the pool's worth) is built at a time: each run is
+// inserted into a small index of its own, whose chains are then measured
+// as serialize_pack measures them. That gives every list of the wave its
+// exact place in the file, after the lists of the waves before, and each
+// run is written there in parallel with write_packed_run. So the index is
+// packed as it is built, is never held in memory whole, and each input
+// list is read just once
+const size_t IMPORT_RUN_POSTINGS = size_t(1) << 20;
+const size_t IMPORT_RUNS_PER_THREAD = 4;
+
+// A run's index is grown once it has fewer free blocks than this; more
+// than any slab
+const size_t IMPORT_SLACK_BLOCKS = size_t(1) << 11;
+
+// A list to load: its term, its f_t and where its postings start in the
+// input
+struct import_list {
+  std::string m_term;
+  uint32_t m_doc_freq;
+  size_t m_offset;
+};
+
+// A PISA binary collection: .docs, .freqs, .sizes and .terms
+class pisa_source {
+
+  public:
+    bool open(const std::string& basename) {
+      if (!m_docs.open(basename + ".docs") || !m_freqs.open(basename + ".freqs")) {
+        return false;
+      }
+      std::ifstream terms(basename + ".terms");
+      std::ifstream sizes(basename + ".sizes", std::ios::binary);
+      uint32_t num_docs = 0;
+      if (!terms || !sizes.read(reinterpret_cast<char *>(&num_docs), sizeof(uint32_t))) {
+        std::cerr << "Could not read " << basename << ".terms or .sizes\n";
+        return false;
+      }
+      std::vector<uint32_t> lengths(num_docs);
+      sizes.read(reinterpret_cast<char *>(lengths.data()), sizeof(uint32_t) * num_docs);
+      for (uint32_t i = 0; i < num_docs; ++i) {
+        m_lengths.add(i + 1, lengths[i]);
+      }
+
+      // Each list of .docs is its length and then its docids, after the
+      // header list [1, |D|]; .freqs has no header
+      const uint32_t* docs = docs_data();
+      const size_t docs_words = m_docs.size() / sizeof(uint32_t);
+      size_t offset = 2;
+      std::string term;
+      while (std::getline(terms, term)) {
+        if (offset >= docs_words || offset + 1 + docs[offset] > docs_words) {
+          std::cerr << "Could not read " << basename << ": more terms than lists\n";
+          return false;
+        }
+        m_lists.push_back(import_list{term, docs[offset], offset + 1});
+        offset += size_t(1) + docs[offset];
+      }
+      if (!sizes || offset != docs_words || m_freqs.size() != m_docs.size() - 2 * sizeof(uint32_t)) {
+        std::cerr << "Could not read " << basename << ": the files don't agree\n";
+        return false;
+      }
+      return true;
+    }
+
+    const std::vector<import_list>& lists() const {
+      return m_lists;
+    }
+
+    const document_lengths& doc_lengths() const {
+      return m_lengths;
+    }
+
+    // Calls f(docid, f_dt) on each posting of a list
+    template <typename Function>
+    void decode(const import_list& list, Function f) const {
+      const uint32_t* docs = docs_data() + list.m_offset;
+      const uint32_t* freqs = reinterpret_cast<const uint32_t*>(m_freqs.data()) + list.m_offset - 2;
+      for (uint32_t i = 0; i < list.m_doc_freq; ++i) {
+        f(docs[i] + 1, freqs[i]);
+      }
+    }
+
+  private:
+    const uint32_t* docs_data() const {
+      return reinterpret_cast<const uint32_t*>(m_docs.data());
+    }
+
+    mapped_file m_docs;
+    mapped_file m_freqs;
+    std::vector<import_list> m_lists;
+    document_lengths m_lengths;
+};
+
+// Just enough of the protobuf wire format to read CIFF
+inline uint64_t get_varint(const uint8_t*& in) {
+  uint64_t value = 0;
+  for (size_t shift = 0; ; shift += 7) {
+    uint8_t byte = *in++;
+    value |= uint64_t(byte & 127) << shift;
+    if (byte < 128) {
+      return value;
+    }
+  }
+}
+
+// Reads the length of a delimited message, and returns where it ends
+inline const uint8_t* get_message_end(const uint8_t*& in) {
+  uint64_t bytes = get_varint(in);
+  return in + bytes;
+}
+
+// Skips the value of a field we don't want, given its wire type
+inline void skip_field(const uint8_t*& in, const uint64_t key) {
+  switch (key & 7) {
+    case 0: get_varint(in); break;
+    case 1: in += 8; break;
+    case 2: { uint64_t bytes = get_varint(in); in += bytes; break; }
+    case 5: in += 4; break;
+  }
+}
+
+// A CIFF file: a Header, then a PostingsList per term (d-gapped docids),
+// then a DocRecord per document
+class ciff_source {
+
+  public:
+    bool open(const std::string& filename) {
+      if (!m_file.open(filename)) {
+        return false;
+      }
+      const uint8_t* in = m_file.data();
+      const uint8_t* end = m_file.data() + m_file.size();
+
+      uint64_t num_lists = 0;
+      uint64_t num_docs = 0;
+      const uint8_t* message_end = get_message_end(in);
+      while (in < message_end) {
+        uint64_t key = get_varint(in);
+        if (key == (2 << 3)) {
+          num_lists = get_varint(in);
+        } else if (key == (3 << 3)) {
+          num_docs = get_varint(in);
+        } else {
+          skip_field(in, key);
+        }
+      }
+
+      // The term and f_t of each list come before its postings
+      for (uint64_t i = 0; i < num_lists && in < end; ++i) {
+        message_end = get_message_end(in);
+        import_list list{"", 0, size_t(in - m_file.data())};
+        while (in < message_end) {
+          uint64_t key = get_varint(in);
+          if (key == ((1 << 3) | 2)) {
+            uint64_t bytes = get_varint(in);
+            list.m_term.assign(reinterpret_cast<const char *>(in), bytes);
+            in += bytes;
+          } else if (key == (2 << 3)) {
+            list.m_doc_freq = get_varint(in);
+          } else {
+            break;
+          }
+        }
+        m_lists.push_back(list);
+        in = message_end;
+      }
+
+      std::vector<uint32_t> lengths(num_docs, 0);
+      for (uint64_t i = 0; i < num_docs && in < end; ++i) {
+        message_end = get_message_end(in);
+        uint64_t docid = 0;
+        uint64_t length = 0;
+        while (in < message_end) {
+          uint64_t key = get_varint(in);
+          if (key == (1 << 3)) {
+            docid = get_varint(in);
+          } else if (key == (3 << 3)) {
+            length = get_varint(in);
+          } else {
+            skip_field(in, key);
+          }
+        }
+        if (docid < num_docs) {
+          lengths[docid] = length;
+        }
+      }
+      if (in > end || m_lists.size() != num_lists) {
+        std::cerr << "Could not read " << filename << ": truncated\n";
+        return false;
+      }
+      for (uint64_t i = 0; i < num_docs; ++i) {
+        m_lengths.add(i + 1, lengths[i]);
+      }
+      return true;
+    }
+
+    const std::vector<import_list>& lists() const {
+      return m_lists;
+    }
+
+    const document_lengths& doc_lengths() const {
+      return m_lengths;
+    }
+
+    template <typename Function>
+    void decode(const import_list& list, Function f) const {
+      const uint8_t* in = m_file.data() + list.m_offset;
+      uint32_t docid = 0;
+      uint32_t decoded = 0;
+      while (decoded < list.m_doc_freq) {
+        uint64_t key = get_varint(in);
+        if (key != ((4 << 3) | 2)) {
+          skip_field(in, key);
+          continue;
+        }
+        const uint8_t* posting_end = get_message_end(in);
+        uint64_t gap = 0;
+        uint64_t freq = 0;
+        while (in < posting_end) {
+          uint64_t posting_key = get_varint(in);
+          if (posting_key == (1 << 3)) {
+            gap = get_varint(in);
+          } else if (posting_key == (2 << 3)) {
+            freq = get_varint(in);
+          } else {
+            skip_field(in, posting_key);
+          }
+        }
+        docid += gap;
+        f(docid + 1, uint32_t(freq));
+        decoded += 1;
+      }
+    }
+
+  private:
+    mapped_file m_file;
+    std::vector<import_list> m_lists;
+    document_lengths m_lengths;
+};
+
+// Writes a packed index to filename holding the lists of the source, with
+// a hash table of hash_slots entries (which must outnumber the terms) and
+// the given layout. Terms too long for a head block are left out, with a
+// warning
+template <typename Source>
+bool bulk_load(const Source& source, const std::string& filename, const size_t hash_slots, const size_t threads,
+               const block_layout& layout = block_layout()) {
+  std::vector<const import_list*> lists;
+  size_t skipped = 0;
+  for (const auto& list : source.lists()) {
+    if (!immediate_index::term_fits(list.m_term) || list.m_doc_freq == 0) {
+      skipped += 1;
+    } else {
+      lists.push_back(&list);
+    }
+  }
+  if (skipped > 0) {
+    std::cerr << "Skipping " << skipped << " empty lists or terms of " << HEAD_BYTES << " bytes or more\n";
+  }
+  if (hash_slots <= lists.size()) {
+    std::cerr << "The hash table needs more than " << lists.size() << " slots\n";
+    return false;
+  }
+
+  // Runs of about IMPORT_RUN_POSTINGS postings
+  std::vector<size_t> run_starts = split_runs(lists, IMPORT_RUN_POSTINGS, [](const import_list* list) {
+    return list->m_doc_freq;
+  });
+
+  int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "Could not open " << filename << " for writing\n";
+    return false;
+  }
+  const size_t block_offset = INDEX_HEADER_BYTES + sizeof(uint32_t) * hash_slots;
+  std::vector<uint32_t> term_offsets(hash_slots, END_CHAIN);
+  size_t total_blocks = 0;
+  std::atomic<bool> failed(false);
+
+  thread_pool pool(threads);
+  const size_t wave = pool.size() * IMPORT_RUNS_PER_THREAD;
+  const size_t num_runs = run_starts.size() - 1;
+  for (size_t first_run = 0; first_run < num_runs; first_run += wave) {
+    const size_t runs = std::min(wave, num_runs - first_run);
+    std::vector<immediate_index> built(runs);
+    std::vector<std::vector<packed_chain>> chains(runs);
+    std::vector<std::vector<uint32_t>> packed_offsets(runs);
+    std::vector<std::vector<std::string>> terms(runs);
+
+    // (1) Build each run, and measure its chains
+    for (size_t r = 0; r < runs; ++r) {
+      pool.submit([&, r](size_t) {
+        const size_t begin = run_starts[first_run + r];
+        const size_t end = run_starts[first_run + r + 1];
+        size_t run_postings = 0;
+        for (size_t i = begin; i < end; ++i) {
+          run_postings += lists[i]->m_doc_freq;
+        }
+        auto& index = built[r];
+        const size_t slots = HASH_VOCAB_SIZE * (end - begin) + 1;
+        index = immediate_index(end - begin + run_postings / 8 + IMPORT_SLACK_BLOCKS, slots, layout);
+        for (size_t i = begin; i < end; ++i) {
+          const std::string& term = lists[i]->m_term;
+          source.decode(*lists[i], [&](const uint32_t docid, const uint32_t freq) {
+            if (index.free_blocks() < IMPORT_SLACK_BLOCKS) {
+              index.reserve(2 * index.used_blocks() + IMPORT_SLACK_BLOCKS);
+            }
+            index.insert(docid, term, freq);
+          });
+        }
+        for (size_t slot = 0; slot < slots; ++slot) {
+          uint32_t head_idx = index.get_offset(slot);
+          chains[r].push_back(head_idx == END_CHAIN ? packed_chain{0, 0} : index.measure_chain(head_idx));
+        }
+        terms[r] = index.vocabulary();
+      });
+    }
+    pool.wait();
+
+    // (2) Place the lists, and enter them in the table; the terms of a run
+    // are in the order of its table
+    for (size_t r = 0; r < runs; ++r) {
+      packed_offsets[r].assign(chains[r].size(), END_CHAIN);
+      size_t next_term = 0;
+      for (size_t slot = 0; slot < chains[r].size(); ++slot) {
+        if (chains[r][slot].m_blocks == 0) {
+          continue;
+        }
+        packed_offsets[r][slot] = total_blocks;
+        total_blocks += chains[r][slot].m_blocks;
+        const std::string& term = terms[r][next_term++];
+        size_t entry = std::hash<std::string>{}(term) % hash_slots;
+        while (term_offsets[entry] != END_CHAIN) {
+          entry = (entry + 1) % hash_slots;
+        }
+        term_offsets[entry] = packed_offsets[r][slot];
+      }
+    }
+    if (total_blocks >= END_CHAIN) {
+      std::cerr << "Too many blocks for " << filename << "\n";
+      close(fd);
+      return false;
+    }
+
+    // (3) Write each run in place
+    for (size_t r = 0; r < runs; ++r) {
+      pool.submit([&, r](size_t) {
+        if (!built[r].write_packed_run(fd, block_offset, chains[r], packed_offsets[r], 0, chains[r].size())) {
+          failed = true;
+        }
+      });
+    }
+    pool.wait();
+  }
+
+  // (4) The header and table, then the document lengths and layout after
+  // the blocks
+  document_lengths lengths = source.doc_lengths();
+  std::ostringstream header;
+  write_index_header(header, total_blocks, hash_slots);
+  header.write(reinterpret_cast<const char *>(term_offsets.data()), sizeof(uint32_t) * hash_slots);
+  std::ostringstream lengths_out;
+  lengths.serialize(lengths_out);
+  layout.serialize(lengths_out);
+  const std::string header_bytes = header.str();
+  const std::string lengths_bytes = lengths_out.str();
+  if (failed ||
+      !write_at(fd, header_bytes.data(), header_bytes.size(), 0) ||
+      !write_at(fd, lengths_bytes.data(), lengths_bytes.size(), block_offset + total_blocks * BLOCK_SIZE)) {
+    std::cerr << "Could not write " << filename << "\n";
+    close(fd);
+    return false;
+  }
+  return close(fd) == 0;
+}
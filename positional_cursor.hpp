@@ -0,0 +1,244 @@
+#pragma once
+
+#include "util.hpp"
+#include "compress.hpp"
+#include "query.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#else
+#include "immediate_index.hpp"
+#endif
+
+// Where we are in a positional postings list. insert_positions writes one
+// record per position, Double-VByte coded as <w-gap, d-gap>, where the
+// d-gap is taken from (the previous docid - 1) so that it is 1 for the
+// next position in the same document. A non-head block instead begins
+// with a plain vbyte b-gap and then a vbyte w-gap; the b-gap is the first
+// docid for the second block, and (first docid - previous first + 1)
+// after that, since a document may continue into the next block
+struct positional_state {
+  uint32_t m_block;
+  size_t m_offset;
+  uint32_t m_chain_position;
+  uint32_t m_block_first_docid; // first docid in the current (non-head) block
+  uint32_t m_recent_docid;      // the d-gaps are taken from this
+};
+
+// A cursor over a postings list written by insert_positions. It moves a
+// document at a time, counting the positions of each document as it goes
+// but not keeping them; positions() goes back and decodes them only for
+// the documents which are asked about
+class positional_cursor {
+
+ public:
+  positional_cursor(immediate_index& index, std::string term) :
+                                            m_index(index),
+                                            m_term(term),
+                                            m_head_block(END_CHAIN),
+                                            m_tail_block(END_CHAIN),
+                                            m_doc_freq(END_CHAIN),
+                                            m_current_docid(END_CHAIN),
+                                            m_current_freq(0),
+                                            m_next_docid(END_CHAIN),
+                                            m_positions_docid(END_CHAIN) {
+
+    // Find the entry location in the hash table
+    uint32_t entry_hash = m_index.found_or_empty_offset(term);
+    m_head_block = m_index.get_offset(entry_hash);
+    if (m_head_block == END_CHAIN) {
+      std::cerr << "Warning: Could not find term [" << term << "]\n";
+    } else {
+      m_tail_block = m_index.tail_block(m_head_block);
+      m_doc_freq = m_index.doc_freq(m_head_block);
+      reset();
+    }
+  }
+
+  // Valid cursors head blocks are indexes
+  bool valid() const {
+    return m_head_block != END_CHAIN;
+  }
+
+  uint32_t doc_freq() const {
+    return m_doc_freq;
+  }
+
+  uint32_t docid() const {
+    return m_current_docid;
+  }
+
+  // The number of positions in the current document
+  uint32_t freq() const {
+    return m_current_freq;
+  }
+
+  std::string term() const {
+    return m_term;
+  }
+
+  // Moves to the first document
+  void reset() {
+    m_state = {m_head_block, m_index.head_data_offset(m_head_block), 0, 0, 0};
+    m_positions_docid = END_CHAIN;
+    m_next_start = m_state;
+    if (!read_record(m_state, m_next_docid)) {
+      m_next_docid = END_CHAIN;
+    }
+    next();
+  }
+
+  // Moves to the next document. We always hold the first record of the
+  // next document, since we have to read it to know this one has ended
+  void next() {
+    m_current_docid = m_next_docid;
+    m_current_freq = 0;
+    if (m_current_docid == END_CHAIN) {
+      return;
+    }
+    m_current_start = m_next_start;
+    do {
+      m_current_freq += 1;
+      m_next_start = m_state;
+      if (!read_record(m_state, m_next_docid)) {
+        m_next_docid = END_CHAIN;
+        break;
+      }
+    } while (m_next_docid == m_current_docid);
+  }
+
+  // Find the first document >= docid. Blocks are skipped on their b-gaps
+  // while the next block starts before the target; a block which starts
+  // on the target may be continuing it, so we don't jump to that one
+  void next_geq(uint32_t target_docid) {
+
+    if (target_docid <= m_current_docid) {
+      return;
+    }
+
+    // m_state is just past the first record of the next document
+    bool skipped = false;
+    uint32_t next_block = m_index.next_block(m_state.m_block, m_tail_block);
+    while (next_block != END_CHAIN) {
+      uint32_t next_first = block_first_docid(next_block, m_state.m_chain_position + 1, m_state.m_block_first_docid);
+      if (next_first >= target_docid) {
+        break;
+      }
+      m_state.m_block = next_block;
+      m_state.m_chain_position += 1;
+      m_state.m_block_first_docid = next_first;
+      m_state.m_offset = TT_PL_OFFSET;
+      skipped = true;
+      next_block = m_index.next_block(next_block, m_tail_block);
+    }
+
+    if (skipped) {
+      // Start again from the first record of the block, which may be part
+      // way through a document, but that one is before the target anyway
+      m_next_start = m_state;
+      read_record(m_state, m_next_docid);
+      next();
+    }
+
+    while (m_current_docid < target_docid) {
+      next();
+    }
+  }
+
+  // The positions of the current document, which are decoded on demand
+  const std::vector<uint32_t>& positions() {
+    if (m_positions_docid != m_current_docid) {
+      m_positions.clear();
+      positional_state state = m_current_start;
+      uint32_t docid = 0;
+      uint32_t wgap = 0;
+      uint32_t position = 0;
+      for (uint32_t i = 0; i < m_current_freq; ++i) {
+        read_record(state, docid, wgap);
+        position += wgap;
+        m_positions.push_back(position);
+      }
+      m_positions_docid = m_current_docid;
+    }
+    return m_positions;
+  }
+
+ private:
+  // The first docid of a block, from its b-gap
+  uint32_t block_first_docid(uint32_t block, uint32_t chain_position, uint32_t prev_first_docid) {
+    size_t offset = TT_PL_OFFSET;
+    uint32_t b_gap = m_index.access_vbyte(block, offset);
+    if (chain_position == 1) {
+      return b_gap;
+    }
+    return prev_first_docid + b_gap - 1;
+  }
+
+  // Decodes the record at the state into a docid and w-gap, and moves the
+  // state on. Returns false at the end of the list
+  bool read_record(positional_state& state, uint32_t& docid) {
+    uint32_t wgap = 0;
+    return read_record(state, docid, wgap);
+  }
+
+  bool read_record(positional_state& state, uint32_t& docid, uint32_t& wgap) {
+    if (state.m_offset >= m_index.block_bytes(state.m_chain_position) ||
+        !m_index.has_data(state.m_block, state.m_offset)) {
+      uint32_t next_block = m_index.next_block(state.m_block, m_tail_block);
+      if (next_block == END_CHAIN) {
+        return false;
+      }
+      state.m_block_first_docid = block_first_docid(next_block, state.m_chain_position + 1, state.m_block_first_docid);
+      state.m_block = next_block;
+      state.m_chain_position += 1;
+      state.m_offset = TT_PL_OFFSET;
+    }
+
+    if (state.m_chain_position > 0 && state.m_offset == TT_PL_OFFSET) {
+      // This is a new block, so we have a b-gap and a w-gap
+      m_index.access_vbyte(state.m_block, state.m_offset);
+      wgap = m_index.access_vbyte(state.m_block, state.m_offset);
+      docid = state.m_block_first_docid;
+    } else {
+      // The "backwards" pair: the w-gap is first
+      auto data = m_index.access(state.m_block, state.m_offset);
+      wgap = data.first;
+      docid = state.m_recent_docid + data.second;
+    }
+    state.m_recent_docid = docid - 1;
+    return true;
+  }
+
+  // Cursor members
+  private:
+    immediate_index& m_index;
+    std::string m_term;
+    uint32_t m_head_block;
+    uint32_t m_tail_block;
+    uint32_t m_doc_freq;
+    positional_state m_state;         // just past the first record of the next document
+    uint32_t m_current_docid;
+    uint32_t m_current_freq;
+    positional_state m_current_start; // at the first record of the current document
+    uint32_t m_next_docid;
+    positional_state m_next_start;    // at the first record of the next document
+    uint32_t m_positions_docid;       // the document m_positions belongs to
+    std::vector<uint32_t> m_positions;
+};
+
+// Given an index and a query, return a vector of positional cursors into
+// the index, one per query term and in query order
+std::vector<positional_cursor>
+query_to_positional_cursors(immediate_index& index, query in_query) {
+
+  std::vector<positional_cursor> cursors;
+  for (auto term : in_query.m_terms) {
+    auto cursor = positional_cursor(index, term);
+    if (!cursor.valid()) {
+      // A phrase can't match without every term
+      return std::vector<positional_cursor>();
+    }
+    cursors.push_back(cursor);
+  }
+  return cursors;
+}
@@ -17,11 +17,15 @@ class postings_cursor {
                                             m_head_block(END_CHAIN),
                                             m_tail_block(END_CHAIN), 
                                             m_doc_freq(END_CHAIN),
+                                            m_max_freq(0),
                                             m_current_block(END_CHAIN), 
                                             m_current_offset(END_CHAIN),
                                             m_gap_accumulator(0), 
                                             m_current_docid(0),
-                                            m_current_tf(0) {
+                                            m_current_tf(0),
+                                            m_shallow_block(END_CHAIN),
+                                            m_shallow_first_docid(0),
+                                            m_shallow_next_docid(END_CHAIN) {
     
     // Find the entry location in the hash table
     uint32_t entry_hash = m_index.found_or_empty_offset(term);
@@ -32,7 +36,10 @@ class postings_cursor {
       m_head_block = m_current_block;
       m_tail_block = m_index.tail_block(m_current_block);
       m_doc_freq = m_index.doc_freq(m_current_block);
+      m_max_freq = m_index.max_freq(m_current_block);
       m_current_offset = m_index.head_data_offset(m_current_block);
+      m_shallow_block = m_head_block;
+      m_shallow_next_docid = peek_next_block(m_shallow_block, m_shallow_first_docid);
       this->next();
     }
   }
@@ -46,6 +53,17 @@ class postings_cursor {
     return m_doc_freq;
   }
 
+  // Overrides f_t; a list from one segment of a segmented index is
+  // weighted by the f_t of the whole collection
+  void set_doc_freq(const uint32_t doc_freq) {
+    m_doc_freq = doc_freq;
+  }
+
+  // The largest f_dt in the list
+  uint32_t max_freq() const {
+    return m_max_freq;
+  }
+
   uint32_t docid() const {
     return m_current_docid; 
   }
@@ -95,6 +113,21 @@ class postings_cursor {
     }
   }
 
+  // Decodes the current posting and the rest of its block into the
+  // buffers, leaving the cursor on the first posting of the next block.
+  // Returns the number of postings decoded (0 once the list is exhausted)
+  size_t decode_block(std::vector<uint32_t>& docids, std::vector<uint32_t>& freqs) {
+    docids.clear();
+    freqs.clear();
+    uint32_t block = m_current_block;
+    while (m_current_block == block && m_current_docid != END_CHAIN) {
+      docids.push_back(m_current_docid);
+      freqs.push_back(m_current_tf);
+      next();
+    }
+    return docids.size();
+  }
+
   // Within-block next_geq; walks the block
   void advance_to_id(uint32_t target_docid) {
     while (m_current_docid < target_docid) {
@@ -131,6 +164,12 @@ class postings_cursor {
 
     // We've overran the document and now need to backtrack by one block
     if (current_docid > target_docid || current_block == END_CHAIN) {
+      // The target is in the block we are already in, so there is no need
+      // to re-decode it from the start; just walk on from here
+      if (prev_block == m_current_block) {
+        advance_to_id(target_docid);
+        return;
+      }
       m_current_block = prev_block;
       m_gap_accumulator = prev_docid;
       m_current_docid = prev_docid;
@@ -163,6 +202,50 @@ class postings_cursor {
     advance_to_id(target_docid);
   }
 
+  // The block-max functions below work on a "shallow" pointer which
+  // moves over the blocks of the list peeking only at their first docid,
+  // so block maxima can be checked without decoding any postings
+
+  // Moves the shallow pointer to the block which would contain target_docid
+  void block_max_next_geq(uint32_t target_docid) {
+    // The shallow pointer should never lag behind the cursor itself
+    if (m_current_block != END_CHAIN &&
+        (m_gap_accumulator > m_shallow_first_docid || target_docid < m_shallow_first_docid)) {
+      m_shallow_block = m_current_block;
+      m_shallow_first_docid = m_gap_accumulator;
+      m_shallow_next_docid = peek_next_block(m_shallow_block, m_shallow_first_docid);
+    }
+    while (m_shallow_next_docid <= target_docid) {
+      m_shallow_block = m_index.next_block(m_shallow_block, m_tail_block);
+      m_shallow_first_docid = m_shallow_next_docid;
+      m_shallow_next_docid = peek_next_block(m_shallow_block, m_shallow_first_docid);
+    }
+  }
+
+  // The largest f_dt in the block under the shallow pointer
+  uint32_t block_max_freq() const {
+    return m_index.block_max_freq(m_shallow_block, m_head_block);
+  }
+
+  // The last docid that could be in the block under the shallow pointer
+  uint32_t block_max_docid() const {
+    if (m_shallow_next_docid == END_CHAIN) {
+      return END_CHAIN;
+    }
+    return m_shallow_next_docid - 1;
+  }
+
+ private:
+  // Returns the first docid of the block after the given one
+  uint32_t peek_next_block(uint32_t block, uint32_t first_docid) {
+    uint32_t next_block = m_index.next_block(block, m_tail_block);
+    if (next_block == END_CHAIN) {
+      return END_CHAIN;
+    }
+    size_t offset = TT_PL_OFFSET;
+    return first_docid + m_index.access(next_block, offset).first;
+  }
+
   // Cursor members 
   private:
     immediate_index& m_index;
@@ -170,11 +253,15 @@ class postings_cursor {
     uint32_t m_head_block;
     uint32_t m_tail_block;
     uint32_t m_doc_freq;
+    uint32_t m_max_freq;
     uint32_t m_current_block;
     size_t m_current_offset;
     uint32_t m_gap_accumulator;
     uint32_t m_current_docid;
     uint32_t m_current_tf;
+    uint32_t m_shallow_block;
+    uint32_t m_shallow_first_docid;
+    uint32_t m_shallow_next_docid;
 };
 
 // Given an index and a query, return a vector of cursors into the index
@@ -11,6 +11,8 @@ struct query {
     std::copy(terms.begin(), terms.end(), std::back_inserter(m_terms));
   }
 
+  query(std::string id, std::vector<std::string>& terms) : m_id(id), m_terms(terms) {}
+
 };
 
 // Read queries formatted like <qid> <t1> <t2> ...
@@ -40,3 +42,44 @@ std::vector<query> read_queries(std::ifstream &in) {
 
   return all_queries;
 }
+
+// As above, but the terms are kept in order and duplicates are kept, as
+// is needed for phrases
+std::vector<query> read_ordered_queries(std::ifstream &in) {
+
+  size_t tcount = 0;
+  std::vector<query> all_queries;
+  std::string line;
+
+  while (std::getline(in, line)) {
+
+    std::istringstream line_data(line);
+    std::vector<std::string> terms;
+    std::string qid;
+    // Eat the first string into the identifier
+    line_data >> qid;
+    std::string term;
+    while (line_data >> term) {
+      terms.push_back(term);
+    }
+    tcount += terms.size();
+    all_queries.emplace_back(qid, terms);
+  }
+
+  std::cerr << "Info: Read " << all_queries.size()
+            << " queries, average length of " << (double) tcount / all_queries.size() << "\n";
+
+  return all_queries;
+}
+
+// The distinct terms of a query log (in the format above), for warming
+// up the lists that the queries are likely to need
+std::vector<std::string> query_log_terms(std::ifstream &in) {
+  std::vector<std::string> terms;
+  for (const auto& logged : read_queries(in)) {
+    terms.insert(terms.end(), logged.m_terms.begin(), logged.m_terms.end());
+  }
+  std::sort(terms.begin(), terms.end());
+  terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+  return terms;
+}
@@ -1,22 +1,85 @@
 #pragma once
 
+#include <atomic>
+
 #ifdef VARIABLE_BLOCK
 #include "variable_postings_cursor.hpp"
 #else
 #include "postings_cursor.hpp"
 #endif
+#include "reverse_postings_cursor.hpp"
+#include "positional_cursor.hpp"
 
+#include "intersection_kernels.hpp"
 #include "ranking.hpp"
 #include "topk_queue.hpp"
 #include "query.hpp"
 
+// The heap threshold shared by the ranges of a query which is being run in
+// parallel: the highest threshold of any of their (full) heaps. The final
+// top-k can't contain anything scoring below it
+class shared_threshold {
+
+  public:
+    shared_threshold() : m_value(0.0f) {}
+
+    float get() const {
+      return m_value.load(std::memory_order_relaxed);
+    }
+
+    // Raises the threshold (it never comes back down)
+    void raise(const float threshold) {
+      float current = get();
+      while (threshold > current && !m_value.compare_exchange_weak(current, threshold, std::memory_order_relaxed)) {}
+    }
+
+  private:
+    std::atomic<float> m_value;
+};
+
+// A slice [m_begin, m_end) of the docid space, for splitting one query over
+// several threads. By default a query runs over every docid. Each range
+// has its own heap, but when a shared threshold is given, candidates are
+// also pruned against the best threshold of all of the ranges
+struct docid_range {
+  uint32_t m_begin = 0;
+  uint32_t m_end = END_CHAIN;
+  shared_threshold* m_threshold = nullptr;
+
+  // Moves the cursors up to the start of the range
+  template <typename Cursor>
+  void seek(std::vector<Cursor>& cursors) const {
+    if (m_begin > 0) {
+      for (auto& cursor : cursors) {
+        cursor.next_geq(m_begin);
+      }
+    }
+  }
+
+  bool would_enter(const topk_queue& results, const float score) const {
+    return results.would_enter(score) && (m_threshold == nullptr || score > m_threshold->get());
+  }
+
+  // Inserts into the heap, and passes on the threshold once the heap is full
+  bool insert(topk_queue& results, const float score, const uint32_t docid) const {
+    if (!would_enter(results, score) || !results.insert(score, docid)) {
+      return false;
+    }
+    if (m_threshold != nullptr && results.size() == results.capacity()) {
+      m_threshold->raise(results.threshold());
+    }
+    return true;
+  }
+};
+
 // Inspired by PISA's implementations
 //
-size_t boolean_conjunction(std::vector<postings_cursor>& cursors) {
+size_t boolean_conjunction(std::vector<postings_cursor>& cursors, const docid_range& range = docid_range()) {
 
   if (cursors.size() == 0) {
     return 0;
   }
+  range.seek(cursors);
 
   std::vector<uint32_t> results;
 
@@ -34,7 +97,7 @@ size_t boolean_conjunction(std::vector<postings_cursor>& cursors) {
   uint32_t candidate = ordered_cursors[0]->docid();
   size_t i = 1;
   
-  while (candidate != END_CHAIN) {
+  while (candidate < range.m_end) {
     for(; i < ordered_cursors.size(); ++i) {
       ordered_cursors[i]->next_geq(candidate);
       
@@ -56,14 +119,362 @@ size_t boolean_conjunction(std::vector<postings_cursor>& cursors) {
   return results.size();
 }
 
-size_t profile_boolean_conjunction(std::vector<postings_cursor>& cursors) {
+// Adaptive conjunctions: rather than always driving the intersection from
+// the shortest list, pick the strategy from the df ratios of the query:
+//  - merge: lists of similar length are walked in step with next(), since
+//    they will mostly be decoded anyway and next_geq only adds overhead;
+//  - gallop: the PISA-style pivot, where the shortest list proposes a
+//    candidate and every other list jumps to it with next_geq, skipping
+//    whole blocks on the b-gaps; on a miss the pivot leaps to the docid
+//    which disproved the candidate;
+//  - decode_and_probe (SvS): the short lists are decoded a block at a
+//    time and intersected with the SIMD kernels, then each long list in
+//    turn is probed with the survivors, so a list is only touched while
+//    candidates remain.
+// The costs are rough estimates in units of "postings decoded"
+enum class conjunction_strategy { merge, gallop, decode_and_probe };
+
+// Lists within this ratio of the shortest are treated as "short"
+const double SHORT_LIST_RATIO = 4.0;
+// The cost of a next_geq (decoding into the target block) relative to
+// decoding one posting, and the (rough) number of postings in a block
+const double PROBE_COST = 16.0;
+const double POSTINGS_PER_BLOCK = 32.0;
+// The cost of a posting intersected by the block kernels
+const double KERNEL_COST = 0.75;
+
+struct conjunction_plan {
+  conjunction_strategy m_strategy;
+  double m_merge_cost;
+  double m_gallop_cost;
+  double m_probe_cost;
+  size_t m_short_lists; // how many lists decode_and_probe decodes up front
+};
+
+std::string strategy_name(const conjunction_strategy strategy) {
+  switch (strategy) {
+    case conjunction_strategy::merge: return "merge";
+    case conjunction_strategy::gallop: return "gallop";
+    case conjunction_strategy::decode_and_probe: return "decode_and_probe";
+  }
+  return "unknown";
+}
+
+// Estimates the cost of each strategy; the cursors must be ordered short
+// to long. num_docs is used to guess how many candidates survive each list
+// (assuming independence), or 0 if unknown, in which case none are pruned
+conjunction_plan plan_conjunction(const std::vector<postings_cursor*>& ordered_cursors, const size_t num_docs) {
+
+  conjunction_plan plan{conjunction_strategy::gallop, 0, 0, 0, 1};
+  double shortest = ordered_cursors[0]->doc_freq();
+
+  // A probe costs the blocks walked (each one a b-gap read) plus the
+  // decode within the target block; it can never cost more than the list
+  auto probe = [](double candidates, double df) {
+    return std::min(df, candidates * PROBE_COST + df / POSTINGS_PER_BLOCK);
+  };
+  auto survive = [num_docs](double candidates, double df) {
+    return num_docs == 0 ? candidates : candidates * std::min(1.0, df / num_docs);
+  };
+
+  // merge decodes everything
+  for (auto cursor : ordered_cursors) {
+    plan.m_merge_cost += cursor->doc_freq();
+  }
+
+  // gallop decodes the shortest and probes the rest in order for each candidate
+  double candidates = shortest;
+  plan.m_gallop_cost = shortest;
+  for (size_t i = 1; i < ordered_cursors.size(); ++i) {
+    plan.m_gallop_cost += probe(candidates, ordered_cursors[i]->doc_freq());
+    candidates = survive(candidates, ordered_cursors[i]->doc_freq());
+  }
+
+  // decode_and_probe decodes the short lists and intersects them with the
+  // block kernels, which is cheaper than walking them in step, then probes
+  // the long lists with what is left
+  candidates = shortest;
+  plan.m_probe_cost = shortest;
+  size_t i = 1;
+  while (i < ordered_cursors.size() && ordered_cursors[i]->doc_freq() <= shortest * SHORT_LIST_RATIO) {
+    plan.m_probe_cost += KERNEL_COST * ordered_cursors[i]->doc_freq();
+    candidates = survive(candidates, ordered_cursors[i]->doc_freq());
+    ++i;
+  }
+  plan.m_short_lists = i;
+  for (; i < ordered_cursors.size(); ++i) {
+    plan.m_probe_cost += probe(candidates, ordered_cursors[i]->doc_freq());
+    candidates = survive(candidates, ordered_cursors[i]->doc_freq());
+  }
+
+  if (plan.m_merge_cost <= plan.m_gallop_cost && plan.m_merge_cost <= plan.m_probe_cost) {
+    plan.m_strategy = conjunction_strategy::merge;
+  } else if (plan.m_probe_cost < plan.m_gallop_cost) {
+    plan.m_strategy = conjunction_strategy::decode_and_probe;
+  }
+  return plan;
+}
+
+// Walks all of the lists in step; each list moves forward one posting at
+// a time, so no b-gaps are read and nothing is decoded twice
+size_t merge_conjunction(std::vector<postings_cursor*>& ordered_cursors) {
+
+  size_t results = 0;
+  uint32_t candidate = ordered_cursors[0]->docid();
+  size_t i = 1;
+
+  while (candidate != END_CHAIN) {
+    for (; i < ordered_cursors.size(); ++i) {
+      ordered_cursors[i]->advance_to_id(candidate);
+      if (ordered_cursors[i]->docid() != candidate) {
+        candidate = ordered_cursors[i]->docid();
+        break;
+      }
+    }
+
+    if (i == ordered_cursors.size()) {
+      results += 1;
+      ordered_cursors[0]->next();
+    } else if (candidate == END_CHAIN) {
+      break;
+    } else {
+      ordered_cursors[0]->advance_to_id(candidate);
+    }
+    candidate = ordered_cursors[0]->docid();
+    i = 1;
+  }
+  return results;
+}
+
+// The pivot loop, leaping to whichever docid disproves the candidate
+size_t gallop_conjunction(std::vector<postings_cursor*>& ordered_cursors) {
+
+  size_t results = 0;
+  uint32_t candidate = ordered_cursors[0]->docid();
+  size_t i = 1;
+
+  while (candidate != END_CHAIN) {
+    for (; i < ordered_cursors.size(); ++i) {
+      ordered_cursors[i]->next_geq(candidate);
+      if (ordered_cursors[i]->docid() != candidate) {
+        candidate = ordered_cursors[i]->docid();
+        break;
+      }
+    }
+
+    if (i == ordered_cursors.size()) {
+      results += 1;
+      ordered_cursors[0]->next();
+    } else if (candidate == END_CHAIN) {
+      break;
+    } else {
+      ordered_cursors[0]->next_geq(candidate);
+    }
+    candidate = ordered_cursors[0]->docid();
+    i = 1;
+  }
+  return results;
+}
+
+// Below this many candidates, the block kernels cost more than they save
+const size_t MIN_KERNEL_CANDIDATES = 256;
+
+// Scratch space for intersecting the candidates with decoded blocks
+struct block_buffers {
+  std::vector<uint32_t> m_docids;
+  std::vector<uint32_t> m_freqs;
+  std::vector<uint32_t> m_matches;
+};
+
+// Filters the (sorted) candidates through a list, a block at a time:
+// each block which may hold a candidate is decoded whole and intersected
+// with the candidates by the kernels, and the blocks in between are
+// skipped with next_geq
+void block_intersect(std::vector<uint32_t>& candidates, postings_cursor* cursor, block_buffers& buffers) {
+
+  buffers.m_matches.resize(candidates.size() + INTERSECT_PADDING);
+  size_t kept = 0;
+  size_t c = 0;
+  while (c < candidates.size()) {
+    cursor->next_geq(candidates[c]);
+    if (cursor->docid() == END_CHAIN) {
+      break;
+    }
+    cursor->decode_block(buffers.m_docids, buffers.m_freqs);
+    // The candidates which can only be in this block
+    size_t end = std::upper_bound(candidates.begin() + c, candidates.end(), buffers.m_docids.back()) - candidates.begin();
+    kept += intersect(candidates.data() + c, end - c, buffers.m_docids.data(), buffers.m_docids.size(),
+                      buffers.m_matches.data() + kept);
+    c = end;
+  }
+  buffers.m_matches.resize(kept);
+  candidates.swap(buffers.m_matches);
+}
+
+// Ranked conjunctions gather this many candidates from their shortest list
+// (or cached pair) and then filter them through the other lists together,
+// with the fused kernels; the heap's threshold is brought up to date
+// between batches
+const size_t RANKED_BATCH = 256;
+// ... but only when every list is within this ratio of the shortest, as
+// otherwise probing a candidate at a time (with its bounds) costs less
+const double BATCH_LIST_RATIO = 2.0;
+
+// Whether to batch, given the number of candidates and the longest list
+// they are filtered through
+bool batch_pays(const size_t candidates, const size_t longest) {
+  return candidates >= MIN_KERNEL_CANDIDATES && longest <= BATCH_LIST_RATIO * candidates;
+}
+
+// A list which batches of candidates are filtered through. decode_block
+// leaves the cursor past the block it decodes, and the next batch may
+// start inside that block, so the block is kept. The blocks are decoded
+// with a copy of the list's cursor: the block bounds of the candidates
+// still to be gathered come from the shallow pointer of the list's own
+// cursor, which mustn't be pulled ahead of them
+struct batch_list {
+  postings_cursor m_cursor;
+  std::vector<uint32_t> m_docids;
+  std::vector<uint32_t> m_freqs;
+
+  explicit batch_list(const postings_cursor& cursor) : m_cursor(cursor) {}
+};
+
+// The candidates of a batch, and a row of freqs for each (one per list,
+// in the order of the query's cursors) which the lists fill in as they
+// are intersected. m_rows[c] is the row of m_docids[c]
+struct candidate_batch {
+  size_t m_lists;
+  std::vector<uint32_t> m_docids;
+  std::vector<uint32_t> m_rows;
+  std::vector<uint32_t> m_freqs;
+  // Scratch space for the kernels
+  std::vector<uint32_t> m_kept_docids;
+  std::vector<uint32_t> m_kept_rows;
+  std::vector<uint32_t> m_kept_freqs;
+
+  explicit candidate_batch(const size_t lists) : m_lists(lists) {}
+
+  void clear() {
+    m_docids.clear();
+    m_rows.clear();
+    m_freqs.clear();
+  }
+
+  size_t size() const {
+    return m_docids.size();
+  }
+
+  // Adds a candidate, returning its row of freqs
+  uint32_t* add(const uint32_t docid) {
+    m_rows.push_back(m_docids.size());
+    m_docids.push_back(docid);
+    m_freqs.resize(m_freqs.size() + m_lists);
+    return m_freqs.data() + m_freqs.size() - m_lists;
+  }
+
+  const uint32_t* freqs(const size_t c) const {
+    return m_freqs.data() + m_rows[c] * m_lists;
+  }
+};
+
+// Filters a batch through a list as block_intersect does, but with the
+// fused kernel: the row numbers ride along as the candidates' freqs, so
+// the survivors come out with their rows and their freqs in this list,
+// which go to column `column` of their rows
+void batch_intersect(candidate_batch& batch, batch_list& list, const size_t column) {
+
+  const size_t padded = batch.size() + INTERSECT_PADDING;
+  batch.m_kept_docids.resize(padded);
+  batch.m_kept_rows.resize(padded);
+  batch.m_kept_freqs.resize(padded);
+  size_t kept = 0;
+  size_t c = 0;
+  while (c < batch.size()) {
+    if (list.m_docids.empty() || list.m_docids.back() < batch.m_docids[c]) {
+      list.m_cursor.next_geq(batch.m_docids[c]);
+      if (list.m_cursor.docid() == END_CHAIN) {
+        break;
+      }
+      list.m_cursor.decode_block(list.m_docids, list.m_freqs);
+    }
+    // The candidates which can only be in this block, and the part of the
+    // block they can be in
+    size_t end = std::upper_bound(batch.m_docids.begin() + c, batch.m_docids.end(), list.m_docids.back()) -
+                 batch.m_docids.begin();
+    size_t start = std::lower_bound(list.m_docids.begin(), list.m_docids.end(), batch.m_docids[c]) -
+                   list.m_docids.begin();
+    kept += intersect_with_freqs(batch.m_docids.data() + c, batch.m_rows.data() + c, end - c,
+                                 list.m_docids.data() + start, list.m_freqs.data() + start,
+                                 list.m_docids.size() - start,
+                                 batch.m_kept_docids.data() + kept, batch.m_kept_rows.data() + kept,
+                                 batch.m_kept_freqs.data() + kept);
+    c = end;
+  }
+  for (size_t k = 0; k < kept; ++k) {
+    batch.m_freqs[batch.m_kept_rows[k] * batch.m_lists + column] = batch.m_kept_freqs[k];
+  }
+  batch.m_kept_docids.resize(kept);
+  batch.m_kept_rows.resize(kept);
+  batch.m_docids.swap(batch.m_kept_docids);
+  batch.m_rows.swap(batch.m_kept_rows);
+}
+
+// Decodes the first short_lists lists and intersects them a block at a
+// time with the kernels, then filters the survivors through each of the
+// long lists in turn with next_geq (SvS)
+size_t decode_and_probe_conjunction(std::vector<postings_cursor*>& ordered_cursors, const size_t short_lists) {
+
+  std::vector<uint32_t> candidates;
+  candidates.reserve(ordered_cursors[0]->doc_freq());
+  while (ordered_cursors[0]->docid() != END_CHAIN) {
+    candidates.push_back(ordered_cursors[0]->docid());
+    ordered_cursors[0]->next();
+  }
+
+  block_buffers buffers;
+  for (size_t i = 1; i < short_lists && !candidates.empty(); ++i) {
+    if (candidates.size() >= MIN_KERNEL_CANDIDATES) {
+      block_intersect(candidates, ordered_cursors[i], buffers);
+      continue;
+    }
+    // Too few to be worth decoding whole blocks, so just merge
+    auto cursor = ordered_cursors[i];
+    size_t kept = 0;
+    for (size_t c = 0; c < candidates.size(); ++c) {
+      cursor->advance_to_id(candidates[c]);
+      if (cursor->docid() == candidates[c]) {
+        candidates[kept++] = candidates[c];
+      }
+    }
+    candidates.resize(kept);
+  }
+
+  for (size_t i = short_lists; i < ordered_cursors.size() && !candidates.empty(); ++i) {
+    auto cursor = ordered_cursors[i];
+    size_t kept = 0;
+    for (size_t c = 0; c < candidates.size(); ++c) {
+      cursor->next_geq(candidates[c]);
+      if (cursor->docid() == END_CHAIN) {
+        break;
+      }
+      if (cursor->docid() == candidates[c]) {
+        candidates[kept++] = candidates[c];
+      }
+    }
+    candidates.resize(kept);
+  }
+  return candidates.size();
+}
+
+// Plans the conjunction, then runs the chosen strategy. If profile is set,
+// the plan is printed along with the terms
+size_t adaptive_conjunction(std::vector<postings_cursor>& cursors, const size_t num_docs, const bool profile = false) {
 
   if (cursors.size() == 0) {
     return 0;
   }
 
-  std::vector<uint32_t> results;
-
   std::vector<postings_cursor*> ordered_cursors;
   ordered_cursors.reserve(cursors.size());
   for (auto& curs : cursors) {
@@ -75,47 +486,376 @@ size_t profile_boolean_conjunction(std::vector<postings_cursor>& cursors) {
     return l->doc_freq() < r->doc_freq();
   });
 
+  auto plan = plan_conjunction(ordered_cursors, num_docs);
+
+  size_t results = 0;
+  switch (plan.m_strategy) {
+    case conjunction_strategy::merge:
+      results = merge_conjunction(ordered_cursors);
+      break;
+    case conjunction_strategy::gallop:
+      results = gallop_conjunction(ordered_cursors);
+      break;
+    case conjunction_strategy::decode_and_probe:
+      results = decode_and_probe_conjunction(ordered_cursors, plan.m_short_lists);
+      break;
+  }
+
+  if (profile) {
+    std::cout << "------\n";
+    for (size_t i = 0; i < ordered_cursors.size(); ++i) {
+      std::cout << "[" << i << "] -> " << ordered_cursors[i]->term() << "  df= " << ordered_cursors[i]->doc_freq() << "\n";
+    }
+    std::cout << "strategy= " << strategy_name(plan.m_strategy)
+              << "  cost(merge)= " << plan.m_merge_cost
+              << "  cost(gallop)= " << plan.m_gallop_cost
+              << "  cost(decode_and_probe)= " << plan.m_probe_cost
+              << "  short_lists= " << plan.m_short_lists
+              << "  matches= " << results << "\n";
+  }
+  return results;
+}
+
+
+// Top-k over a conjunction: only documents containing every term are
+// scored. The lists are intersected short to long as in gallop, and two
+// kinds of upper bounds are used to avoid work once the heap is full:
+// the block-max bounds of every list (which let us skip the shortest list
+// forward past whole blocks at once), and, while probing a candidate, the
+// score so far plus the bounds of the lists not yet probed
+template <typename Ranker>
+size_t ranked_conjunction(std::vector<postings_cursor>& cursors, Ranker& ranker, topk_queue& results,
+                          const docid_range& range = docid_range()) {
+
+  if (cursors.size() == 0) {
+    return 0;
+  }
+  range.seek(cursors);
+
+  // As in maxscore_disjunction, the final score is summed in the order of
+  // `cursors` so that it matches ranked_disjunction bit-for-bit
+  std::vector<size_t> ordered_lists(cursors.size());
+  std::iota(ordered_lists.begin(), ordered_lists.end(), 0);
+  std::vector<float> idf_weights(cursors.size());
+  float list_bound = 0;
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    idf_weights[i] = ranker.idf_weight(cursors[i].doc_freq());
+    list_bound += ranker.term_weight_bound(cursors[i].max_freq()) * idf_weights[i];
+  }
+
+  // Order short to long
+  std::sort(ordered_lists.begin(), ordered_lists.end(), [&](size_t l, size_t r) {
+    return cursors[l].doc_freq() < cursors[r].doc_freq();
+  });
+  std::vector<postings_cursor*> ordered_cursors;
+  ordered_cursors.reserve(cursors.size());
+  for (auto list : ordered_lists) {
+    ordered_cursors.push_back(&cursors[list]);
+  }
+
+  // remaining_bounds[i] bounds the score from lists [i, n) for docids up
+  // to block_end, from the blocks the candidate falls in
+  std::vector<float> remaining_bounds(cursors.size() + 1, 0);
+  uint32_t block_end = 0;
+  auto update_block_bounds = [&](uint32_t candidate) {
+    block_end = END_CHAIN;
+    for (size_t i = ordered_cursors.size(); i-- > 0; ) {
+      ordered_cursors[i]->block_max_next_geq(candidate);
+      remaining_bounds[i] = remaining_bounds[i + 1] +
+                            ranker.term_weight_bound(ordered_cursors[i]->block_max_freq()) * idf_weights[ordered_lists[i]];
+      block_end = std::min(block_end, ordered_cursors[i]->block_max_docid());
+    }
+  };
+
+  // With enough candidates, the other lists are decoded a block at a time
+  // instead: the candidates which may make the heap are gathered from the
+  // shortest list, skipping blocks as below, and filtered in batches
+  if (ordered_cursors.size() > 1 && batch_pays(ordered_cursors[0]->doc_freq(), ordered_cursors.back()->doc_freq())) {
+    candidate_batch batch(cursors.size());
+    std::vector<batch_list> lists;
+    for (size_t i = 1; i < ordered_cursors.size(); ++i) {
+      lists.emplace_back(*ordered_cursors[i]);
+    }
+    uint32_t candidate = ordered_cursors[0]->docid();
+    while (candidate < range.m_end && range.would_enter(results, list_bound)) {
+      batch.clear();
+      while (candidate < range.m_end && batch.size() < RANKED_BATCH) {
+        if (candidate > block_end) {
+          update_block_bounds(candidate);
+        }
+        if (!range.would_enter(results, remaining_bounds[0])) {
+          if (block_end == END_CHAIN) {
+            candidate = END_CHAIN;
+            break;
+          }
+          ordered_cursors[0]->next_geq(block_end + 1);
+          candidate = ordered_cursors[0]->docid();
+          continue;
+        }
+        uint32_t freq = ordered_cursors[0]->freq();
+        float score = ranker.doc_term_weight(candidate, freq) * idf_weights[ordered_lists[0]];
+        if (range.would_enter(results, score + remaining_bounds[1])) {
+          batch.add(candidate)[ordered_lists[0]] = freq;
+        }
+        ordered_cursors[0]->next();
+        candidate = ordered_cursors[0]->docid();
+      }
+      for (size_t i = 1; i < ordered_cursors.size() && batch.size() > 0; ++i) {
+        batch_intersect(batch, lists[i - 1], ordered_lists[i]);
+      }
+      for (size_t c = 0; c < batch.size(); ++c) {
+        const uint32_t* freqs = batch.freqs(c);
+        float score = 0;
+        for (size_t j = 0; j < cursors.size(); ++j) {
+          score += ranker.doc_term_weight(batch.m_docids[c], freqs[j]) * idf_weights[j];
+        }
+        range.insert(results, score, batch.m_docids[c]);
+      }
+    }
+    results.finalize();
+    return results.size();
+  }
+
   uint32_t candidate = ordered_cursors[0]->docid();
-  size_t i = 1;
+  while (candidate < range.m_end && range.would_enter(results, list_bound)) {
 
-  std::vector<size_t> geq_count(ordered_cursors.size());
+    if (candidate > block_end) {
+      update_block_bounds(candidate);
+    }
+    // Nothing up to the end of these blocks can make the heap
+    if (!range.would_enter(results, remaining_bounds[0])) {
+      if (block_end == END_CHAIN) {
+        break;
+      }
+      ordered_cursors[0]->next_geq(block_end + 1);
+      candidate = ordered_cursors[0]->docid();
+      continue;
+    }
 
-  while (candidate != END_CHAIN) {
-    
-    for(; i < ordered_cursors.size(); ++i) {
-      
+    float score = ranker.doc_term_weight(candidate, ordered_cursors[0]->freq()) * idf_weights[ordered_lists[0]];
+    uint32_t next_doc = candidate;
+    size_t i = 1;
+    for (; i < ordered_cursors.size(); ++i) {
+      // The candidate can't make it even if the rest of the lists match
+      if (!range.would_enter(results, score + remaining_bounds[i])) {
+        break;
+      }
       ordered_cursors[i]->next_geq(candidate);
-      geq_count[i]++;
-
       if (ordered_cursors[i]->docid() != candidate) {
-        i = 0;
+        next_doc = ordered_cursors[i]->docid();
         break;
       }
+      score += ranker.doc_term_weight(candidate, ordered_cursors[i]->freq()) * idf_weights[ordered_lists[i]];
     }
 
     if (i == ordered_cursors.size()) {
-      results.push_back(candidate);
+      score = 0;
+      for (size_t j = 0; j < cursors.size(); ++j) {
+        score += ranker.doc_term_weight(candidate, cursors[j].freq()) * idf_weights[j];
+      }
+      range.insert(results, score, candidate);
+    }
+
+    // Leap to whichever docid disproved the candidate
+    if (next_doc == END_CHAIN) {
+      break;
+    } else if (next_doc > candidate) {
+      ordered_cursors[0]->next_geq(next_doc);
+    } else {
+      ordered_cursors[0]->next();
     }
-    
-    geq_count[0]++;
-    ordered_cursors[0]->next();
     candidate = ordered_cursors[0]->docid();
-    i = 1;
+  }
+  results.finalize();
+  return results.size();
+}
 
+// Phrase and proximity queries: the lists are first intersected at the
+// document level (short to long, as in gallop_conjunction), and only then
+// are the positions of each candidate decoded and checked. Matching
+// docids are appended to matches
+template <typename PositionCheck>
+size_t positional_conjunction(std::vector<positional_cursor>& cursors, std::vector<uint32_t>& matches,
+                              PositionCheck check) {
+
+  matches.clear();
+  if (cursors.size() == 0) {
+    return 0;
   }
 
-  std::cout << "------\n";
-  for(size_t i = 0; i < ordered_cursors.size(); ++i) {
-    std::cout << "[" << i << "] -> " << ordered_cursors[i]->term() << "  df= " << ordered_cursors[i]->doc_freq() << "  next_geq_count= " << geq_count[i] << "\n";
+  std::vector<positional_cursor*> ordered_cursors;
+  ordered_cursors.reserve(cursors.size());
+  for (auto& curs : cursors) {
+    ordered_cursors.push_back(&curs);
   }
 
+  // Order short to long
+  std::sort(ordered_cursors.begin(), ordered_cursors.end(), [](positional_cursor* l, positional_cursor* r) {
+    return l->doc_freq() < r->doc_freq();
+  });
 
-  return results.size();
+  uint32_t candidate = ordered_cursors[0]->docid();
+  size_t i = 1;
+
+  while (candidate != END_CHAIN) {
+    for (; i < ordered_cursors.size(); ++i) {
+      ordered_cursors[i]->next_geq(candidate);
+      if (ordered_cursors[i]->docid() != candidate) {
+        candidate = ordered_cursors[i]->docid();
+        break;
+      }
+    }
+
+    if (i == ordered_cursors.size()) {
+      if (check(cursors)) {
+        matches.push_back(candidate);
+      }
+      ordered_cursors[0]->next();
+    } else if (candidate == END_CHAIN) {
+      break;
+    } else {
+      ordered_cursors[0]->next_geq(candidate);
+    }
+    candidate = ordered_cursors[0]->docid();
+    i = 1;
+  }
+  return matches.size();
 }
 
+// The cursors are in query order; the i-th term must occur at position p + i.
+// We anchor on the term with the fewest positions and look up the others
+size_t phrase_query(std::vector<positional_cursor>& cursors, std::vector<uint32_t>& matches) {
 
-// Heavily based on PISA's algos
-size_t boolean_disjunction(std::vector<postings_cursor>& cursors) {
+  return positional_conjunction(cursors, matches, [](std::vector<positional_cursor>& phrase) {
+    size_t anchor = 0;
+    for (size_t i = 1; i < phrase.size(); ++i) {
+      if (phrase[i].freq() < phrase[anchor].freq()) {
+        anchor = i;
+      }
+    }
+    for (auto position : phrase[anchor].positions()) {
+      if (position <= anchor) {
+        continue;
+      }
+      uint32_t start = position - anchor;
+      size_t i = 0;
+      for (; i < phrase.size(); ++i) {
+        if (i == anchor) {
+          continue;
+        }
+        const auto& positions = phrase[i].positions();
+        if (!std::binary_search(positions.begin(), positions.end(), start + i)) {
+          break;
+        }
+      }
+      if (i == phrase.size()) {
+        return true;
+      }
+    }
+    return false;
+  });
+}
+
+// Every term must occur, in any order, within some span of window words.
+// This is the smallest range covering one position from each list: keep
+// a position per term, and repeatedly advance whichever is furthest back.
+// A term given c times in the query must occur c times in the span, so
+// its repeats are collapsed into one term which covers c consecutive
+// positions from the one it is at
+size_t window_query(std::vector<positional_cursor>& cursors, const uint32_t window, std::vector<uint32_t>& matches) {
+
+  std::vector<size_t> distinct; // the first cursor of each term
+  std::vector<uint32_t> repeats; // and how often the term is given
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    size_t j = 0;
+    while (j < distinct.size() && cursors[distinct[j]].term() != cursors[i].term()) {
+      ++j;
+    }
+    if (j == distinct.size()) {
+      distinct.push_back(i);
+      repeats.push_back(0);
+    }
+    repeats[j] += 1;
+  }
+
+  std::vector<size_t> next_position(distinct.size());
+  return positional_conjunction(cursors, matches, [&](std::vector<positional_cursor>& terms) {
+    for (size_t j = 0; j < distinct.size(); ++j) {
+      if (terms[distinct[j]].freq() < repeats[j]) {
+        return false;
+      }
+    }
+    std::fill(next_position.begin(), next_position.end(), 0);
+    while (true) {
+      size_t lowest = 0;
+      uint32_t min_position = END_CHAIN;
+      uint32_t max_position = 0;
+      for (size_t j = 0; j < distinct.size(); ++j) {
+        const auto& positions = terms[distinct[j]].positions();
+        uint32_t position = positions[next_position[j]];
+        if (position < min_position) {
+          min_position = position;
+          lowest = j;
+        }
+        max_position = std::max(max_position, positions[next_position[j] + repeats[j] - 1]);
+      }
+      if (max_position - min_position < window) {
+        return true;
+      }
+      next_position[lowest] += 1;
+      if (next_position[lowest] + repeats[lowest] > terms[distinct[lowest]].freq()) {
+        return false;
+      }
+    }
+  });
+}
+
+// A starting threshold for a top-k disjunction, from the block maxima:
+// every block holds a document with its largest f_dt, so if one list has k
+// blocks whose maxima score at least t, then so do k documents, and the
+// k-th best score of the disjunction is at least t. Only the first few
+// blocks of each list are looked at (any blocks will do), which keeps this
+// cheap. Saturated maxima only tell us f_dt >= MAX_BLOCK_FREQ. Returns 0
+// if no list has enough blocks. Since a primed heap only keeps scores
+// above its threshold, pass a value just below this one to the heap
+const size_t ESTIMATE_BLOCKS_PER_RESULT = 4;
+
+template <typename Ranker>
+float estimate_threshold(const std::vector<postings_cursor>& cursors, Ranker& ranker, const size_t k) {
+
+  if (k == 0) {
+    return 0;
+  }
+  float estimate = 0;
+  std::vector<float> floors;
+  for (const auto& list : cursors) {
+    if (list.doc_freq() < k) {
+      continue;
+    }
+    // The estimate moves the shallow pointer only, but on a copy all the same
+    postings_cursor cursor(list);
+    float idf_weight = ranker.idf_weight(cursor.doc_freq());
+    floors.clear();
+    cursor.block_max_next_geq(cursor.docid());
+    while (floors.size() < k * ESTIMATE_BLOCKS_PER_RESULT) {
+      uint32_t freq = std::min(cursor.block_max_freq(), MAX_BLOCK_FREQ);
+      floors.push_back(ranker.term_weight_floor(freq) * idf_weight);
+      if (cursor.block_max_docid() == END_CHAIN) {
+        break;
+      }
+      cursor.block_max_next_geq(cursor.block_max_docid() + 1);
+    }
+    if (floors.size() >= k) {
+      std::nth_element(floors.begin(), floors.begin() + k - 1, floors.end(), std::greater<float>());
+      estimate = std::max(estimate, floors[k - 1]);
+    }
+  }
+  return estimate;
+}
+
+// Heavily based on PISA's algos. Every list is checked for every
+// candidate, which is hard to beat for a handful of lists
+size_t scan_boolean_disjunction(std::vector<postings_cursor>& cursors) {
 
   if (cursors.size() == 0) {
     return 0;
@@ -146,34 +886,595 @@ size_t boolean_disjunction(std::vector<postings_cursor>& cursors) {
 }
 
 // Heavily based on PISA's algos
-size_t ranked_disjunction(std::vector<postings_cursor>& cursors, tfidf_ranker& ranker, topk_queue& results) {
+template <typename Ranker>
+size_t scan_ranked_disjunction(std::vector<postings_cursor>& cursors, Ranker& ranker, topk_queue& results,
+                               const docid_range& range = docid_range()) {
 
   if (cursors.size() == 0) {
     return 0;
   }
+  range.seek(cursors);
 
   uint32_t candidate = 
     std::min_element(cursors.begin(), cursors.end(), [](auto const& l, auto const& r) {
         return l.docid() < r.docid();
     })->docid();
   
-  while (candidate != END_CHAIN) {
+  while (candidate < range.m_end) {
     float score = 0;
     uint32_t next_doc = END_CHAIN;
     for(size_t i = 0; i < cursors.size(); ++i) {
       if (cursors[i].docid() == candidate) {
-        score += ranker.tf_weight(cursors[i].freq()) * ranker.idf_weight(cursors[i].doc_freq());
+        score += ranker.doc_term_weight(candidate, cursors[i].freq()) * ranker.idf_weight(cursors[i].doc_freq());
         cursors[i].next();
       }
       if (cursors[i].docid() < next_doc) {
         next_doc = cursors[i].docid();
       }
     }
-    results.insert(score, candidate);
+    range.insert(results, score, candidate);
     candidate = next_doc;
   }
   results.finalize(); 
   return results.size();
 }
 
+// A min-heap of the lists of a disjunction, ordered by the current docid
+// of their cursors. Each candidate costs O(log n) per list which holds it,
+// rather than a check of every list, so this wins for many-term queries.
+// Lists which run out are dropped from the heap
+class cursor_heap {
+
+  public:
+    explicit cursor_heap(std::vector<postings_cursor>& cursors) : m_cursors(cursors) {
+      for (size_t i = 0; i < cursors.size(); ++i) {
+        if (cursors[i].docid() != END_CHAIN) {
+          m_heap.push_back(i);
+        }
+      }
+      for (size_t i = m_heap.size() / 2; i-- > 0; ) {
+        sift_down(i);
+      }
+    }
+
+    bool empty() const {
+      return m_heap.empty();
+    }
+
+    // The list holding the lowest docid
+    size_t top() const {
+      return m_heap[0];
+    }
+
+    uint32_t top_docid() const {
+      return m_heap.empty() ? END_CHAIN : m_cursors[m_heap[0]].docid();
+    }
+
+    // Restores the heap once the top list has been moved on
+    void fix_top() {
+      if (m_cursors[m_heap[0]].docid() == END_CHAIN) {
+        m_heap[0] = m_heap.back();
+        m_heap.pop_back();
+      }
+      if (!m_heap.empty()) {
+        sift_down(0);
+      }
+    }
+
+  private:
+    void sift_down(size_t i) {
+      size_t list = m_heap[i];
+      uint32_t docid = m_cursors[list].docid();
+      while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= m_heap.size()) {
+          break;
+        }
+        if (child + 1 < m_heap.size() && m_cursors[m_heap[child + 1]].docid() < m_cursors[m_heap[child]].docid()) {
+          child += 1;
+        }
+        if (m_cursors[m_heap[child]].docid() >= docid) {
+          break;
+        }
+        m_heap[i] = m_heap[child];
+        i = child;
+      }
+      m_heap[i] = list;
+    }
+
+    std::vector<postings_cursor>& m_cursors;
+    std::vector<size_t> m_heap;
+};
+
+// As scan_boolean_disjunction, over a heap of the lists
+size_t heap_boolean_disjunction(std::vector<postings_cursor>& cursors) {
+
+  size_t results = 0;
+  cursor_heap heap(cursors);
+  while (!heap.empty()) {
+    uint32_t candidate = heap.top_docid();
+    results += 1;
+    do {
+      cursors[heap.top()].next();
+      heap.fix_top();
+    } while (heap.top_docid() == candidate);
+  }
+  return results;
+}
+
+// As scan_ranked_disjunction, over a heap of the lists. The lists holding
+// a candidate come off the heap in no particular order, so their scores
+// are summed afterwards in list order, to match bit-for-bit
+template <typename Ranker>
+size_t heap_ranked_disjunction(std::vector<postings_cursor>& cursors, Ranker& ranker, topk_queue& results,
+                               const docid_range& range = docid_range()) {
+
+  if (cursors.size() == 0) {
+    return 0;
+  }
+  range.seek(cursors);
 
+  std::vector<float> idf_weights(cursors.size());
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    idf_weights[i] = ranker.idf_weight(cursors[i].doc_freq());
+  }
+  std::vector<uint32_t> term_freqs(cursors.size(), 0);
+  std::vector<size_t> matched;
+
+  cursor_heap heap(cursors);
+  while (heap.top_docid() < range.m_end) {
+    uint32_t candidate = heap.top_docid();
+    matched.clear();
+    do {
+      size_t list = heap.top();
+      matched.push_back(list);
+      term_freqs[list] = cursors[list].freq();
+      cursors[list].next();
+      heap.fix_top();
+    } while (heap.top_docid() == candidate);
+
+    std::sort(matched.begin(), matched.end());
+    float score = 0;
+    for (auto list : matched) {
+      score += ranker.doc_term_weight(candidate, term_freqs[list]) * idf_weights[list];
+    }
+    range.insert(results, score, candidate);
+  }
+  results.finalize();
+  return results.size();
+}
+
+// Counts a dense disjunction in windows of the docid space: each list
+// sets the bits of its docids within the window, and then the window is
+// counted with popcount. There is no per-candidate work at all, so when
+// the lists cover a good fraction of the documents this is far cheaper
+// than merging them
+const size_t BITSET_WINDOW_BITS = 16; // 8 KiB of bits, which sits in L1
+
+size_t bitset_boolean_disjunction(std::vector<postings_cursor>& cursors) {
+
+  const uint32_t window_size = 1 << BITSET_WINDOW_BITS;
+  std::vector<uint64_t> bits(window_size / 64, 0);
+  size_t results = 0;
+
+  auto lowest_docid = [&]() {
+    uint32_t lowest = END_CHAIN;
+    for (auto& cursor : cursors) {
+      lowest = std::min(lowest, cursor.docid());
+    }
+    return lowest;
+  };
+
+  uint32_t lowest = lowest_docid();
+  while (lowest != END_CHAIN) {
+    // Skip straight to the next window which holds anything
+    uint64_t window_start = lowest & ~(window_size - 1);
+    uint64_t window_end = std::min(window_start + window_size, uint64_t(END_CHAIN));
+    for (auto& cursor : cursors) {
+      while (cursor.docid() < window_end) {
+        uint32_t bit = cursor.docid() - window_start;
+        bits[bit >> 6] |= uint64_t(1) << (bit & 63);
+        cursor.next();
+      }
+    }
+    for (auto& word : bits) {
+      results += __builtin_popcountll(word);
+      word = 0;
+    }
+    lowest = lowest_docid();
+  }
+  return results;
+}
+
+// How the lists of a disjunction are traversed
+enum class disjunction_strategy {scan, heap, bitset};
+
+std::string strategy_name(const disjunction_strategy strategy) {
+  switch (strategy) {
+    case disjunction_strategy::scan:
+      return "scan";
+    case disjunction_strategy::heap:
+      return "heap";
+    case disjunction_strategy::bitset:
+      return "bitset";
+  }
+  return "unknown";
+}
+
+// With at least this many lists, the heap beats checking every list. A
+// ranked scan does more per list and candidate than a Boolean one, so it
+// gives way sooner
+const size_t HEAP_MIN_LISTS_RANKED = 6;
+const size_t HEAP_MIN_LISTS_COUNTING = 16;
+// A window of the bitset costs a pass over its words, which are about
+// this many times cheaper than decoding a posting
+const size_t BITSET_WORDS_PER_POSTING = 16;
+
+// Picks the traversal from the number of lists and their lengths. When only
+// counting, the bitset is used unless the postings are spread so thinly
+// over the documents that most of the windows would be nearly empty
+disjunction_strategy plan_disjunction(const std::vector<postings_cursor>& cursors, const size_t num_docs,
+                                      const bool counting) {
+  if (counting && num_docs > 0) {
+    size_t postings = 0;
+    for (const auto& cursor : cursors) {
+      postings += cursor.doc_freq();
+    }
+    size_t windows = std::min(postings, (num_docs >> BITSET_WINDOW_BITS) + 1);
+    if (windows * ((size_t(1) << BITSET_WINDOW_BITS) / 64) <= postings * BITSET_WORDS_PER_POSTING) {
+      return disjunction_strategy::bitset;
+    }
+  }
+  if (cursors.size() >= (counting ? HEAP_MIN_LISTS_COUNTING : HEAP_MIN_LISTS_RANKED)) {
+    return disjunction_strategy::heap;
+  }
+  return disjunction_strategy::scan;
+}
+
+// Counts the documents holding any of the terms, picking the traversal to
+// suit the query. Without the number of documents, the bitset isn't used
+size_t boolean_disjunction(std::vector<postings_cursor>& cursors, const size_t num_docs = 0) {
+  switch (plan_disjunction(cursors, num_docs, true)) {
+    case disjunction_strategy::bitset:
+      return bitset_boolean_disjunction(cursors);
+    case disjunction_strategy::heap:
+      return heap_boolean_disjunction(cursors);
+    case disjunction_strategy::scan:
+      break;
+  }
+  return scan_boolean_disjunction(cursors);
+}
+
+// Exhaustive top-k over a disjunction, picking the traversal to suit the
+// query; both give identical results
+template <typename Ranker>
+size_t ranked_disjunction(std::vector<postings_cursor>& cursors, Ranker& ranker, topk_queue& results,
+                          const docid_range& range = docid_range()) {
+  if (plan_disjunction(cursors, 0, false) == disjunction_strategy::heap) {
+    return heap_ranked_disjunction(cursors, ranker, results, range);
+  }
+  return scan_ranked_disjunction(cursors, ranker, results, range);
+}
+
+// MaxScore, again based on PISA's algos. Each list has a score upper
+// bound (from the max f_dt tracked in its head block); lists are ordered
+// by their bounds, and the prefix whose bounds sum to at most the heap
+// threshold is "non-essential": those lists can't put a document into
+// the heap on their own, so candidates only come from the essential
+// lists and the others are just probed with next_geq
+template <typename Ranker>
+size_t maxscore_disjunction(std::vector<postings_cursor>& cursors, Ranker& ranker, topk_queue& results,
+                            const docid_range& range = docid_range()) {
+
+  if (cursors.size() == 0) {
+    return 0;
+  }
+  range.seek(cursors);
+
+  // Lists are referred to by their position in `cursors`; the final score
+  // of a document is summed in that order so that it matches
+  // ranked_disjunction bit-for-bit
+  std::vector<size_t> ordered_lists(cursors.size());
+  std::iota(ordered_lists.begin(), ordered_lists.end(), 0);
+  std::vector<float> idf_weights(cursors.size());
+  std::vector<float> list_bounds(cursors.size());
+  std::vector<uint32_t> term_freqs(cursors.size(), 0);
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    idf_weights[i] = ranker.idf_weight(cursors[i].doc_freq());
+    list_bounds[i] = ranker.term_weight_bound(cursors[i].max_freq()) * idf_weights[i];
+  }
+
+  // Order by upper bound, low to high
+  std::sort(ordered_lists.begin(), ordered_lists.end(), [&](size_t l, size_t r) {
+    return list_bounds[l] < list_bounds[r];
+  });
+  std::vector<postings_cursor*> ordered_cursors;
+  ordered_cursors.reserve(cursors.size());
+  for (auto list : ordered_lists) {
+    ordered_cursors.push_back(&cursors[list]);
+  }
+
+  // upper_bounds[i] bounds the total score from lists [0, i]
+  std::vector<float> upper_bounds(cursors.size());
+  float cumulative_bound = 0;
+  for (size_t i = 0; i < ordered_lists.size(); ++i) {
+    cumulative_bound += list_bounds[ordered_lists[i]];
+    upper_bounds[i] = cumulative_bound;
+  }
+
+  // Lists [0, non_essential) are non-essential
+  size_t non_essential = 0;
+  auto update_non_essential = [&]() {
+    while (non_essential < ordered_cursors.size() && !range.would_enter(results, upper_bounds[non_essential])) {
+      non_essential += 1;
+    }
+  };
+  update_non_essential();
+
+  uint32_t candidate = 
+    (*std::min_element(ordered_cursors.begin(), ordered_cursors.end(), [](auto const& l, auto const& r) {
+        return l->docid() < r->docid();
+    }))->docid();
+
+  while (non_essential < ordered_cursors.size() && candidate < range.m_end) {
+    // The other ranges may have raised the threshold
+    if (range.m_threshold != nullptr) {
+      update_non_essential();
+    }
+    float score = 0;
+    uint32_t next_doc = END_CHAIN;
+    // Score the essential lists, and find the next candidate among them
+    for (size_t i = non_essential; i < ordered_cursors.size(); ++i) {
+      if (ordered_cursors[i]->docid() == candidate) {
+        term_freqs[ordered_lists[i]] = ordered_cursors[i]->freq();
+        score += ranker.doc_term_weight(candidate, ordered_cursors[i]->freq()) * idf_weights[ordered_lists[i]];
+        ordered_cursors[i]->next();
+      }
+      if (ordered_cursors[i]->docid() < next_doc) {
+        next_doc = ordered_cursors[i]->docid();
+      }
+    }
+    // Probe the non-essential lists, highest bound first, while the
+    // candidate still has a chance of making it into the heap
+    bool pruned = false;
+    for (size_t i = non_essential; i-- > 0; ) {
+      if (!range.would_enter(results, score + upper_bounds[i])) {
+        pruned = true;
+        break;
+      }
+      ordered_cursors[i]->next_geq(candidate);
+      if (ordered_cursors[i]->docid() == candidate) {
+        term_freqs[ordered_lists[i]] = ordered_cursors[i]->freq();
+        score += ranker.doc_term_weight(candidate, ordered_cursors[i]->freq()) * idf_weights[ordered_lists[i]];
+      }
+    }
+    if (!pruned) {
+      score = 0;
+      for (size_t i = 0; i < term_freqs.size(); ++i) {
+        if (term_freqs[i] > 0) {
+          score += ranker.doc_term_weight(candidate, term_freqs[i]) * idf_weights[i];
+        }
+      }
+      if (range.insert(results, score, candidate)) {
+        update_non_essential();
+      }
+    }
+    std::fill(term_freqs.begin(), term_freqs.end(), 0);
+    candidate = next_doc;
+  }
+  results.finalize();
+  return results.size();
+}
+
+// Recency-first conjunction: walks the lists from the newest docid back
+// towards the oldest, collecting matches (newest first) until we have n of
+// them or the candidates fall below min_docid
+size_t recent_conjunction(std::vector<reverse_postings_cursor>& cursors, const size_t n,
+                          const uint32_t min_docid, std::vector<uint32_t>& results) {
+
+  results.clear();
+  if (cursors.size() == 0 || n == 0) {
+    return 0;
+  }
+
+  std::vector<reverse_postings_cursor*> ordered_cursors;
+  ordered_cursors.reserve(cursors.size());
+  for (auto& curs : cursors) {
+    ordered_cursors.push_back(&curs);
+  }
+
+  // Order short to long
+  std::sort(ordered_cursors.begin(), ordered_cursors.end(), [](reverse_postings_cursor* l, reverse_postings_cursor* r) {
+    return l->doc_freq() < r->doc_freq();
+  });
+
+  uint32_t candidate = ordered_cursors[0]->docid();
+  size_t i = 1;
+
+  while (candidate != START_CHAIN && candidate >= min_docid) {
+    for(; i < ordered_cursors.size(); ++i) {
+      ordered_cursors[i]->prev_leq(candidate);
+
+      if (ordered_cursors[i]->docid() != candidate) {
+        break;
+      }
+    }
+
+    if (i == ordered_cursors.size()) {
+      results.push_back(candidate);
+      if (results.size() == n) {
+        break;
+      }
+      ordered_cursors[0]->prev();
+    } else {
+      // Nothing between the mismatch and the candidate can match
+      ordered_cursors[0]->prev_leq(ordered_cursors[i]->docid());
+    }
+    candidate = ordered_cursors[0]->docid();
+    i = 1;
+  }
+  return results.size();
+}
+
+// Recency-first disjunction: the n most recent documents containing any
+// of the terms, no older than min_docid
+size_t recent_disjunction(std::vector<reverse_postings_cursor>& cursors, const size_t n,
+                          const uint32_t min_docid, std::vector<uint32_t>& results) {
+
+  results.clear();
+  if (cursors.size() == 0 || n == 0) {
+    return 0;
+  }
+
+  uint32_t candidate =
+    std::max_element(cursors.begin(), cursors.end(), [](auto const& l, auto const& r) {
+        return l.docid() < r.docid();
+    })->docid();
+
+  while (candidate != START_CHAIN && candidate >= min_docid) {
+    results.push_back(candidate);
+    if (results.size() == n) {
+      break;
+    }
+    uint32_t next_doc = START_CHAIN;
+    for(size_t i = 0; i < cursors.size(); ++i) {
+      if (cursors[i].docid() == candidate) {
+        cursors[i].prev();
+      }
+      if (cursors[i].docid() > next_doc) {
+        next_doc = cursors[i].docid();
+      }
+    }
+    candidate = next_doc;
+  }
+
+  return results.size();
+}
+
+// Block-Max WAND, once again following PISA. Like WAND, the lists are kept
+// ordered by their current docid and a pivot is found using the list upper
+// bounds; the pivot is then checked against the block maxima of the lists
+// preceding it, and if those can't beat the heap threshold, every document
+// up to the end of the shortest of those blocks is skipped without being
+// decoded
+template <typename Ranker>
+size_t block_max_wand(std::vector<postings_cursor>& cursors, Ranker& ranker, topk_queue& results,
+                      const docid_range& range = docid_range()) {
+
+  if (cursors.size() == 0) {
+    return 0;
+  }
+  range.seek(cursors);
+
+  std::vector<float> idf_weights(cursors.size());
+  std::vector<float> list_bounds(cursors.size());
+  std::vector<size_t> ordered_lists(cursors.size());
+  std::iota(ordered_lists.begin(), ordered_lists.end(), 0);
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    idf_weights[i] = ranker.idf_weight(cursors[i].doc_freq());
+    list_bounds[i] = ranker.term_weight_bound(cursors[i].max_freq()) * idf_weights[i];
+  }
+
+  auto docid_order = [&](size_t l, size_t r) {
+    return cursors[l].docid() < cursors[r].docid();
+  };
+  // Restores the docid order after the list at position i moved forward
+  auto bubble_down = [&](size_t i) {
+    for (; i + 1 < ordered_lists.size() && docid_order(ordered_lists[i + 1], ordered_lists[i]); ++i) {
+      std::swap(ordered_lists[i], ordered_lists[i + 1]);
+    }
+  };
+  std::sort(ordered_lists.begin(), ordered_lists.end(), docid_order);
+
+  while (true) {
+
+    // Find the pivot: the first list at which the upper bounds could beat the threshold
+    float upper_bound = 0;
+    size_t pivot = 0;
+    bool found_pivot = false;
+    for (; pivot < ordered_lists.size(); ++pivot) {
+      if (cursors[ordered_lists[pivot]].docid() == END_CHAIN) {
+        break;
+      }
+      upper_bound += list_bounds[ordered_lists[pivot]];
+      if (range.would_enter(results, upper_bound)) {
+        found_pivot = true;
+        // Include any other lists sitting on the pivot document
+        while (pivot + 1 < ordered_lists.size() &&
+               cursors[ordered_lists[pivot + 1]].docid() == cursors[ordered_lists[pivot]].docid()) {
+          pivot += 1;
+        }
+        break;
+      }
+    }
+    if (!found_pivot) {
+      break;
+    }
+
+    uint32_t pivot_id = cursors[ordered_lists[pivot]].docid();
+    if (pivot_id >= range.m_end) {
+      break;
+    }
+
+    // Now tighten the bound using the blocks which hold the pivot
+    float block_upper_bound = 0;
+    for (size_t i = 0; i <= pivot; ++i) {
+      auto& cursor = cursors[ordered_lists[i]];
+      cursor.block_max_next_geq(pivot_id);
+      block_upper_bound += ranker.term_weight_bound(cursor.block_max_freq()) * idf_weights[ordered_lists[i]];
+    }
+
+    if (range.would_enter(results, block_upper_bound)) {
+      if (cursors[ordered_lists[0]].docid() == pivot_id) {
+        // Every list up to the pivot is on the pivot document, so score it,
+        // summing in query order to match ranked_disjunction exactly
+        float score = 0;
+        for (size_t i = 0; i < cursors.size(); ++i) {
+          if (cursors[i].docid() == pivot_id) {
+            score += ranker.doc_term_weight(pivot_id, cursors[i].freq()) * idf_weights[i];
+            cursors[i].next();
+          }
+        }
+        range.insert(results, score, pivot_id);
+        std::sort(ordered_lists.begin(), ordered_lists.end(), docid_order);
+      } else {
+        // Move up a list which is behind the pivot
+        size_t next_list = pivot;
+        while (cursors[ordered_lists[next_list]].docid() == pivot_id) {
+          next_list -= 1;
+        }
+        cursors[ordered_lists[next_list]].next_geq(pivot_id);
+        bubble_down(next_list);
+      }
+    } else {
+      // Nothing up to the end of the current blocks can make it, so skip the
+      // list with the largest bound past them (or to the next list's docid)
+      size_t next_list = pivot;
+      float max_weight = list_bounds[ordered_lists[next_list]];
+      for (size_t i = 0; i < pivot; ++i) {
+        if (list_bounds[ordered_lists[i]] > max_weight) {
+          next_list = i;
+          max_weight = list_bounds[ordered_lists[i]];
+        }
+      }
+
+      uint32_t next_docid = END_CHAIN;
+      for (size_t i = 0; i <= pivot; ++i) {
+        next_docid = std::min(next_docid, cursors[ordered_lists[i]].block_max_docid());
+      }
+      if (next_docid != END_CHAIN) {
+        next_docid += 1;
+      }
+      if (pivot + 1 < ordered_lists.size() && cursors[ordered_lists[pivot + 1]].docid() < next_docid) {
+        next_docid = cursors[ordered_lists[pivot + 1]].docid();
+      }
+      if (next_docid <= pivot_id) {
+        next_docid = pivot_id + 1;
+      }
+      cursors[ordered_lists[next_list]].next_geq(next_docid);
+      bubble_down(next_list);
+    }
+  }
+  results.finalize();
+  return results.size();
+}
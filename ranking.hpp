@@ -1,6 +1,13 @@
 #pragma once
 
 #include "util.hpp"
+#include "document_lengths.hpp"
+
+// Rankers score a posting as doc_term_weight(docid, f_dt) * idf_weight(f_t);
+// term_weight_bound(f) must bound doc_term_weight for any f_dt <= f so
+// that it can be used for dynamic pruning, and term_weight_floor(f) must
+// be at most doc_term_weight for any document with f_dt >= f, so that it
+// can be used to estimate a starting threshold
 
 class tfidf_ranker {
 
@@ -15,7 +22,121 @@ class tfidf_ranker {
       return std::log(1 + m_num_docs / static_cast<float>(df));
     }
 
+    // The document is irrelevant for tf-idf
+    float doc_term_weight(const uint32_t, const uint32_t tf) const {
+      return tf_weight(tf);
+    }
+
+    float term_weight_bound(const uint32_t max_tf) const {
+      return tf_weight(max_tf);
+    }
+
+    float term_weight_floor(const uint32_t min_tf) const {
+      return tf_weight(min_tf);
+    }
+
   private:
     uint32_t m_num_docs;
 
 };
+
+// Okapi BM25. The length normalisation of each document is quantized
+// into a byte (a log scale with 3 bits of mantissa, so lengths are kept to
+// within 12.5%); for each of the 256 levels we precompute the tf
+// component for small f_dt values, so scoring a posting is usually just
+// two lookups and no division
+class bm25_ranker {
+
+  public:
+    // Anything with a smaller f_dt is scored out of the table
+    static const uint32_t TF_CACHE = 16;
+    static const size_t NORM_LEVELS = 256;
+
+    explicit bm25_ranker(const document_lengths& lengths, const float k1 = 0.9, const float b = 0.4) :
+                                                 m_num_docs(lengths.num_docs()),
+                                                 m_first_docid(lengths.first_docid()),
+                                                 m_k1(k1) {
+      // Precompute K = k1 * (1 - b + b * |d| / avg(|d|)) for each level
+      double average_length = std::max(lengths.average_length(), 1.0);
+      m_norms.resize(NORM_LEVELS);
+      for (size_t level = 0; level < NORM_LEVELS; ++level) {
+        m_norms[level] = m_k1 * (1 - b + b * level_to_length(level) / average_length);
+      }
+
+      // ... then the tf component for the common (small) f_dt values
+      m_tf_table.resize(NORM_LEVELS * TF_CACHE);
+      for (size_t level = 0; level < NORM_LEVELS; ++level) {
+        for (uint32_t tf = 0; tf < TF_CACHE; ++tf) {
+          m_tf_table[level * TF_CACHE + tf] = tf_component(tf, m_norms[level]);
+        }
+      }
+
+      // ... and finally quantize each document, noting the shortest and longest
+      uint8_t min_level = NORM_LEVELS - 1;
+      uint8_t max_level = 0;
+      m_levels.resize(lengths.num_docs());
+      for (size_t i = 0; i < lengths.num_docs(); ++i) {
+        m_levels[i] = length_to_level(lengths.length(m_first_docid + i));
+        min_level = std::min(min_level, m_levels[i]);
+        max_level = std::max(max_level, m_levels[i]);
+      }
+      m_min_norm = m_norms[min_level];
+      m_max_norm = m_norms[max_level];
+    }
+
+    float idf_weight(const uint32_t df) const {
+      return std::log(1 + (static_cast<float>(m_num_docs) - df + 0.5f) / (df + 0.5f));
+    }
+
+    float doc_term_weight(const uint32_t docid, const uint32_t tf) const {
+      uint8_t level = m_levels[docid - m_first_docid];
+      if (tf < TF_CACHE) {
+        return m_tf_table[level * TF_CACHE + tf];
+      }
+      return tf_component(tf, m_norms[level]);
+    }
+
+    // Assumes the shortest document in the collection
+    float term_weight_bound(const uint32_t max_tf) const {
+      return tf_component(max_tf, m_min_norm);
+    }
+
+    // Assumes the longest document in the collection
+    float term_weight_floor(const uint32_t min_tf) const {
+      return tf_component(min_tf, m_max_norm);
+    }
+
+    // Lengths below 8 are exact; then 8 levels per power of two
+    static uint8_t length_to_level(const uint32_t length) {
+      if (length < 8) {
+        return length;
+      }
+      uint32_t exponent = 31 - __builtin_clz(length);
+      uint32_t mantissa = (length >> (exponent - 3)) & 7;
+      return (exponent - 2) * 8 + mantissa;
+    }
+
+    // The smallest length which maps to a level
+    static double level_to_length(const uint32_t level) {
+      if (level < 8) {
+        return level;
+      }
+      int exponent = level / 8 + 2;
+      int mantissa = level % 8;
+      return std::ldexp(8 + mantissa, exponent - 3);
+    }
+
+  private:
+    float tf_component(const uint32_t tf, const float norm) const {
+      return (tf * (m_k1 + 1)) / (tf + norm);
+    }
+
+    uint32_t m_num_docs;
+    uint32_t m_first_docid;
+    float m_k1;
+    float m_min_norm;
+    float m_max_norm;
+    std::vector<float> m_norms;
+    std::vector<float> m_tf_table;
+    std::vector<uint8_t> m_levels;
+};
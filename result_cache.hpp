@@ -0,0 +1,164 @@
+#pragma once
+
+#include <list>
+#include <unordered_map>
+
+#include "util.hpp"
+#include "query.hpp"
+#include "topk_queue.hpp"
+#include "query_processing.hpp"
+
+// A cached query result, tagged with the largest docid in the index (the
+// watermark) when it was computed. Since docids only ever grow, a result
+// can be brought up to date by evaluating the query over the docids past
+// its watermark alone, and merging
+struct cached_result {
+  uint32_t m_watermark;      // the result covers docids up to here
+  uint32_t m_base_watermark; // ... and was last computed in full up to here
+  size_t m_count;            // for Boolean queries, the number of matches
+  std::vector<topk_queue::entry_type> m_topk; // for ranked queries
+};
+
+// An LRU cache of query results, keyed by the normalised query (the sorted
+// and de-duplicated terms), so repeats in a query log are answered without
+// traversing the lists again, or by traversing just their newest postings.
+//
+// Match counts stay exact however much the index grows. Ranked results
+// are only approximate once the index has grown, since the cached scores
+// were computed with the collection statistics of the time; once the index
+// has grown by more than max_growth (as a fraction of the docids the result
+// was last fully computed over), a ranked result is recomputed from scratch
+class result_cache {
+
+  public:
+    explicit result_cache(const size_t capacity, const double max_growth = 0.1) : m_capacity(capacity),
+                                                                                 m_max_growth(max_growth),
+                                                                                 m_hits(0),
+                                                                                 m_partial_hits(0),
+                                                                                 m_misses(0) {}
+
+    // The cache key: the terms, sorted and de-duplicated
+    static std::string normalise(const query& in_query) {
+      std::vector<std::string> terms(in_query.m_terms);
+      std::sort(terms.begin(), terms.end());
+      terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+      std::string key;
+      for (const auto& term : terms) {
+        key += term;
+        key += ' ';
+      }
+      return key;
+    }
+
+    // Counts the matches of a Boolean query over the whole index, with
+    // evaluate(range) counting the matches within a docid range
+    template <typename Evaluate>
+    size_t count(const query& in_query, const uint32_t watermark, Evaluate evaluate) {
+      std::string key = normalise(in_query);
+      cached_result* entry = find(key);
+      if (entry == nullptr) {
+        m_misses += 1;
+        size_t matches = evaluate(docid_range());
+        insert(key, {watermark, watermark, matches, {}});
+        return matches;
+      }
+      if (entry->m_watermark < watermark) {
+        m_partial_hits += 1;
+        entry->m_count += evaluate(docid_range{entry->m_watermark + 1, END_CHAIN, nullptr});
+        entry->m_watermark = watermark;
+      } else {
+        m_hits += 1;
+      }
+      return entry->m_count;
+    }
+
+    // Finds the top-k of a ranked query over the whole index, with
+    // evaluate(results, range) running the query within a docid range. On a
+    // partial hit, the heap is filled with the cached top-k before the new
+    // docids are evaluated, so the evaluation starts with a full heap and
+    // its threshold prunes from the first posting
+    template <typename Evaluate>
+    size_t topk(const query& in_query, const uint32_t watermark, topk_queue& results, Evaluate evaluate) {
+      std::string key = normalise(in_query);
+      cached_result* entry = find(key);
+      if (entry != nullptr && entry->m_watermark < watermark &&
+          watermark - entry->m_base_watermark > m_max_growth * entry->m_base_watermark) {
+        // Too stale to patch up
+        entry = nullptr;
+      }
+      if (entry == nullptr) {
+        m_misses += 1;
+        results.clear();
+        evaluate(results, docid_range());
+        insert(key, {watermark, watermark, 0, results.topk()});
+        return results.size();
+      }
+
+      results.clear();
+      for (const auto& result : entry->m_topk) {
+        results.insert(result.first, result.second);
+      }
+      if (entry->m_watermark < watermark) {
+        m_partial_hits += 1;
+        evaluate(results, docid_range{entry->m_watermark + 1, END_CHAIN, nullptr});
+        entry->m_topk = results.topk();
+        entry->m_watermark = watermark;
+      } else {
+        m_hits += 1;
+        results.finalize();
+      }
+      return results.size();
+    }
+
+    size_t hits() const {
+      return m_hits;
+    }
+
+    size_t partial_hits() const {
+      return m_partial_hits;
+    }
+
+    size_t misses() const {
+      return m_misses;
+    }
+
+  private:
+    using entry_list = std::list<std::pair<std::string, cached_result>>;
+
+    // Returns the entry and marks it as the most recently used, or nullptr
+    cached_result* find(const std::string& key) {
+      auto it = m_lookup.find(key);
+      if (it == m_lookup.end()) {
+        return nullptr;
+      }
+      m_entries.splice(m_entries.begin(), m_entries, it->second);
+      return &it->second->second;
+    }
+
+    // Adds (or replaces) an entry, evicting the least recently used
+    void insert(const std::string& key, cached_result result) {
+      if (m_capacity == 0) {
+        return;
+      }
+      auto it = m_lookup.find(key);
+      if (it != m_lookup.end()) {
+        it->second->second = std::move(result);
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        return;
+      }
+      if (m_entries.size() == m_capacity) {
+        m_lookup.erase(m_entries.back().first);
+        m_entries.pop_back();
+      }
+      m_entries.emplace_front(key, std::move(result));
+      m_lookup[key] = m_entries.begin();
+    }
+
+    size_t m_capacity;
+    double m_max_growth;
+    entry_list m_entries; // most recently used first
+    std::unordered_map<std::string, entry_list::iterator> m_lookup;
+    size_t m_hits;
+    size_t m_partial_hits;
+    size_t m_misses;
+};
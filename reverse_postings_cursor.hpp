@@ -0,0 +1,202 @@
+#pragma once
+
+#include "util.hpp"
+#include "compress.hpp"
+#include "query.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#else
+#include "immediate_index.hpp"
+#endif
+
+// Docids begin at 1, so 0 flags a reverse cursor that has run off the front
+const uint32_t START_CHAIN = 0;
+
+// One entry per block of a chain, in chain order
+struct block_directory_entry {
+  uint32_t m_block;       // index of the block in the index
+  uint32_t m_first_docid; // first docid in the block (0 for the head)
+  uint32_t m_data_offset; // byte offset of the first posting
+  uint32_t m_data_bytes;  // bytes spanned by the block
+};
+
+// A cursor which walks a postings list from the most recent posting
+// back towards the oldest. Chains are only linked head-to-tail, so on
+// construction we walk the chain once, peeking at the b-gap of each block
+// to build a tail-to-head block directory. After that, each block is
+// decoded (forwards) into a small buffer and read backwards, and prev_leq
+// can binary search the directory rather than walking the chain
+class reverse_postings_cursor {
+
+ public:
+  reverse_postings_cursor(immediate_index& index, std::string term) :
+                                            m_index(index),
+                                            m_term(term),
+                                            m_head_block(END_CHAIN),
+                                            m_doc_freq(END_CHAIN),
+                                            m_current_entry(0),
+                                            m_current_posting(0),
+                                            m_current_docid(START_CHAIN),
+                                            m_current_tf(0) {
+
+    // Find the entry location in the hash table
+    uint32_t entry_hash = m_index.found_or_empty_offset(term);
+    m_head_block = m_index.get_offset(entry_hash);
+    if (m_head_block == END_CHAIN) {
+      std::cerr << "Warning: Could not find term [" << term << "]\n";
+    } else {
+      m_doc_freq = m_index.doc_freq(m_head_block);
+      build_directory();
+      reset();
+    }
+  }
+
+  // Valid cursors head blocks are indexes
+  bool valid() const {
+    return m_head_block != END_CHAIN;
+  }
+
+  uint32_t doc_freq() const {
+    return m_doc_freq;
+  }
+
+  uint32_t docid() const {
+    return m_current_docid;
+  }
+
+  uint32_t freq() const {
+    return m_current_tf;
+  }
+
+  std::string term() const {
+    return m_term;
+  }
+
+  // Number of blocks in the chain
+  size_t blocks() const {
+    return m_directory.size();
+  }
+
+  // Moves the cursor to the most recent posting
+  void reset() {
+    load_block(m_directory.size() - 1);
+    m_current_posting = m_docids.size();
+    prev();
+  }
+
+  // Steps back to the previous (older) posting
+  void prev() {
+    while (m_current_posting == 0) {
+      // We have exhausted the list, so flag it and bail
+      if (m_current_entry == 0) {
+        m_current_docid = START_CHAIN;
+        return;
+      }
+      load_block(m_current_entry - 1);
+      m_current_posting = m_docids.size();
+    }
+    m_current_posting -= 1;
+    m_current_docid = m_docids[m_current_posting];
+    m_current_tf = m_freqs[m_current_posting];
+  }
+
+  // Find the last document in the list <= docid
+  void prev_leq(uint32_t target_docid) {
+
+    if (target_docid >= m_current_docid) {
+      return;
+    }
+
+    // Binary search for the last block starting at or before the target;
+    // the head block starts at 0 so this is always well defined
+    auto it = std::upper_bound(m_directory.begin(), m_directory.begin() + m_current_entry + 1, target_docid,
+                               [](uint32_t target, const block_directory_entry& e) {
+                                 return target < e.m_first_docid;
+                               });
+    size_t entry = (it - m_directory.begin()) - 1;
+    if (entry != m_current_entry) {
+      load_block(entry);
+      m_current_posting = m_docids.size();
+    }
+
+    // Now walk backwards in the block; if the block starts with a larger
+    // docid, prev() will roll us into the previous block
+    do {
+      prev();
+    } while (m_current_docid > target_docid);
+  }
+
+ private:
+  // Walks the chain once, recording where every block starts
+  void build_directory() {
+    uint32_t tail_block = m_index.tail_block(m_head_block);
+    uint32_t block = m_head_block;
+    uint32_t first_docid = 0;
+    uint32_t chain_position = 0;
+    m_directory.push_back({block, 0, static_cast<uint32_t>(m_index.head_data_offset(block)),
+                           static_cast<uint32_t>(m_index.block_bytes(chain_position))});
+    block = m_index.next_block(block, tail_block);
+    while (block != END_CHAIN) {
+      ++chain_position;
+      size_t offset = TT_PL_OFFSET;
+      first_docid += m_index.access(block, offset).first;
+      m_directory.push_back({block, first_docid, static_cast<uint32_t>(TT_PL_OFFSET),
+                             static_cast<uint32_t>(m_index.block_bytes(chain_position))});
+      block = m_index.next_block(block, tail_block);
+    }
+  }
+
+  // Decodes every posting in the given directory entry into the buffers
+  void load_block(size_t entry) {
+    m_current_entry = entry;
+    m_docids.clear();
+    m_freqs.clear();
+    const auto& e = m_directory[entry];
+    size_t offset = e.m_data_offset;
+    uint32_t docid = e.m_first_docid;
+    bool first = true;
+    while (offset < e.m_data_bytes && m_index.has_data(e.m_block, offset)) {
+      auto data = m_index.access(e.m_block, offset);
+      // The first posting of a non-head block is a b-gap
+      if (first && entry != 0) {
+        docid = e.m_first_docid;
+      } else {
+        docid += data.first;
+      }
+      first = false;
+      m_docids.push_back(docid);
+      m_freqs.push_back(data.second);
+    }
+  }
+
+  // Cursor members
+  private:
+    immediate_index& m_index;
+    std::string m_term;
+    uint32_t m_head_block;
+    uint32_t m_doc_freq;
+    std::vector<block_directory_entry> m_directory;
+    size_t m_current_entry;
+    size_t m_current_posting;
+    std::vector<uint32_t> m_docids;
+    std::vector<uint32_t> m_freqs;
+    uint32_t m_current_docid;
+    uint32_t m_current_tf;
+};
+
+// Given an index and a query, return a vector of reverse cursors into the index
+std::vector<reverse_postings_cursor>
+query_to_reverse_cursors(immediate_index& index, query in_query) {
+
+  std::vector<reverse_postings_cursor> cursors;
+
+  // XXX assumes terms are unique!
+  for (auto term : in_query.m_terms) {
+    auto cursor = reverse_postings_cursor(index, term);
+    if (cursor.valid()) {
+      cursors.push_back(cursor);
+    }
+  }
+  return cursors;
+}
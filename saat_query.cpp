@@ -0,0 +1,83 @@
+#include "util.hpp"
+#include "query.hpp"
+#include "topk_queue.hpp"
+#include "impact_index.hpp"
+
+int main(int argc, const char **argv) {
+
+  if (argc < 4) {
+    std::cerr << "Usage: " << argv[0] << " <impact_index> <query_file> <k> [-v] [-p <postings_budget>]\n";
+    return -1;
+  }
+
+  bool verbose = false;
+  size_t budget = std::numeric_limits<size_t>::max(); // Anytime cutoff; by default we process everything
+  for (int i = 4; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-v")
+      verbose = true;
+    else if (arg == "-p" && i + 1 < argc)
+      budget = std::atol(argv[++i]);
+    else
+      std::cerr << "Ignoring unknown argument: " << arg << "\n";
+  }
+
+  std::cerr << "Index File: " << argv[1] << "\n";
+  std::cerr << "Query File: " << argv[2] << "\n";
+  size_t k = std::atol(argv[3]);
+  std::cerr << "k = " << k << "\n";
+  if (budget != std::numeric_limits<size_t>::max()) {
+    std::cerr << "Postings budget: " << budget << "\n";
+  }
+
+  std::cerr << "Reading the index...\n";
+  std::ifstream in_idx(argv[1], std::ios::binary);
+  impact_index my_idx;
+  my_idx.load(in_idx);
+
+  std::cerr << "Reading the query file...\n";
+  std::ifstream in_q(argv[2]);
+  auto queries = read_queries(in_q);
+
+  std::vector<double> query_times;
+
+  topk_queue heap(k);
+  saat_accumulators accumulators(my_idx.max_docid());
+
+  // For each query
+  for (size_t i = 0; i < queries.size(); ++i) {
+
+    // Clear the heap from the last query
+    heap.clear();
+
+    double start = get_time_usecs();
+    size_t processed = score_at_a_time(my_idx, queries[i], accumulators, heap, budget);
+    do_not_optimize_away(processed);
+    double stop = get_time_usecs() - start;
+
+    if (heap.size() > 0) {
+        query_times.push_back(stop);
+
+        if (verbose) {
+          std::cout << queries[i].m_id << " latency=" << stop << " postings=" << processed << "\n";
+        }
+    }
+  }
+
+  std::cerr << "Statistics computed over " << query_times.size() << " queries with at least one match.\n";
+
+  std::sort(query_times.begin(), query_times.end());
+  double average = std::accumulate(query_times.begin(), query_times.end(), double()) / query_times.size();
+  double p50 = query_times[query_times.size() / 2];
+  double p90 = query_times[90 * query_times.size() / 100];
+  double p95 = query_times[95 * query_times.size() / 100];
+  double p99 = query_times[99 * query_times.size() / 100];
+
+  std::cerr << "Latency -> Mean: " << average
+            << " Median: " << p50
+            << " p90: " << p90
+            << " p95: " << p95
+            << " p99: " << p99 << "\n";
+
+  return 0;
+}
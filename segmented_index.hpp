@@ -0,0 +1,366 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "util.hpp"
+#include "document_lengths.hpp"
+#include "background_snapshot.hpp"
+
+#ifdef VARIABLE_BLOCK
+#include "variable_immediate_index.hpp"
+#include "variable_postings_cursor.hpp"
+#else
+#include "immediate_index.hpp"
+#include "postings_cursor.hpp"
+#endif
+
+// Room left in the active segment past its budget, so that the document
+// which takes it over the budget still fits; more than any slab
+const size_t SEGMENT_SLACK_BLOCKS = size_t(1) << 16;
+
+// Two neighbouring segments are merged once the older is no more than
+// this many times the size of the newer, which keeps the number of
+// segments logarithmic in the size of the collection
+const size_t SEGMENT_MERGE_RATIO = 2;
+
+// An index kept as a run of segments, log-structured: documents go into an
+// active in-memory index, and once that reaches its budget of blocks it is
+// frozen and a fresh active index takes over. A frozen segment is packed
+// to disk (serialize_pack) and then mapped back in read-only in place of
+// its blocks, so memory is bounded by about twice the budget, and new
+// documents can be queried as soon as they are indexed.
+//
+// The segments hold consecutive runs of docids, oldest first, so a list
+// is the concatenation of its lists in each segment. Neighbouring frozen
+// segments are merged, one merge at a time, by replaying the postings of
+// both into a new index which is packed in turn; the merged segment then
+// replaces the two. Packing and merging are done in forked children (see
+// background_snapshot.hpp), which work on a view of the segments as they
+// were at the fork, so ingestion and queries carry on meanwhile; poll()
+// picks up their results.
+//
+// The segment files are <prefix>.seg.<n>; write_manifest lists them, in
+// order, for open() to map them all back in for querying
+class segmented_index {
+
+  public:
+    struct segment {
+      std::string m_filename;
+      std::shared_ptr<immediate_index> m_index;
+    };
+
+    // An index for querying only, see open()
+    segmented_index() : segmented_index("", 0, 0, 1) {}
+
+    segmented_index(const std::string& prefix, const size_t budget_blocks, const size_t hash_buckets,
+                    const size_t threads, const block_layout& layout = block_layout()) : m_prefix(prefix),
+                                                                                         m_budget_blocks(budget_blocks),
+                                                                                         m_hash_buckets(hash_buckets),
+                                                                                         m_threads(std::max(threads, size_t(1))),
+                                                                                         m_layout(layout),
+                                                                                         m_next_id(0),
+                                                                                         m_packing(false),
+                                                                                         m_merging(false),
+                                                                                         m_merge_first(0),
+                                                                                         m_freezes(0),
+                                                                                         m_merges(0) {
+      if (m_budget_blocks > 0) {
+        m_active = std::make_shared<immediate_index>(m_budget_blocks + SEGMENT_SLACK_BLOCKS, m_hash_buckets, m_layout);
+      }
+    }
+
+    segmented_index(const segmented_index&) = delete;
+    segmented_index& operator=(const segmented_index&) = delete;
+
+    bool insert(const uint32_t docid, const std::string& term, const uint32_t freq) {
+      return m_active->insert(docid, term, freq);
+    }
+
+    bool insert(const uint32_t docid, const std::string& term, const std::vector<uint32_t>& positions) {
+      return m_active->insert(docid, term, positions);
+    }
+
+    // Records the length of a document once its postings are inserted,
+    // then freezes the active segment if it has reached its budget
+    bool add_document(const uint32_t docid, const uint32_t length) {
+      if (!m_active->add_document(docid, length)) {
+        return false;
+      }
+      m_lengths.add(docid, length);
+      if (m_active->used_blocks() >= m_budget_blocks) {
+        return freeze();
+      }
+      return poll();
+    }
+
+    // Freezes the active segment and starts packing it, once the last
+    // segment to be frozen has been packed; then starts a merge if one is
+    // due and none is running
+    bool freeze() {
+      if (m_active->num_docs() == 0) {
+        return true;
+      }
+      if (m_packing && !collect_pack()) {
+        return false;
+      }
+      std::string filename = segment_filename(m_next_id++);
+      if (!m_packer.start(*m_active, filename, m_threads)) {
+        std::cerr << "__ERROR__: Could not start packing the active segment to " << filename << ".\n";
+        return false;
+      }
+      m_packing = true;
+      m_frozen.push_back(segment{filename, m_active});
+      m_active = std::make_shared<immediate_index>(m_budget_blocks + SEGMENT_SLACK_BLOCKS, m_hash_buckets, m_layout);
+      m_freezes += 1;
+      return poll();
+    }
+
+    // Puts the results of finished packing and merging in place, and then
+    // starts a merge if one is due. False if either failed
+    bool poll() {
+      bool changed = false;
+      if (m_packing && !m_packer.running()) {
+        if (!collect_pack()) {
+          return false;
+        }
+        changed = true;
+      }
+      if (m_merging && !m_merger.running()) {
+        if (!collect_merge()) {
+          return false;
+        }
+        changed = true;
+      }
+      return !changed || start_merge();
+    }
+
+    // Waits for the packing and merging to settle, until nothing is
+    // running or due
+    bool finish_merges() {
+      while (m_packing || m_merging) {
+        if ((m_packing && !collect_pack()) || (m_merging && !collect_merge()) || !start_merge()) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Freezes whatever is in the active segment, settles the merges and
+    // lists the segments in the manifest
+    bool close(const std::string& manifest) {
+      return freeze() && finish_merges() && write_manifest(manifest);
+    }
+
+    // The segment files, one per line and in docid order; the names are
+    // relative to the manifest, which sits with them
+    bool write_manifest(const std::string& manifest) const {
+      std::ofstream out(manifest);
+      for (const auto& frozen : m_frozen) {
+        out << basename(frozen.m_filename) << "\n";
+      }
+      out.close();
+      if (!out) {
+        std::cerr << "Could not write the manifest " << manifest << "\n";
+        return false;
+      }
+      return true;
+    }
+
+    // Maps in the segments listed in a manifest, for querying
+    bool open(const std::string& manifest) {
+      std::ifstream in(manifest);
+      if (!in) {
+        std::cerr << "Could not open the manifest " << manifest << "\n";
+        return false;
+      }
+      std::string directory = dirname(manifest);
+      std::string name;
+      while (std::getline(in, name)) {
+        if (name.empty()) {
+          continue;
+        }
+        auto frozen = std::make_shared<immediate_index>();
+        if (!frozen->map(directory + name)) {
+          return false;
+        }
+        const auto& lengths = frozen->doc_lengths();
+        for (size_t i = 0; i < lengths.num_docs(); ++i) {
+          m_lengths.add(lengths.first_docid() + i, lengths.length(lengths.first_docid() + i));
+        }
+        m_frozen.push_back(segment{directory + name, frozen});
+      }
+      return true;
+    }
+
+    // The segments to query, oldest first: the frozen ones, then the
+    // active one (if any). Holding them keeps them alive across a merge
+    std::vector<std::shared_ptr<immediate_index>> segments() const {
+      std::vector<std::shared_ptr<immediate_index>> all;
+      for (const auto& frozen : m_frozen) {
+        all.push_back(frozen.m_index);
+      }
+      if (m_active) {
+        all.push_back(m_active);
+      }
+      return all;
+    }
+
+    // The f_t of a term over all of the segments
+    uint32_t doc_freq(const std::string& term) const {
+      uint32_t doc_freq = 0;
+      for (const auto& index : segments()) {
+        uint32_t head_idx = index->get_offset(index->found_or_empty_offset(term));
+        if (head_idx != END_CHAIN) {
+          doc_freq += index->doc_freq(head_idx);
+        }
+      }
+      return doc_freq;
+    }
+
+    // The document lengths and collection statistics of all the segments
+    const document_lengths& doc_lengths() const {
+      return m_lengths;
+    }
+
+    size_t num_docs() const {
+      return m_lengths.num_docs();
+    }
+
+    size_t num_frozen() const {
+      return m_frozen.size();
+    }
+
+    size_t freezes() const {
+      return m_freezes;
+    }
+
+    size_t merges() const {
+      return m_merges;
+    }
+
+  private:
+    std::string segment_filename(const size_t id) const {
+      return m_prefix + ".seg." + std::to_string(id);
+    }
+
+    static std::string basename(const std::string& path) {
+      size_t slash = path.find_last_of('/');
+      return slash == std::string::npos ? path : path.substr(slash + 1);
+    }
+
+    static std::string dirname(const std::string& path) {
+      size_t slash = path.find_last_of('/');
+      return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    }
+
+    // Waits for the newest frozen segment to be packed, then maps it in
+    // place of its blocks, which are freed once no query holds them
+    bool collect_pack() {
+      m_packing = false;
+      auto& frozen = m_frozen.back();
+      auto mapped = std::make_shared<immediate_index>();
+      if (!m_packer.wait() || !mapped->map(frozen.m_filename)) {
+        std::cerr << "__ERROR__: Could not pack a frozen segment to " << frozen.m_filename << ".\n";
+        return false;
+      }
+      frozen.m_index = mapped;
+      return true;
+    }
+
+    // Starts merging the newest pair of packed neighbours which are close
+    // enough in size, unless a merge is running already
+    bool start_merge() {
+      if (m_merging) {
+        return true;
+      }
+      for (size_t i = m_frozen.size(); i >= 2; --i) {
+        auto older = m_frozen[i - 2].m_index;
+        auto newer = m_frozen[i - 1].m_index;
+        if (!older->mapped() || !newer->mapped() ||
+            older->used_blocks() > SEGMENT_MERGE_RATIO * newer->used_blocks()) {
+          continue;
+        }
+        std::string filename = segment_filename(m_next_id++);
+        const size_t hash_buckets = m_hash_buckets;
+        const size_t threads = m_threads;
+        if (!m_merger.run([=]() { return merge(*older, *newer, filename, hash_buckets, threads); })) {
+          std::cerr << "__ERROR__: Could not start merging into " << filename << ".\n";
+          return false;
+        }
+        m_merging = true;
+        m_merge_first = i - 2;
+        m_merged_filename = filename;
+        break;
+      }
+      return true;
+    }
+
+    // Waits for the merge, then puts the merged segment in place of its
+    // two inputs. Freezes only ever add segments after them
+    bool collect_merge() {
+      m_merging = false;
+      auto mapped = std::make_shared<immediate_index>();
+      if (!m_merger.wait() || !mapped->map(m_merged_filename)) {
+        std::cerr << "__ERROR__: Could not merge segments into " << m_merged_filename << ".\n";
+        return false;
+      }
+      // The inputs are unlinked; their mappings live on for as long as
+      // anything still holds them
+      std::remove(m_frozen[m_merge_first].m_filename.c_str());
+      std::remove(m_frozen[m_merge_first + 1].m_filename.c_str());
+      m_frozen[m_merge_first] = segment{m_merged_filename, mapped};
+      m_frozen.erase(m_frozen.begin() + m_merge_first + 1);
+      m_merges += 1;
+      return true;
+    }
+
+    // Run by the merging child: replays the postings of two neighbouring
+    // segments into a new index, older first so that each list stays in
+    // docid order, and packs that to the file
+    static bool merge(immediate_index& older, immediate_index& newer, const std::string& filename,
+                      const size_t hash_buckets, const size_t threads) {
+      immediate_index merged(older.used_blocks() + newer.used_blocks() + SEGMENT_SLACK_BLOCKS, hash_buckets,
+                             older.layout());
+      for (auto input : {&older, &newer}) {
+        for (const auto& term : input->vocabulary()) {
+          postings_cursor cursor(*input, term);
+          while (cursor.docid() != END_CHAIN) {
+            // Lists needn't pack into the same number of blocks once joined
+            if (merged.free_blocks() < SEGMENT_SLACK_BLOCKS) {
+              merged.reserve(2 * merged.used_blocks() + SEGMENT_SLACK_BLOCKS);
+            }
+            merged.insert(cursor.docid(), term, cursor.freq());
+            cursor.next();
+          }
+        }
+        const auto& lengths = input->doc_lengths();
+        for (size_t i = 0; i < lengths.num_docs(); ++i) {
+          merged.add_document(lengths.first_docid() + i, lengths.length(lengths.first_docid() + i));
+        }
+      }
+      return background_snapshot::write_packed(merged, filename, threads);
+    }
+
+    std::string m_prefix;
+    size_t m_budget_blocks;
+    size_t m_hash_buckets;
+    size_t m_threads;
+    block_layout m_layout;
+    size_t m_next_id;
+    std::shared_ptr<immediate_index> m_active;
+    std::vector<segment> m_frozen;
+    document_lengths m_lengths;
+
+    // While m_packing, the newest frozen segment is being packed; while
+    // m_merging, m_frozen[m_merge_first] and the one after it are being
+    // merged into m_merged_filename
+    background_snapshot m_packer;
+    background_snapshot m_merger;
+    bool m_packing;
+    bool m_merging;
+    size_t m_merge_first;
+    std::string m_merged_filename;
+
+    size_t m_freezes;
+    size_t m_merges;
+};
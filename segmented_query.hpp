@@ -0,0 +1,80 @@
+#pragma once
+
+#include "util.hpp"
+#include "query_processing.hpp"
+#include "parallel_query.hpp"
+#include "segmented_index.hpp"
+
+// Querying a segmented index: the query is run over each segment in turn,
+// as over the docid ranges of a parallel query, since the segments hold
+// disjoint runs of docids. Lists are weighted by their f_t over the whole
+// index, so that a document scores the same whichever segment it is in
+
+// The f_t of each term of the query over all of the segments
+std::vector<uint32_t> query_doc_freqs(segmented_index& index, const query& in_query) {
+  std::vector<uint32_t> doc_freqs;
+  for (const auto& term : in_query.m_terms) {
+    doc_freqs.push_back(index.doc_freq(term));
+  }
+  return doc_freqs;
+}
+
+// Cursors over the lists of one segment, each carrying the f_t of its
+// term over all of the segments. As over a single index, terms which
+// aren't in the index at all are left out; but for a conjunction, a term
+// missing from just this segment means nothing here can match
+std::vector<postings_cursor> segment_cursors(immediate_index& segment, const query& in_query,
+                                             const std::vector<uint32_t>& doc_freqs, const bool conjunctive) {
+  std::vector<postings_cursor> cursors;
+  for (size_t i = 0; i < in_query.m_terms.size(); ++i) {
+    const auto& term = in_query.m_terms[i];
+    if (doc_freqs[i] == 0) {
+      continue;
+    }
+    if (segment.get_offset(segment.found_or_empty_offset(term)) == END_CHAIN) {
+      if (conjunctive) {
+        return std::vector<postings_cursor>();
+      }
+      continue;
+    }
+    cursors.emplace_back(segment, term);
+    cursors.back().set_doc_freq(doc_freqs[i]);
+  }
+  return cursors;
+}
+
+// Runs a ranked algorithm (called as algorithm(cursors, heap, range)) over
+// each segment with a heap of its own, and merges the results into the
+// heap. Later segments are pruned against the threshold of the earlier
+template <typename Algorithm>
+size_t segmented_ranked(segmented_index& index, const query& in_query, const bool conjunctive, topk_queue& results,
+                        Algorithm algorithm) {
+  shared_threshold threshold;
+  docid_range range{0, END_CHAIN, &threshold};
+  auto segments = index.segments();
+  auto doc_freqs = query_doc_freqs(index, in_query);
+  std::vector<topk_queue> heaps(segments.size(), topk_queue(results.capacity(), results.initial_threshold()));
+  for (size_t i = 0; i < segments.size(); ++i) {
+    auto cursors = segment_cursors(*segments[i], in_query, doc_freqs, conjunctive);
+    if (!cursors.empty()) {
+      algorithm(cursors, heaps[i], range);
+    }
+  }
+  merge_topk(heaps, results);
+  return results.size();
+}
+
+// As above for a Boolean query (called as algorithm(cursors)), whose
+// matches are summed over the segments
+template <typename Algorithm>
+size_t segmented_boolean(segmented_index& index, const query& in_query, const bool conjunctive, Algorithm algorithm) {
+  size_t matches = 0;
+  auto doc_freqs = query_doc_freqs(index, in_query);
+  for (const auto& segment : index.segments()) {
+    auto cursors = segment_cursors(*segment, in_query, doc_freqs, conjunctive);
+    if (!cursors.empty()) {
+      matches += algorithm(cursors);
+    }
+  }
+  return matches;
+}
@@ -6,11 +6,19 @@
 #include <chrono>
 #include <memory>
 #include <functional>
-#include <unordered_set>
-#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <queue>
+#include <atomic>
+#include <thread>
 #include <numeric>
+#include <cstring>
+#include <cstdio>
 #include <type_traits>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 // Pisa indexes are made up of five files
 // Three are binary u32 sequences as follows
 // .docs
@@ -19,116 +27,444 @@
 // [<|l1| <f_1,l1> <f_2,l1> ...]
 // .sizes
 // <|D| |doc_1| |doc_2| ...>
-
+// The other two are text: the terms (.terms) in list order, and the
+// document identifiers (.documents) in docid order.
+// We also write .interleaved, which is each list in turn as
+// <dgap, freq> pairs (the first dgap being the docid), with no lengths
+
+// The postings are built in external memory. Documents are read into a
+// buffer of <term, docid, freq> postings; once that reaches the memory
+// budget, it is sorted into term order (docids are already in order) and
+// spilled to disk as a run. Each run is a sequence of lists, each written
+// as <termid, |l|, <d, f> ...>, and we keep the offset of each list.
+// The terms themselves stay in memory along with their f_t, so once the
+// stream is read, every list's place in each output file is known. The
+// runs are then merged: the lists are cut into ranges of terms, and each
+// range is merged by a thread of its own (a k-way merge over the runs)
+// and written in place with pwrite, a large buffer at a time.
+const size_t DEFAULT_BUDGET_MIB = 1024;
+const size_t RANGES_PER_THREAD = 4;
+const size_t WRITE_BUFFER_BYTES = size_t(1) << 20;
+const size_t MIN_READ_BUFFER_BYTES = size_t(64) << 10;
+const size_t MAX_READ_BUFFER_BYTES = size_t(4) << 20;
 
 struct posting {
   uint32_t docid;
   uint32_t freq;
 
+  posting() = default;
   posting(uint32_t d, uint32_t f) : docid(d), freq(f) {}
 
 };
 
+// A posting waiting in the buffer for its run
+struct buffered_posting {
+  uint32_t termid;
+  uint32_t docid;
+  uint32_t freq;
+};
+
+// Where a list starts in a run
+struct run_list {
+  uint32_t termid;
+  uint64_t offset;
+};
+
+struct sorted_run {
+  std::string filename;
+  std::vector<run_list> lists; // In term order
+};
+
+bool write_at(int fd, const void* data, size_t bytes, size_t offset) {
+  const char* from = static_cast<const char*>(data);
+  while (bytes > 0) {
+    ssize_t written = pwrite(fd, from, bytes, offset);
+    if (written <= 0) {
+      return false;
+    }
+    from += written;
+    bytes -= written;
+    offset += written;
+  }
+  return true;
+}
+
+// Buffers u32s bound for consecutive offsets of a file
+class offset_writer {
+
+  public:
+    offset_writer(int fd, size_t offset) : m_fd(fd), m_offset(offset), m_ok(true) {
+      m_buffer.reserve(WRITE_BUFFER_BYTES / sizeof(uint32_t));
+    }
+
+    void append(uint32_t value) {
+      if (m_buffer.size() == m_buffer.capacity()) {
+        flush();
+      }
+      m_buffer.push_back(value);
+    }
+
+    bool flush() {
+      size_t bytes = m_buffer.size() * sizeof(uint32_t);
+      m_ok = m_ok && write_at(m_fd, m_buffer.data(), bytes, m_offset);
+      m_offset += bytes;
+      m_buffer.clear();
+      return m_ok;
+    }
+
+  private:
+    int m_fd;
+    size_t m_offset;
+    bool m_ok;
+    std::vector<uint32_t> m_buffer;
+};
+
+// Reads a run sequentially from some offset, a buffer at a time
+class run_reader {
+
+  public:
+    run_reader(int fd, uint64_t offset, size_t buffer_bytes) : m_fd(fd), m_offset(offset),
+                                                               m_buffer(buffer_bytes), m_pos(0), m_end(0) {}
+
+    bool read(void* data, size_t bytes) {
+      char* to = static_cast<char*>(data);
+      while (bytes > 0) {
+        if (m_pos == m_end && !fill()) {
+          return false;
+        }
+        size_t take = std::min(bytes, m_end - m_pos);
+        std::memcpy(to, m_buffer.data() + m_pos, take);
+        m_pos += take;
+        to += take;
+        bytes -= take;
+      }
+      return true;
+    }
+
+  private:
+    bool fill() {
+      ssize_t got = pread(m_fd, m_buffer.data(), m_buffer.size(), m_offset);
+      if (got <= 0) {
+        return false;
+      }
+      m_offset += got;
+      m_pos = 0;
+      m_end = got;
+      return true;
+    }
+
+    int m_fd;
+    uint64_t m_offset;
+    std::vector<char> m_buffer;
+    size_t m_pos;
+    size_t m_end;
+};
+
 struct inverted_index {
 
-  std::map<std::string, std::vector<posting>> index;
-  std::vector<uint32_t> doclen;
-  std::vector<std::string> docmap;
+  std::string basename;
+  size_t budget_postings;
+  size_t threads;
+
+  std::unordered_map<std::string, uint32_t> termids;
+  std::vector<std::string> terms;       // By termid
+  std::vector<uint32_t> doc_freqs;      // By termid
+  std::vector<buffered_posting> buffer;
+  std::vector<sorted_run> runs;
+  uint32_t doc_count = 0;
+  size_t spilled_postings = 0;
+
+  // Counts by termid while a run is sorted; zero in between
+  std::vector<uint32_t> run_counts;
+
+  inverted_index(const std::string& base, size_t budget_bytes, size_t num_threads)
+      : basename(base), threads(std::max(num_threads, size_t(1))) {
+    // The buffer is sorted into a second one of the same length
+    budget_postings = std::max(budget_bytes / (sizeof(buffered_posting) + sizeof(posting)), size_t(1));
+    buffer.reserve(budget_postings);
+  }
 
-  void serialize(std::string basename) {
+  uint32_t termid(const std::string& term) {
+    auto it = termids.find(term);
+    if (it != termids.end()) {
+      return it->second;
+    }
+    uint32_t id = terms.size();
+    termids.emplace(term, id);
+    terms.push_back(term);
+    doc_freqs.push_back(0);
+    return id;
+  }
 
-    // Plaintext out
-    std::ofstream out_lexicon(basename + ".terms");
-    std::ofstream out_docmap(basename + ".documents");
-    
-    // Binary out
-    std::ofstream out_docs(basename + ".docs");
-    std::ofstream out_freqs(basename + ".freqs");
-    std::ofstream out_sizes(basename + ".sizes");
-   
-    if (docmap.size() != doclen.size()) {
-      std::cerr << "Error: docmap and doclen should have the same size.\n";
-      return;
-    }
-
-    // Write header
-    uint32_t one = 1;
-    uint32_t doc_count = docmap.size();
-    out_docs.write(reinterpret_cast<char *>(&one), sizeof(uint32_t));
-    out_docs.write(reinterpret_cast<char *>(&doc_count), sizeof(uint32_t));
-    out_sizes.write(reinterpret_cast<char *>(&doc_count), sizeof(uint32_t));
-
-    for (size_t i = 0; i < docmap.size(); ++i) {
-      // Write docmap 
-      out_docmap << docmap[i] << "\n";
-
-      uint32_t len = doclen[i];
-      // and doclens
-      out_sizes.write(reinterpret_cast<char *>(&len), sizeof(uint32_t));
-    }
-
-    for (auto it = index.begin(); it != index.end(); ++it) {
-  
-      // Write lexicon
-      out_lexicon << it->first << "\n";
-
-      // Write pl
-      auto list = it->second;
-
-      uint32_t count = list.size();
-      out_docs.write(reinterpret_cast<char *>(&count), sizeof(uint32_t));
-      out_freqs.write(reinterpret_cast<char *>(&count), sizeof(uint32_t));
-
-
-      for (auto & posting : list) {
-        uint32_t docid = posting.docid;
-        uint32_t freq = posting.freq;
-        out_docs.write(reinterpret_cast<char *>(&docid), sizeof(uint32_t));
-        out_freqs.write(reinterpret_cast<char *>(&freq), sizeof(uint32_t));
+  // Adds a document as its termids (in any order, with repeats)
+  bool add_document(std::vector<uint32_t>& doc_terms) {
+    std::sort(doc_terms.begin(), doc_terms.end());
+    for (size_t i = 0; i < doc_terms.size(); ) {
+      size_t j = i;
+      while (j < doc_terms.size() && doc_terms[j] == doc_terms[i]) {
+        ++j;
+      }
+      if (buffer.size() == budget_postings && !spill()) {
+        return false;
       }
+      buffer.push_back(buffered_posting{doc_terms[i], doc_count, uint32_t(j - i)});
+      doc_freqs[doc_terms[i]] += 1;
+      i = j;
     }
+    doc_count++;
+    return true;
   }
 
-  void serialize_postings_into_interleaved(std::string basename) {
-
-    std::ofstream out(basename + ".interleaved");
-    for (auto it = index.begin(); it != index.end(); ++it) {
-      auto list = it->second;
-      uint32_t count = list.size();
-      bool first = true;
-      uint32_t prev_docid = 0;
-      for (auto & posting : list) {
-        uint32_t dgap = 0;
-        uint32_t docid = posting.docid;
-        uint32_t freq = posting.freq;
-        if (first) {
-          dgap = docid;
-          first = false;
-        } else {
-          dgap = docid - prev_docid;
+  // Sorts the buffer into term order (a counting sort, which keeps the
+  // docids of each list in order) and writes it out as a run
+  bool spill() {
+    if (buffer.empty()) {
+      return true;
+    }
+    run_counts.resize(terms.size(), 0);
+    std::vector<uint32_t> run_terms;
+    for (const auto& p : buffer) {
+      if (run_counts[p.termid]++ == 0) {
+        run_terms.push_back(p.termid);
+      }
+    }
+    std::sort(run_terms.begin(), run_terms.end(), [&](uint32_t l, uint32_t r) {
+      return terms[l] < terms[r];
+    });
+
+    // Each list is <termid, |l|> and then its postings
+    sorted_run run;
+    run.filename = basename + ".run." + std::to_string(runs.size());
+    std::vector<size_t> starts(terms.size());
+    size_t words = 0;
+    for (auto id : run_terms) {
+      run.lists.push_back(run_list{id, words * sizeof(uint32_t)});
+      words += 2;
+      starts[id] = words / 2;
+      words += 2 * size_t(run_counts[id]);
+    }
+    std::vector<posting> sorted(words / 2);
+    for (auto id : run_terms) {
+      sorted[starts[id] - 1] = posting(id, run_counts[id]);
+      run_counts[id] = 0;
+    }
+    for (const auto& p : buffer) {
+      sorted[starts[p.termid]++] = posting(p.docid, p.freq);
+    }
+
+    int fd = ::open(run.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd >= 0 && write_at(fd, sorted.data(), sorted.size() * sizeof(posting), 0);
+    if (fd < 0 || close(fd) != 0 || !written) {
+      std::cerr << "Error: could not write the run " << run.filename << "\n";
+      return false;
+    }
+    spilled_postings += buffer.size();
+    buffer.clear();
+    runs.push_back(std::move(run));
+    return true;
+  }
+
+  // Merges the runs into .docs, .freqs and .interleaved, and writes .terms
+  bool merge() {
+    if (!spill()) {
+      return false;
+    }
+
+    // The terms in list order; rank[termid] is the place of each
+    std::vector<uint32_t> order(terms.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](uint32_t l, uint32_t r) {
+      return terms[l] < terms[r];
+    });
+    std::vector<uint32_t> rank(terms.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      rank[order[i]] = i;
+    }
+
+    // The postings before each list, from which its offsets follow
+    std::vector<size_t> postings_before(order.size() + 1, 0);
+    for (size_t i = 0; i < order.size(); ++i) {
+      postings_before[i + 1] = postings_before[i] + doc_freqs[order[i]];
+    }
+
+    // Ranges of lists with about the same number of postings
+    size_t num_ranges = threads * RANGES_PER_THREAD;
+    size_t range_postings = postings_before.back() / num_ranges + 1;
+    std::vector<size_t> range_starts(1, 0);
+    for (size_t i = 0; i < order.size(); ++i) {
+      if (postings_before[i] - postings_before[range_starts.back()] >= range_postings) {
+        range_starts.push_back(i);
+      }
+    }
+    range_starts.push_back(order.size());
+
+    int docs_fd = ::open((basename + ".docs").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int freqs_fd = ::open((basename + ".freqs").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int inter_fd = ::open((basename + ".interleaved").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    std::vector<int> run_fds;
+    for (const auto& run : runs) {
+      run_fds.push_back(::open(run.filename.c_str(), O_RDONLY));
+    }
+    bool opened = docs_fd >= 0 && freqs_fd >= 0 && inter_fd >= 0 &&
+                  std::find(run_fds.begin(), run_fds.end(), -1) == run_fds.end();
+
+    // The readers of the ranges being merged share the budget
+    size_t read_buffer = (budget_postings * (sizeof(buffered_posting) + sizeof(posting))) /
+                         (threads * std::max(runs.size(), size_t(1)));
+    read_buffer = std::min(std::max(read_buffer, MIN_READ_BUFFER_BYTES), MAX_READ_BUFFER_BYTES);
+
+    std::atomic<size_t> next_range(0);
+    std::atomic<bool> failed(!opened);
+    auto merge_ranges = [&]() {
+      size_t r;
+      while (!failed && (r = next_range++) + 1 < range_starts.size()) {
+        if (!merge_range(range_starts[r], range_starts[r + 1], rank, postings_before, run_fds,
+                         docs_fd, freqs_fd, inter_fd, read_buffer)) {
+          failed = true;
         }
-        prev_docid = docid;
-        out.write(reinterpret_cast<char *>(&dgap), sizeof(uint32_t));
-        out.write(reinterpret_cast<char *>(&freq), sizeof(uint32_t));
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; ++t) {
+      workers.emplace_back(merge_ranges);
+    }
+    merge_ranges();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+
+    uint32_t header[2] = {1, doc_count};
+    bool written = !failed && write_at(docs_fd, header, sizeof(header), 0);
+    for (int fd : {docs_fd, freqs_fd, inter_fd}) {
+      written = fd >= 0 && close(fd) == 0 && written;
+    }
+    for (size_t i = 0; i < runs.size(); ++i) {
+      if (run_fds[i] >= 0) {
+        close(run_fds[i]);
+      }
+      std::remove(runs[i].filename.c_str());
+    }
+
+    std::ofstream out_lexicon(basename + ".terms");
+    for (auto id : order) {
+      out_lexicon << terms[id] << "\n";
+    }
+    out_lexicon.close();
+    if (!written || !out_lexicon) {
+      std::cerr << "Error: could not write the index " << basename << "\n";
+      return false;
+    }
+    return true;
+  }
+
+  // A k-way merge of the lists ranked [first, last) over all of the runs.
+  // A list's postings come from the runs in order, since the runs hold
+  // increasing docids
+  bool merge_range(size_t first, size_t last, const std::vector<uint32_t>& rank,
+                   const std::vector<size_t>& postings_before, const std::vector<int>& run_fds,
+                   int docs_fd, int freqs_fd, int inter_fd, size_t read_buffer) {
+    // Each list takes 1 + f_t u32s in .docs (after its header) and .freqs,
+    // and 2 f_t in .interleaved
+    offset_writer docs(docs_fd, sizeof(uint32_t) * (2 + first + postings_before[first]));
+    offset_writer freqs(freqs_fd, sizeof(uint32_t) * (first + postings_before[first]));
+    offset_writer inter(inter_fd, sizeof(posting) * postings_before[first]);
+
+    // The next list of each run within the range, by (rank, run)
+    std::vector<std::unique_ptr<run_reader>> readers(runs.size());
+    std::vector<size_t> next_list(runs.size());
+    typedef std::pair<uint32_t, size_t> cursor;
+    std::priority_queue<cursor, std::vector<cursor>, std::greater<cursor>> heap;
+    for (size_t i = 0; i < runs.size(); ++i) {
+      const auto& lists = runs[i].lists;
+      auto it = std::lower_bound(lists.begin(), lists.end(), first, [&](const run_list& l, size_t r) {
+        return rank[l.termid] < r;
+      });
+      next_list[i] = it - lists.begin();
+      if (it != lists.end() && rank[it->termid] < last) {
+        readers[i].reset(new run_reader(run_fds[i], it->offset, read_buffer));
+        heap.emplace(rank[it->termid], i);
+      }
+    }
+
+    size_t current = last;
+    uint32_t prev_docid = 0;
+    std::vector<posting> postings;
+    while (!heap.empty()) {
+      auto top = heap.top();
+      heap.pop();
+      size_t i = top.second;
+      posting head;
+      if (!readers[i]->read(&head, sizeof(posting))) {
+        return false;
+      }
+      if (top.first != current) {
+        current = top.first;
+        uint32_t count = postings_before[current + 1] - postings_before[current];
+        docs.append(count);
+        freqs.append(count);
+        prev_docid = 0;
+      }
+      postings.resize(head.freq);
+      if (!readers[i]->read(postings.data(), postings.size() * sizeof(posting))) {
+        return false;
+      }
+      for (const auto& p : postings) {
+        docs.append(p.docid);
+        freqs.append(p.freq);
+        inter.append(p.docid - prev_docid);
+        inter.append(p.freq);
+        prev_docid = p.docid;
+      }
+      size_t next = ++next_list[i];
+      if (next < runs[i].lists.size() && rank[runs[i].lists[next].termid] < last) {
+        heap.emplace(rank[runs[i].lists[next].termid], i);
       }
     }
+    return docs.flush() && freqs.flush() && inter.flush();
   }
 
 };
 
 int main(int argc, const char **argv) {
 
-  if (argc != 3) {
-    std::cerr << "Usage: " << argv[0] << " <docstream> <output basename>\n"; 
+  if (argc < 3 || argc % 2 == 0) {
+    std::cerr << "Usage: " << argv[0] << " <docstream> <output basename> [-m <MiB>] [-t <threads>]\n";
     return -1;
   }
 
-  inverted_index idx;
+  size_t budget_mib = DEFAULT_BUDGET_MIB;
+  size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+  for (int i = 3; i < argc; i += 2) {
+    std::string flag(argv[i]);
+    if (flag == "-m") {
+      budget_mib = std::stoull(argv[i + 1]);
+    } else if (flag == "-t") {
+      threads = std::stoull(argv[i + 1]);
+    } else {
+      std::cerr << "Unknown option " << flag << "\n";
+      return -1;
+    }
+  }
+
+  std::string basename(argv[2]);
+  inverted_index idx(basename, budget_mib << 20, threads);
 
   std::ifstream in(argv[1]);
- 
+  if (!in) {
+    std::cerr << "Error: could not open " << argv[1] << "\n";
+    return -1;
+  }
+
+  // The document map and lengths are written as we go; the count at the
+  // head of .sizes is filled in at the end
+  std::ofstream out_docmap(basename + ".documents");
+  std::ofstream out_sizes(basename + ".sizes", std::ios::binary);
+  uint32_t doc_count = 0;
+  out_sizes.write(reinterpret_cast<char *>(&doc_count), sizeof(uint32_t));
+
+  auto start = std::chrono::steady_clock::now();
   std::string line;
-  uint32_t docid = 0;
+  std::vector<uint32_t> doc_terms;
 
   // For each doc
   while (std::getline(in, line)) {
@@ -136,30 +472,37 @@ int main(int argc, const char **argv) {
     std::string sdocid;
     std::istringstream line_data(line);
     line_data >> sdocid;
-    idx.docmap.push_back(sdocid);
-    
-    std::string term;
-    uint32_t len = 0;
-    std::map<std::string, uint32_t> local_stats;
+    out_docmap << sdocid << "\n";
 
+    std::string term;
+    doc_terms.clear();
     while (line_data >> term) {
-      local_stats[term]+=1;
-      len++;
+      doc_terms.push_back(idx.termid(term));
     }
-    idx.doclen.push_back(len);
-   
-    // Freq count 
-    for (auto & p : local_stats) {
-      idx.index[p.first].emplace_back(docid, p.second);
+    uint32_t len = doc_terms.size();
+    out_sizes.write(reinterpret_cast<char *>(&len), sizeof(uint32_t));
+
+    if (!idx.add_document(doc_terms)) {
+      return -1;
     }
-    docid++;
+  }
+  doc_count = idx.doc_count;
+  out_sizes.seekp(0);
+  out_sizes.write(reinterpret_cast<char *>(&doc_count), sizeof(uint32_t));
+  out_docmap.close();
+  out_sizes.close();
+  if (!out_docmap || !out_sizes) {
+    std::cerr << "Error: could not write " << basename << ".documents or .sizes\n";
+    return -1;
   }
 
-  //idx.serialize(argv[2]);
-  idx.serialize_postings_into_interleaved(argv[2]);
-
-
+  auto parsed = std::chrono::steady_clock::now();
+  if (!idx.merge()) {
+    return -1;
+  }
+  auto merged = std::chrono::steady_clock::now();
+  std::cerr << "Read " << doc_count << " documents into " << idx.runs.size() << " runs in "
+            << std::chrono::duration<double>(parsed - start).count() << "s; merged in "
+            << std::chrono::duration<double>(merged - parsed).count() << "s\n";
 
 }
-
-
@@ -1,4 +1,7 @@
 #include "util.hpp"
+#include "write_ahead_log.hpp"
+#include "background_snapshot.hpp"
+#include "segmented_index.hpp"
 
 #ifdef VARIABLE_BLOCK
 #include "variable_immediate_index.hpp"
@@ -10,14 +13,59 @@
 
 
 // CONFIGURE ME!
-constexpr bool positions = false;
 constexpr bool sort_serialize = true; 
 constexpr bool dummy = false;
 
 int main(int argc, const char **argv) {
 
-  if (argc != 3) {
-    std::cerr << "Usage: " << argv[0] << " [wsj1|robust|wiki] <output_file> < /path/to/docstream\n";
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " [wsj1|robust|wiki] <output_file> [-p] [-c <docs>] [-l <log_file> [-g <docs>] [-y <groups>]] [-R] [-S <docs>] [-M <MiB>] [-L <layout>] < /path/to/docstream\n";
+    return EXIT_FAILURE;
+  }
+
+  bool positions = false;     // If set, index the positions of each term, for phrase_query
+  size_t checkpoint_docs = 0; // If set, checkpoint the index every so many documents
+  std::string log_path;       // If set, log every document here before indexing it
+  size_t group_docs = 256;    // ... committing the log in groups of this many documents
+  size_t sync_groups = 1;     // ... and syncing it every so many groups
+  bool resume = false;        // If set, recover from the checkpoints and log, then carry on
+  size_t snapshot_docs = 0;   // If set, write a packed snapshot in the background every so many documents
+  size_t segment_mib = 0;     // If set, index into segments of at most this size, see segmented_index.hpp
+  std::string layout_spec;    // If set, how the chains grow: fixed, expon, triangle or a table, see block_layout.hpp
+  for (int i = 3; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-p")
+      positions = true;
+    else if (arg == "-c" && i + 1 < argc)
+      checkpoint_docs = std::atol(argv[++i]);
+    else if (arg == "-l" && i + 1 < argc)
+      log_path = argv[++i];
+    else if (arg == "-g" && i + 1 < argc)
+      group_docs = std::atol(argv[++i]);
+    else if (arg == "-y" && i + 1 < argc)
+      sync_groups = std::atol(argv[++i]);
+    else if (arg == "-R")
+      resume = true;
+    else if (arg == "-S" && i + 1 < argc)
+      snapshot_docs = std::atol(argv[++i]);
+    else if (arg == "-M" && i + 1 < argc)
+      segment_mib = std::atol(argv[++i]);
+    else if (arg == "-L" && i + 1 < argc)
+      layout_spec = argv[++i];
+    else
+      std::cerr << "Ignoring unknown argument: " << arg << "\n";
+  }
+  block_layout layout;
+  if (!layout_spec.empty() && !block_layout::parse(layout_spec, layout)) {
+    return EXIT_FAILURE;
+  }
+  layout.set_positions(positions);
+  if (!log_path.empty() && (positions || dummy)) {
+    std::cerr << "The log holds f_dt only, so it can't be used for positional (-p) or dummy indexing\n";
+    return EXIT_FAILURE;
+  }
+  if (segment_mib > 0 && (positions || dummy || checkpoint_docs > 0 || !log_path.empty() || resume || snapshot_docs > 0)) {
+    std::cerr << "A segmented index (-M) holds f_dt only, and can't be combined with -p, -c, -l, -R or -S\n";
     return EXIT_FAILURE;
   }
 
@@ -26,6 +74,7 @@ int main(int argc, const char **argv) {
   std::cerr << "Dummy Indexing? " << dummy << "\n";
   std::cerr << "Block Size = " << BLOCK_SIZE << "\n";
   std::cerr << "Magic F = " << MAGIC_F << "\n";
+  std::cerr << "Layout = " << layout.name() << (resume ? " (unless resuming an index with another)" : "") << "\n";
 
 
   std::string output_path = std::string(argv[2]);
@@ -48,7 +97,109 @@ int main(int argc, const char **argv) {
   std::cerr << "Indexing from stream...\n";
   auto start = get_time_usecs();
 
-  immediate_index my_idx(idx_blocks, hash_buckets);
+  immediate_index my_idx;
+  uint32_t docid = 1;
+
+  // The checkpoints follow on from a dump of the (empty) index. To resume,
+  // that dump and the checkpoints are read back, and then any documents
+  // in the log which came after the last checkpoint are indexed again
+  const std::string base_path = output_path + ".base";
+  auto checkpoint_path = [&](size_t n) { return output_path + ".ckpt." + std::to_string(n); };
+  size_t checkpoints = 0;
+  size_t log_bytes = 0;
+  std::ifstream in_base;
+  if (resume) {
+    in_base.open(base_path, std::ios::binary);
+  }
+  // With -M, the active segment takes the place of the index
+  std::unique_ptr<segmented_index> segments;
+  if (segment_mib > 0) {
+    segments = std::make_unique<segmented_index>(output_path, (segment_mib << 20) / BLOCK_SIZE, hash_buckets,
+                                                 std::max(std::thread::hardware_concurrency(), 1u), layout);
+    std::cerr << "Segments of " << segment_mib << " MiB, listed in " << output_path << "\n";
+  } else if (!in_base.is_open()) {
+    my_idx = immediate_index(idx_blocks, hash_buckets, layout);
+  }
+  if (resume) {
+    if (in_base.is_open()) {
+      if (!my_idx.load(in_base)) {
+        return EXIT_FAILURE;
+      }
+      if (my_idx.layout().positions() != positions) {
+        std::cerr << "__ERROR__: The index was built " << (positions ? "without" : "with")
+                  << " positions; resume it " << (positions ? "without" : "with") << " -p.\n";
+        return EXIT_FAILURE;
+      }
+      std::ifstream in_checkpoint(checkpoint_path(checkpoints + 1), std::ios::binary);
+      while (in_checkpoint) {
+        if (!my_idx.apply_checkpoint(in_checkpoint)) {
+          return EXIT_FAILURE;
+        }
+        checkpoints += 1;
+        in_checkpoint = std::ifstream(checkpoint_path(checkpoints + 1), std::ios::binary);
+      }
+      my_idx.reserve(idx_blocks);
+    }
+    uint32_t restored = my_idx.doc_lengths().last_docid();
+    size_t replayed = 0;
+    bool replay_failed = false;
+    if (!log_path.empty()) {
+      log_bytes = write_ahead_log::replay(log_path, [&](const logged_document& logged) {
+        if (replay_failed || logged.m_docid <= my_idx.doc_lengths().last_docid()) {
+          return;
+        }
+        for (const auto& posting : logged.m_terms) {
+          my_idx.insert(logged.m_docid, posting.first, posting.second);
+        }
+        if (!my_idx.add_document(logged.m_docid, logged.m_length)) {
+          replay_failed = true;
+        }
+        replayed += 1;
+      });
+    }
+    if (replay_failed) {
+      return EXIT_FAILURE;
+    }
+    docid = my_idx.doc_lengths().last_docid() + 1;
+    std::cerr << "Resumed from " << checkpoints << " checkpoints (" << restored << " documents) and "
+              << replayed << " logged documents; the stream continues from document " << docid << "\n";
+  } else if (checkpoint_docs > 0 && !dummy) {
+    std::ofstream out_base(base_path + ".partial", std::ios::binary);
+    my_idx.serialize(out_base);
+    out_base.close();
+    if (!out_base || !rename_synced(base_path + ".partial", base_path)) {
+      std::cerr << "__ERROR__: Could not write " << base_path << ".\n";
+      return EXIT_FAILURE;
+    }
+  }
+  if (checkpoint_docs > 0) {
+    std::cerr << "Checkpointing every " << checkpoint_docs << " documents\n";
+  }
+
+  write_ahead_log log(group_docs, sync_groups);
+  if (!log_path.empty()) {
+    std::cerr << "Logging to " << log_path << " in groups of " << group_docs << " documents, synced every "
+              << sync_groups << " groups\n";
+    if (!log.open(log_path, log_bytes)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Snapshots are written by a child process while we carry on
+  background_snapshot snapshot;
+  const std::string snapshot_path = output_path + ".snap";
+  const size_t snapshot_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  size_t snapshots_skipped = 0;
+  double max_snapshot_pause = 0;
+  if (snapshot_docs > 0) {
+    std::cerr << "Snapshotting to " << snapshot_path << " every " << snapshot_docs << " documents\n";
+  }
+
+  // Find out now, rather than at every document, if the index can't be
+  // added to
+  if (!segments && !dummy && !my_idx.writable()) {
+    return EXIT_FAILURE;
+  }
 
   // Read the file line-by-line out of stdin
   std::string document;
@@ -56,8 +207,8 @@ int main(int argc, const char **argv) {
   std::string term;
   std::unordered_map<std::string, std::vector<uint32_t>> term_to_pos;
   term_to_pos.reserve(1024); // Just a guess; we don't want the table resizing
-  uint32_t docid = 1;
   size_t postings_count = 0;
+  size_t long_postings = 0; // of terms too long to keep, which are skipped
   size_t words_count = 0;
   while (std::getline(std::cin, document)) {
   
@@ -71,22 +222,70 @@ int main(int argc, const char **argv) {
       term_to_pos[term].push_back(position);
       position++;
     }
+    // Log the document before indexing it
+    if (!log_path.empty() && !log.append(docid, position-1, term_to_pos)) {
+      return EXIT_FAILURE;
+    }
+
     // We now have the terms and their positions, so we can index
     for (auto & element : term_to_pos) {
       if (dummy) { // Don't index anything, just check the lengths
         size_t vec_size = element.second.size();
         do_not_optimize_away(vec_size);
       } else { // OK, legit indexing here
-        if (positions) { 
-          my_idx.insert_positions(docid, element.first, element.second);
+        bool inserted = false;
+        if (segments) {
+          inserted = segments->insert(docid, element.first, element.second);
+        } else if (positions) { 
+          inserted = my_idx.insert_positions(docid, element.first, element.second);
         } else {
-          my_idx.insert(docid, element.first, element.second);
+          inserted = my_idx.insert(docid, element.first, element.second);
+        }
+        // The index is writable (see above), so the term was too long
+        if (!inserted) {
+          long_postings += 1;
         }
       }
     }
     
+    if (segments) {
+      if (!segments->add_document(docid, position-1)) {
+        return EXIT_FAILURE;
+      }
+    } else if (!dummy && !my_idx.add_document(docid, position-1)) {
+      return EXIT_FAILURE;
+    }
+
     postings_count += term_to_pos.size();
     words_count += position-1;
+
+    if (checkpoint_docs > 0 && !dummy && docid % checkpoint_docs == 0) {
+      auto checkpoint_start = get_time_usecs();
+      checkpoints += 1;
+      // It is written aside and renamed into place once on disk, so that
+      // a crash part way through leaves no checkpoint rather than half of
+      // one; the log still holds its documents until then
+      const std::string partial = checkpoint_path(checkpoints) + ".partial";
+      std::ofstream out_checkpoint(partial, std::ios::binary);
+      size_t pages = my_idx.checkpoint(out_checkpoint);
+      out_checkpoint.close();
+      // Once the checkpoint is safely on disk, the log can start again
+      if (!out_checkpoint || !rename_synced(partial, checkpoint_path(checkpoints)) ||
+          (!log_path.empty() && !log.truncate())) {
+        std::cerr << "__ERROR__: Could not make checkpoint " << checkpoints << " durable.\n";
+        return EXIT_FAILURE;
+      }
+      std::cerr << "Checkpoint " << checkpoints << ": " << pages << " pages in "
+                << (get_time_usecs() - checkpoint_start)/1000.0 << " milliseconds\n";
+    }
+    if (snapshot_docs > 0 && !dummy && docid % snapshot_docs == 0) {
+      auto snapshot_start = get_time_usecs();
+      if (snapshot.start(my_idx, snapshot_path, snapshot_threads)) {
+        max_snapshot_pause = std::max(max_snapshot_pause, get_time_usecs() - snapshot_start);
+      } else {
+        snapshots_skipped += 1; // the last one is still being written
+      }
+    }
     docid += 1;
 
     //std::cout << docid-1 << " " << get_time_usecs() - doctime << "\n";
@@ -97,15 +296,39 @@ int main(int argc, const char **argv) {
   std::cerr << "That's about " << time_micro / docid-1 << " micro/doc, or " 
            << time_micro / postings_count << " micro/posting, or "
            << time_micro / words_count << " micro/word\n";
+  if (long_postings > 0) {
+    std::cerr << "Skipped " << long_postings << " postings of terms of " << HEAD_BYTES << " bytes or more\n";
+  }
+
+  if (snapshot_docs > 0) {
+    snapshot.wait();
+    std::cerr << "Snapshots: " << snapshot.taken() << " written, " << snapshot.failed() << " failed, "
+              << snapshots_skipped << " skipped while the last was being written; the longest pause to start one was "
+              << max_snapshot_pause/1000.0 << " milliseconds\n";
+  }
 
   // Also time the serialization
-  if (!dummy) {
-    std::ofstream out_idx(output_path, std::ios::binary);
+  if (segments) {
+    auto serialize_start = get_time_usecs();
+    if (!segments->close(output_path)) {
+      return EXIT_FAILURE;
+    }
+    std::cerr << "Segments: " << segments->freezes() << " frozen, " << segments->merges() << " merged, "
+              << segments->num_frozen() << " left\n";
+    std::cerr << "Serialized in " << (get_time_usecs() - serialize_start)/1000.0 << " milliseconds\n";
+    time_micro = (get_time_usecs() - start);
+    std::cerr << "Indexed+Serialized in " << time_micro/1000.0 << " milliseconds\n";
+  } else if (!dummy) {
+    auto serialize_start = get_time_usecs();
     if (sort_serialize) {
-      my_idx.serialize_pack(out_idx);
+      if (!my_idx.serialize_pack(output_path, std::max(std::thread::hardware_concurrency(), 1u))) {
+        return EXIT_FAILURE;
+      }
     } else {
+      std::ofstream out_idx(output_path, std::ios::binary);
       my_idx.serialize(out_idx);
     }
+    std::cerr << "Serialized in " << (get_time_usecs() - serialize_start)/1000.0 << " milliseconds\n";
     time_micro = (get_time_usecs() - start);
     std::cerr << "Indexed+Serialized in " << time_micro/1000.0 << " milliseconds\n";
   }
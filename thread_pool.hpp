@@ -0,0 +1,140 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <functional>
+
+#include "util.hpp"
+
+// A small work-stealing thread pool. Each worker owns a deque of tasks:
+// it takes work from the back of its own deque, and when that runs dry,
+// steals from the front of the others. A task is told which worker is
+// running it, so callers can keep per-worker state (heaps, buffers) in a
+// plain vector indexed by worker, with no locking.
+//
+// Tasks are dealt to the workers round-robin as they are submitted; since
+// idle workers steal, one heavy task only holds up its own worker, and
+// the tasks queued behind it are taken by the others
+class thread_pool {
+
+  public:
+    using task = std::function<void(size_t)>;
+
+    explicit thread_pool(const size_t threads) : m_queues(std::max(threads, size_t(1))),
+                                                 m_next_queue(0),
+                                                 m_pending(0),
+                                                 m_queued(0),
+                                                 m_stop(false) {
+      for (size_t i = 0; i < m_queues.size(); ++i) {
+        m_workers.emplace_back([this, i]() { work(i); });
+      }
+    }
+
+    ~thread_pool() {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+      }
+      m_work_available.notify_all();
+      for (auto& worker : m_workers) {
+        worker.join();
+      }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    size_t size() const {
+      return m_queues.size();
+    }
+
+    // Queues a task. It is counted as queued (and a worker woken) under
+    // m_mutex only once it is in a deque, so a worker going to sleep
+    // either sees it or is woken for it
+    void submit(task t) {
+      size_t queue = m_next_queue++ % m_queues.size();
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending += 1;
+      }
+      {
+        std::lock_guard<std::mutex> lock(m_queues[queue].m_mutex);
+        m_queues[queue].m_tasks.push_back(std::move(t));
+      }
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queued += 1;
+      m_work_available.notify_one();
+    }
+
+    // Blocks until every submitted task has finished
+    void wait() {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_all_done.wait(lock, [this]() { return m_pending == 0; });
+    }
+
+  private:
+    struct task_queue {
+      std::mutex m_mutex;
+      std::deque<task> m_tasks;
+    };
+
+    // Our own work first (newest first), then steal (oldest first)
+    bool take(const size_t worker, task& t) {
+      {
+        auto& own = m_queues[worker];
+        std::lock_guard<std::mutex> lock(own.m_mutex);
+        if (!own.m_tasks.empty()) {
+          t = std::move(own.m_tasks.back());
+          own.m_tasks.pop_back();
+          return true;
+        }
+      }
+      for (size_t i = 1; i < m_queues.size(); ++i) {
+        auto& victim = m_queues[(worker + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(victim.m_mutex);
+        if (!victim.m_tasks.empty()) {
+          t = std::move(victim.m_tasks.front());
+          victim.m_tasks.pop_front();
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void work(const size_t worker) {
+      task t;
+      while (true) {
+        if (take(worker, t)) {
+          {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queued -= 1;
+          }
+          t(worker);
+          std::lock_guard<std::mutex> lock(m_mutex);
+          if (--m_pending == 0) {
+            m_all_done.notify_all();
+          }
+          continue;
+        }
+        // Nothing to run or steal, so sleep until something is submitted
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_work_available.wait(lock, [this]() { return m_stop || m_queued > 0; });
+        if (m_stop && m_queued == 0) {
+          return;
+        }
+      }
+    }
+
+    std::vector<task_queue> m_queues;
+    std::vector<std::thread> m_workers;
+    std::atomic<size_t> m_next_queue;
+    std::mutex m_mutex;
+    std::condition_variable m_work_available;
+    std::condition_variable m_all_done;
+    size_t m_pending;  // submitted and not yet finished
+    size_t m_queued;   // in a deque and not yet taken
+    bool m_stop;
+};
@@ -13,13 +13,23 @@
 /// min element. Because it is a binary heap, the elements are not sorted;
 /// use `finalize()` member function to sort it before accessing it with
 /// `topk()`.
+///
+/// For small k (up to `SMALL_K`), the entries are instead kept in a sorted
+/// array: finding the slot is a branchless count over a few cache lines,
+/// which is cheaper than the heap's data-dependent branches.
 struct topk_queue {
 
     // Scores are floats, docids are u32's
     using entry_type = std::pair<float, uint32_t>;
 
-    /// Constructs a top-k priority queue with a threshold set to zero
-    explicit topk_queue(size_t k) : m_k(k), m_threshold(0.0f) { 
+    static const size_t SMALL_K = 16;
+
+    /// Constructs a top-k priority queue with a threshold set to zero, or
+    /// to the given initial threshold
+    explicit topk_queue(size_t k, float initial_threshold = 0.0f) : m_k(k),
+                                                                    m_small(k <= SMALL_K),
+                                                                    m_initial_threshold(initial_threshold),
+                                                                    m_threshold(initial_threshold) { 
         m_q.reserve(m_k + 1);
     }
     topk_queue(topk_queue const&) = default;
@@ -40,20 +50,52 @@ struct topk_queue {
         if (not would_enter(score)) {
             return false;
         }
+        if (m_small) {
+            insert_sorted(score, docid);
+            return true;
+        }
         m_q.emplace_back(score, docid);
         if (m_q.size() <= m_k) {
             std::push_heap(m_q.begin(), m_q.end(), min_heap_order);
             if (m_q.size() == m_k) {
-                m_threshold = m_q.front().first;
+                m_threshold = std::max(m_q.front().first, m_initial_threshold);
             }
         } else {
             std::pop_heap(m_q.begin(), m_q.end(), min_heap_order);
             m_q.pop_back();
-            m_threshold = m_q.front().first;
+            m_threshold = std::max(m_q.front().first, m_initial_threshold);
         }
         return true;
     }
 
+    /// Inserts a batch of entries. The scores are first filtered against the
+    /// threshold in one (vectorizable) pass, and only the survivors are
+    /// inserted one at a time. Returns the number inserted.
+    auto insert(const float* scores, const uint32_t* docids, size_t n) -> size_t
+    {
+        const size_t BATCH = 64;
+        uint8_t enters[BATCH];
+        size_t inserted = 0;
+        for (size_t start = 0; start < n; start += BATCH) {
+            size_t count = std::min(BATCH, n - start);
+            float threshold = m_threshold;
+            uint8_t any = 0;
+            for (size_t i = 0; i < count; ++i) {
+                enters[i] = scores[start + i] > threshold;
+                any |= enters[i];
+            }
+            if (!any) {
+                continue;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                if (enters[i]) {
+                    inserted += insert(scores[start + i], docids[start + i]);
+                }
+            }
+        }
+        return inserted;
+    }
+
     /// Checks if an entry with the given score would be inserted to the queue, according
     /// to the current threshold.
     bool would_enter(float score) const { return score > m_threshold; }
@@ -64,7 +106,9 @@ struct topk_queue {
     /// the heap order will not be preserved.
     void finalize()
     {
-        std::sort_heap(m_q.begin(), m_q.end(), min_heap_order);
+        if (!m_small) {
+            std::sort_heap(m_q.begin(), m_q.end(), min_heap_order);
+        }
         size_t size = std::lower_bound(
                           m_q.begin(),
                           m_q.end(),
@@ -86,12 +130,29 @@ struct topk_queue {
         return m_threshold;
     }
 
+    /// Returns the score of the k-th entry, or 0 if the queue isn't full yet.
+    [[nodiscard]] auto true_threshold() const noexcept -> float
+    {
+        if (m_q.size() < m_k) {
+            return 0.0f;
+        }
+        return m_small ? m_q.back().first : m_q.front().first;
+    }
+
+    /// Returns the threshold the queue started with. Only entries scoring
+    /// above it are kept, so if it was set too high (above the true k-th
+    /// score), fewer than k entries will come back.
+    [[nodiscard]] auto initial_threshold() const noexcept -> float
+    {
+        return m_initial_threshold;
+    }
 
     /// Empties the queue and resets the threshold to 0 (or the given value).
-    void clear() noexcept
+    void clear(float initial_threshold = 0.0f) noexcept
     {
         m_q.clear();
-        m_threshold = 0.0f;
+        m_initial_threshold = initial_threshold;
+        m_threshold = initial_threshold;
     }
 
     /// Will dump a TREC-like output to stdout
@@ -108,6 +169,32 @@ struct topk_queue {
     [[nodiscard]] auto size() const noexcept -> std::size_t { return m_q.size(); }
 
   private:
+    /// The small-k path: m_q is kept sorted by descending score. The new
+    /// entry goes after every entry scoring at least as much, so ties keep
+    /// their arrival order, and the lowest entry drops off once we're full.
+    void insert_sorted(float score, uint32_t docid)
+    {
+        if (m_k == 0) {
+            return;
+        }
+        size_t size = m_q.size();
+        size_t slot = 0;
+        for (size_t i = 0; i < size; ++i) {
+            slot += m_q[i].first >= score;
+        }
+        if (size < m_k) {
+            m_q.emplace_back();
+            size += 1;
+        }
+        for (size_t i = size - 1; i > slot; --i) {
+            m_q[i] = m_q[i - 1];
+        }
+        m_q[slot] = entry_type(score, docid);
+        if (size == m_k) {
+            m_threshold = std::max(m_q.back().first, m_initial_threshold);
+        }
+    }
+
     [[nodiscard]] constexpr static auto
     min_heap_order(entry_type const& lhs, entry_type const& rhs) noexcept -> bool
     {
@@ -115,6 +202,8 @@ struct topk_queue {
     }
 
     size_t m_k;
+    bool m_small;
+    float m_initial_threshold;
     float m_threshold;
     std::vector<entry_type> m_q;
 };
@@ -4,7 +4,28 @@
 #include "util.hpp"
 #include "compress.hpp"
 #include "variable_index_blocks.hpp"
+#include "block_layout.hpp"
+#include "index_format.hpp"
 #include "query.hpp"
+#include "document_lengths.hpp"
+#include "mapped_file.hpp"
+#include "dirty_pages.hpp"
+#include "thread_pool.hpp"
+
+// serialize_pack splits each of its passes into this many tasks per
+// thread, and copies the lists through buffers of this many blocks
+const size_t PACK_TASKS_PER_THREAD = 4;
+const size_t PACK_BUFFER_BLOCKS = (size_t(4) << 20) / BLOCK_SIZE;
+
+// Checkpoints track changes in pages of one block
+const size_t CHECKPOINT_PAGE_SHIFT = 6;
+static_assert(size_t(1) << CHECKPOINT_PAGE_SHIFT == BLOCK_SIZE, "checkpoint pages are blocks");
+
+// The size of a list once packed, in blocks, and where its tail goes
+struct packed_chain {
+  uint32_t m_blocks;
+  uint32_t m_tail;
+};
 
 // The structure of the whole index
 // Note: The difference between the regular and
@@ -16,174 +37,335 @@ class immediate_index {
   // Data structures
   private:
     size_t m_next_empty;
-    std::vector<uint32_t> m_term_offsets;
-    std::vector<index_block> m_data;
-    std::vector<size_t> m_slab_size;
+    mappable_array<uint32_t> m_term_offsets;
+    mappable_array<index_block> m_data;
+    document_lengths m_doc_lengths;
+    std::shared_ptr<mapped_file> m_file; // set if the index is mapped
+    dirty_pages m_dirty_table{CHECKPOINT_PAGE_SHIFT}; // what has changed since the last checkpoint
+    dirty_pages m_dirty_blocks{CHECKPOINT_PAGE_SHIFT};
+    size_t m_checkpoint_docs;   // the documents as of the last checkpoint
+    block_layout m_layout;      // how the chains grow
 
   // Functions
   public:
 
     // Default
-    immediate_index() : m_next_empty(0) {
-      set_slab_size();
-    }
+    immediate_index() : m_next_empty(0), m_checkpoint_docs(0) {}
     
-    // Initialize the index
-    immediate_index(size_t no_blocks, size_t no_hash_slots) {
+    // Initialize the index, with the slabs of its chains growing as the
+    // layout says
+    immediate_index(size_t no_blocks, size_t no_hash_slots, const block_layout& layout = block_layout()) {
       m_next_empty = 0;
       m_term_offsets.resize(no_hash_slots, END_CHAIN);
       m_data.resize(no_blocks);
-      set_slab_size();
-    }
-
-    // Controller for slab size method
-    void set_slab_size() {
-      //set_slab_size_expon();
-      set_slab_size_triangle();
-    }
-
-    // Slab sizes for expon
-    void set_slab_size_expon() {
-      const double expon_base = 1.1;
-      size_t cumulative_bytes = TT_BYTES;
-      m_slab_size.push_back(1);
-      // Set first size to one block
-      for(size_t i = 0; i < MAX_SLAB_IDX; ++i) {
-        // We're assuming n blocks minus the header bytes of payload
-        double next = (double(TT_PL_OFFSET) + (expon_base - 1) * cumulative_bytes) / BLOCK_SIZE;
-        size_t this_size = next + 0.9999;
-        cumulative_bytes += (this_size * BLOCK_SIZE) - TT_PL_OFFSET;
-        // We'll overflow in the t_ptr, stick with the last one
-        if (this_size*BLOCK_SIZE >= std::numeric_limits<uint16_t>::max()) {
-          this_size = m_slab_size[i];
-        }
-        //std::cerr << this_size << "\n";
-        m_slab_size.push_back(this_size);
-      }
-    } 
-
-    // Slab sizes for triangle
-    void set_slab_size_triangle() {
-      // Set first size to one block
-      size_t cumulative_bytes = TT_BYTES;
-      m_slab_size.push_back(1);
-      for(size_t i = 0; i < MAX_SLAB_IDX; ++i) {
-        // We're assuming n blocks minus the header bytes of payload
-        double next = (double(TT_PL_OFFSET) + std::sqrt(2.0f * TT_PL_OFFSET * cumulative_bytes)) / BLOCK_SIZE;
-        size_t this_size = next + 0.9999;
-        cumulative_bytes += (this_size * BLOCK_SIZE) - TT_PL_OFFSET;
-        // We'll overflow in the t_ptr, stick with the last one
-        if (this_size*BLOCK_SIZE >= std::numeric_limits<uint16_t>::max()) {
-          this_size = m_slab_size[i];
-        }
-        m_slab_size.push_back(this_size);
-      }
+      m_dirty_table.resize(no_hash_slots * sizeof(uint32_t));
+      m_dirty_blocks.resize(no_blocks * BLOCK_SIZE);
+      m_checkpoint_docs = 0;
+      m_layout = layout;
     }
 
     // Write to disk
     void serialize(std::ofstream& out) {
-      // (1) Write total of "in-use" blocks
-      out.write(reinterpret_cast<char *>(&m_next_empty), sizeof(size_t));
-      // (2) Write the hash table size
+      // (1) and (2) Write the format, the total of "in-use" blocks and
+      // the hash table size
       size_t ht_size = m_term_offsets.size();
-      out.write(reinterpret_cast<char *>(&ht_size), sizeof(size_t));
+      write_index_header(out, m_next_empty, ht_size);
       // (3) Write the table itself
       out.write(reinterpret_cast<char *>(&m_term_offsets[0]), sizeof(uint32_t) * ht_size);
       // (4) Write the data
       out.write(reinterpret_cast<char *>(&m_data[0]), m_next_empty * BLOCK_SIZE);
+      // (5) Write the document lengths and collection statistics
+      m_doc_lengths.serialize(out);
+      // (6) Write the layout
+      m_layout.serialize(out);
+      // (7) Checkpoints from here on follow on from this
+      m_dirty_table.clear();
+      m_dirty_blocks.clear();
+      m_checkpoint_docs = m_doc_lengths.num_docs();
     }
 
-    // Write to disk with contiguous blocks for each term
-    void serialize_pack(std::ofstream& out) {
-      // (1) Write total of "in-use" blocks
-      out.write(reinterpret_cast<char *>(&m_next_empty), sizeof(size_t));
-
-      // (2) Write the hash table size
-      size_t ht_size = m_term_offsets.size();
-      out.write(reinterpret_cast<char *>(&ht_size), sizeof(size_t));
-
-      // (3) Note the hash table start offset; we are going to have to re-write it
-      const size_t hash_table_beginning_offset = out.tellp();
-
-      // (4) Write the table itself; this is all done in vain but I am lazy
-      out.write(reinterpret_cast<char *>(&m_term_offsets[0]), sizeof(uint32_t) * ht_size);
-
-      // (5) For each hash table entry, follow the chains updating next pointers and
-      // writing blocks consecutively; once the end is reached, update the hash
-      // table pointer to reflect the new head block offset
-      uint32_t next_idx = 0;
-      for (size_t i = 0; i < m_term_offsets.size(); ++i) {
+    // Writes to disk with the blocks of each list in a contiguous range.
+    // This takes two passes, each split over a pool of threads by ranges
+    // of the hash table. The first walks every chain to measure it, and a
+    // prefix sum of the sizes then gives every list its place in the file.
+    // The second copies the lists into large buffers, patching the block
+    // pointers in the copies, and writes each buffer in place with pwrite.
+    // The table is written once, at the end, and the index isn't changed
+    bool serialize_pack(const std::string& filename, const size_t threads = 1) {
+      int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+        std::cerr << "Could not open " << filename << " for writing\n";
+        return false;
+      }
+      const size_t ht_size = m_term_offsets.size();
+      thread_pool pool(threads);
+      const size_t tasks = pool.size() * PACK_TASKS_PER_THREAD;
+
+      // (1) Measure every chain
+      std::vector<packed_chain> chains(ht_size, packed_chain{0, 0});
+      const size_t slots_per_task = ht_size / tasks + 1;
+      for (size_t begin = 0; begin < ht_size; begin += slots_per_task) {
+        const size_t end = std::min(begin + slots_per_task, ht_size);
+        pool.submit([&, begin, end](size_t) {
+          for (size_t i = begin; i < end; ++i) {
+            if (m_term_offsets[i] != END_CHAIN) {
+              chains[i] = measure_chain(m_term_offsets[i]);
+            }
+          }
+        });
+      }
+      pool.wait();
 
-        // (1) Check if there is something here
-        uint32_t head_block_idx = m_term_offsets[i];
-        if (head_block_idx == END_CHAIN) {
+      // (2) Place the lists in hash table order, and cut the table into
+      // runs of about the same number of blocks for copying
+      size_t total_blocks = 0;
+      for (const auto& chain : chains) {
+        total_blocks += chain.m_blocks;
+      }
+      const size_t blocks_per_run = total_blocks / tasks + 1;
+      std::vector<uint32_t> packed_offsets(ht_size, END_CHAIN);
+      std::vector<size_t> run_starts(1, 0);
+      size_t next_idx = 0;
+      for (size_t i = 0; i < ht_size; ++i) {
+        if (chains[i].m_blocks == 0) {
           continue;
         }
-        // (2) Update the hash table pointer 
-        m_term_offsets[i] = next_idx;
-
-        // (3) Get a handle on the tail block
-        auto tail_block = m_data[head_block_idx].head.tail_block();
-
-        // (4) Count how many blocks we are going to write
-        uint32_t total_blocks_in_chain = 0; 
-        uint32_t slab_index = 0;
-        uint32_t block_idx = head_block_idx;
-        while (block_idx != tail_block) {
-          auto& block = m_data[block_idx];
-          block_idx = block.head.next_block();
-          // We actually count physical blocks consumed
-          total_blocks_in_chain += slab_size(slab_index);
-          slab_index += 1;
-          slab_index = std::min(slab_index, MAX_SLAB_IDX);
-        }
-        
-        // (5) Update the head block tail pointer to reflect the new location
-        auto &head_block = m_data[head_block_idx];
-        head_block.head.set_tail_block(total_blocks_in_chain + next_idx);
-
-        // (6) We are now clear to walk and write all of the blocks
-        block_idx = head_block_idx;
-        slab_index = 0;
-        while (block_idx != tail_block) {
-          auto& block = m_data[block_idx];
-          uint32_t next_block = block.head.next_block();
-          // The next 'block' will begin at the end of this one
-          size_t slab_blocks = slab_size(slab_index);
-          next_idx += slab_blocks;
-          block.head.set_next_block(next_idx);
-          out.write(reinterpret_cast<char *>(&m_data[block_idx]), slab_blocks * BLOCK_SIZE);
-          block_idx = next_block;
-          slab_index+=1;
-          slab_index = std::min(slab_index, MAX_SLAB_IDX);
+        if (next_idx >= blocks_per_run * run_starts.size()) {
+          run_starts.push_back(i);
         }
-        // Finally, we will write the tail block
-        // Note that we need not do any updating on the tail blocks pointers 
-        size_t slab_blocks = slab_size(slab_index);
-        out.write(reinterpret_cast<char *>(&m_data[block_idx]), slab_blocks * BLOCK_SIZE);
-        next_idx += slab_blocks;
+        packed_offsets[i] = next_idx;
+        next_idx += chains[i].m_blocks;
       }
-
-      // (6) Now all that hard work is done, we need to go back and re-write the hash table
-      out.seekp(hash_table_beginning_offset);
-      out.write(reinterpret_cast<char *>(&m_term_offsets[0]), sizeof(uint32_t) * ht_size);
+      run_starts.push_back(ht_size);
+
+      // (3) Copy and write the runs
+      const size_t block_offset = INDEX_HEADER_BYTES + sizeof(uint32_t) * ht_size;
+      std::atomic<bool> failed(false);
+      for (size_t r = 0; r + 1 < run_starts.size(); ++r) {
+        pool.submit([&, r](size_t) {
+          if (!write_packed_run(fd, block_offset, chains, packed_offsets, run_starts[r], run_starts[r + 1])) {
+            failed = true;
+          }
+        });
+      }
+      pool.wait();
+
+      // (4) The header and table, then the document lengths and layout after
+      // the blocks
+      std::ostringstream header;
+      write_index_header(header, total_blocks, ht_size);
+      header.write(reinterpret_cast<const char *>(packed_offsets.data()), sizeof(uint32_t) * ht_size);
+      std::ostringstream lengths;
+      m_doc_lengths.serialize(lengths);
+      m_layout.serialize(lengths);
+      const std::string header_bytes = header.str();
+      const std::string lengths_bytes = lengths.str();
+      if (failed ||
+          !write_at(fd, header_bytes.data(), header_bytes.size(), 0) ||
+          !write_at(fd, lengths_bytes.data(), lengths_bytes.size(), block_offset + total_blocks * BLOCK_SIZE)) {
+        std::cerr << "Could not write " << filename << "\n";
+        close(fd);
+        return false;
+      }
+      return close(fd) == 0;
     }
 
-    // Load from disk into main memory
-    void load(std::ifstream& in) {
-      // (1) Read total of "in-use" blocks
-      in.read(reinterpret_cast<char *>(&m_next_empty), sizeof(size_t));
-      // (2) Read the hash table size and set it up
+    // Load from disk into main memory. False (with a message) if this
+    // build can't read its layout
+    bool load(std::ifstream& in) {
+      // (1) and (2) Check the format, then read the total of "in-use"
+      // blocks and the hash table size, and set the table up
       size_t ht_size = 0;
-      in.read(reinterpret_cast<char *>(&ht_size), sizeof(size_t));
+      if (!read_index_header(in, m_next_empty, ht_size)) {
+        return false;
+      }
       m_term_offsets.resize(ht_size);
       // (3) Read the table itself
       in.read(reinterpret_cast<char *>(&m_term_offsets[0]), sizeof(uint32_t) * ht_size);
       // (4) Resize the blocks and then read the data
       m_data.resize(m_next_empty);
       in.read(reinterpret_cast<char *>(&m_data[0]), m_next_empty * BLOCK_SIZE);
+      // (5) Read the document lengths and collection statistics
+      m_doc_lengths.load(in);
+      // (6) Read the layout, which must be one this build can read
+      if (!m_layout.load(in)) {
+        return false;
+      }
+      m_dirty_table.resize(sizeof(uint32_t) * ht_size);
+      m_dirty_blocks.resize(m_next_empty * BLOCK_SIZE);
+      m_checkpoint_docs = m_doc_lengths.num_docs();
+      return true;
+    }
+
+    // Maps a serialized index instead of reading it. The hash table and
+    // the blocks are used where they lie in the page cache, so this takes
+    // milliseconds whatever the size of the index, and processes serving
+    // the same file share its memory. A mapped index is read-only: it can
+    // be queried and serialized, but not inserted into
+    bool map(const std::string& filename) {
+      auto file = std::make_shared<mapped_file>();
+      if (!file->open(filename)) {
+        return false;
+      }
+      // (1) and (2) The format, the "in-use" blocks and the hash table size
+      const size_t header_bytes = INDEX_HEADER_BYTES;
+      size_t next_empty = 0;
+      size_t ht_size = 0;
+      if (file->size() < header_bytes || !parse_index_header(file->data(), next_empty, ht_size)) {
+        std::cerr << "Could not map " << filename << ": not an index\n";
+        return false;
+      }
+      // (3) and (4) The table and the blocks follow on; the blocks only
+      // need the alignment of their 32-bit fields, which they have
+      const size_t table_offset = header_bytes;
+      const size_t block_offset = table_offset + sizeof(uint32_t) * ht_size;
+      const size_t lengths_offset = block_offset + next_empty * BLOCK_SIZE;
+      if (ht_size == 0 || lengths_offset > file->size()) {
+        std::cerr << "Could not map " << filename << ": truncated\n";
+        return false;
+      }
+      m_next_empty = next_empty;
+      m_term_offsets.view(file->data() + table_offset, ht_size);
+      m_data.view(file->data() + block_offset, next_empty);
+      // Every lookup goes through the table, so have it read in now
+      file->advise(table_offset, sizeof(uint32_t) * ht_size, MADV_WILLNEED);
+      // (5) and (6) The document lengths and layout are small, and are
+      // read as usual
+      std::ifstream in(filename, std::ios::binary);
+      in.seekg(lengths_offset);
+      m_doc_lengths.load(in);
+      if (!m_layout.load(in)) {
+        return false;
+      }
+      m_checkpoint_docs = m_doc_lengths.num_docs();
+      m_file = file;
+      return true;
+    }
+
+    // Faults in the lists of the given (hot) terms of a mapped index, so
+    // the first queries to use them don't wait on the disk. Returns the
+    // number of blocks touched
+    size_t prefault(const std::vector<std::string>& terms) {
+      size_t touched = 0;
+      volatile uint8_t sink = 0;
+      for (const auto& term : terms) {
+        uint32_t head_idx = m_term_offsets[found_or_empty_offset(term)];
+        if (head_idx == END_CHAIN) {
+          continue;
+        }
+        uint32_t tail_idx = tail_block(head_idx);
+        uint32_t position = 0;
+        for (uint32_t block_idx = head_idx; block_idx != END_CHAIN; block_idx = next_block(block_idx, tail_idx)) {
+          for (size_t byte = 0; byte < block_bytes(position); byte += BLOCK_SIZE) {
+            sink = sink + *(m_data[block_idx].head.struct_ptr() + byte);
+            touched += 1;
+          }
+          position += 1;
+        }
+      }
+      return touched;
+    }
+
+    // True if the index is a view over a mapped file
+    bool mapped() const {
+      return m_file != nullptr;
+    }
+
+    // False (with a message) if the index is mapped, and so can't be
+    // changed: its blocks are the read-only pages of the file
+    bool writable() const {
+      if (mapped()) {
+        std::cerr << "__ERROR__: A mapped index can't be added to.\n";
+        return false;
+      }
+      return true;
+    }
+
+    // Writes what has changed since the last checkpoint, or the last full
+    // serialize: the pages of the hash table and of the blocks which have
+    // been written to, and the lengths of the new documents. The index is
+    // append-mostly, so these are the heads and tails of the lists which
+    // took postings, and the new blocks; replaying the checkpoints in order
+    // onto the last serialized index (see apply_checkpoint) rebuilds it.
+    // Returns the number of pages written
+    size_t checkpoint(std::ofstream& out) {
+      // (1) Total of "in-use" blocks and the hash table size
+      out.write(reinterpret_cast<char *>(&m_next_empty), sizeof(size_t));
+      size_t ht_size = m_term_offsets.size();
+      out.write(reinterpret_cast<char *>(&ht_size), sizeof(size_t));
+      // (2) The dirty pages of the table, then of the blocks in use
+      size_t pages = m_dirty_table.write(out, m_term_offsets.data(), sizeof(uint32_t) * ht_size);
+      pages += m_dirty_blocks.write(out, m_data.data(), m_next_empty * BLOCK_SIZE);
+      // (3) The new document lengths
+      m_doc_lengths.serialize_since(out, m_checkpoint_docs);
+      m_checkpoint_docs = m_doc_lengths.num_docs();
+      return pages;
+    }
+
+    // Replays a checkpoint onto an index loaded from the serialized index
+    // it follows (and any checkpoints before it). The whole checkpoint is
+    // checked before anything is changed, so one which was cut short
+    // leaves the index as it was. False if it doesn't fit or is cut short
+    bool apply_checkpoint(std::ifstream& in) {
+      if (!writable()) {
+        return false;
+      }
+      std::streampos start = in.tellg();
+      if (!read_checkpoint(in, false)) {
+        return false;
+      }
+      in.clear();
+      in.seekg(start);
+      read_checkpoint(in, true);
+      m_checkpoint_docs = m_doc_lengths.num_docs();
+      return true;
+    }
+
+    // Grows the blocks to hold at least no_blocks, so that an index which
+    // was read back in can take more postings
+    void reserve(const size_t no_blocks) {
+      if (no_blocks > m_data.size()) {
+        m_data.resize(no_blocks);
+        m_dirty_blocks.resize(no_blocks * BLOCK_SIZE);
+      }
+    }
+
+    // Notes a change to an entry of the hash table, or to bytes of the
+    // blocks (from the start of block_idx), for the next checkpoint
+    void touch_entry(const uint32_t entry) {
+      m_dirty_table.mark(size_t(entry) * sizeof(uint32_t), sizeof(uint32_t));
+    }
+
+    void touch_block(const uint32_t block_idx, const size_t offset = 0, const size_t bytes = BLOCK_SIZE) {
+      m_dirty_blocks.mark(size_t(block_idx) * BLOCK_SIZE + offset, bytes);
     }
     
+    // Reads a checkpoint (see apply_checkpoint), only changing the index
+    // if apply is set; otherwise just checks that it is whole
+    bool read_checkpoint(std::istream& in, const bool apply) {
+      size_t next_empty = 0;
+      size_t ht_size = 0;
+      in.read(reinterpret_cast<char *>(&next_empty), sizeof(size_t));
+      in.read(reinterpret_cast<char *>(&ht_size), sizeof(size_t));
+      if (!in || ht_size != m_term_offsets.size() || next_empty < m_next_empty) {
+        std::cerr << "__ERROR__: The checkpoint does not follow on from this index.\n";
+        return false;
+      }
+      if (apply) {
+        if (next_empty > m_data.size()) {
+          reserve(next_empty);
+        }
+        m_next_empty = next_empty;
+      }
+      if (!dirty_pages::read(in, apply ? m_term_offsets.data() : nullptr, sizeof(uint32_t) * ht_size) ||
+          !dirty_pages::read(in, apply ? m_data.data() : nullptr, next_empty * BLOCK_SIZE) ||
+          !m_doc_lengths.load_since(in, apply)) {
+        std::cerr << "__ERROR__: The checkpoint is truncated.\n";
+        return false;
+      }
+      return true;
+    }
+
     // Returns the next slot, or blows up if none are left
     size_t next_free_slot(uint32_t blocks_desired) {
       if (m_next_empty + blocks_desired >= m_data.size()) {
@@ -200,6 +382,17 @@ class immediate_index {
       return termid % m_term_offsets.size();
     }
 
+    // Returns every term in the index, in hash table order
+    std::vector<std::string> vocabulary() {
+      std::vector<std::string> terms;
+      for (size_t i = 0; i < m_term_offsets.size(); ++i) {
+        if (m_term_offsets[i] != END_CHAIN) {
+          terms.push_back(m_data[m_term_offsets[i]].head.get_term());
+        }
+      }
+      return terms;
+    }
+
     // Given an index, return the offset value
     uint32_t get_offset(uint32_t index) {
       return m_term_offsets[index];
@@ -235,6 +428,12 @@ class immediate_index {
       return decode_magic(m_data[block_idx].head.struct_ptr() + offset, offset);
     }
 
+    // Returns a single vbyte at a given position; positional blocks begin
+    // with a b-gap and a w-gap coded this way
+    uint32_t access_vbyte(uint32_t block_idx, size_t& offset) {
+      return vbyte_decode(m_data[block_idx].head.struct_ptr() + offset, offset);
+    }
+
     // Returns the identifier of the next block
     uint32_t next_block(uint32_t block_idx, const uint32_t tail_idx) const {
       if (block_idx == tail_idx) {
@@ -255,6 +454,28 @@ class immediate_index {
       return m_data[block_idx].head.doc_freq();
     }
 
+    // Returns the largest f_dt of the list given an index
+    // Assumes the index is a head block
+    uint32_t max_freq(uint32_t block_idx) const {
+      return m_data[block_idx].head.max_freq();
+    }
+
+    // Returns the largest f_dt within a single block of the list whose
+    // head is at head_idx; saturated blocks give the max f_dt of the list.
+    // Note that insert_positions does not maintain the block maxima
+    uint32_t block_max_freq(uint32_t block_idx, uint32_t head_idx) const {
+      uint32_t freq = MAX_BLOCK_FREQ;
+      if (block_idx == head_idx) {
+        freq = m_data[block_idx].head.block_max_freq();
+      } else {
+        freq = m_data[block_idx].torso.max_freq();
+      }
+      if (freq == MAX_BLOCK_FREQ) {
+        return m_data[head_idx].head.max_freq();
+      }
+      return freq;
+    }
+
     // Returns a head block data offset
     uint64_t head_data_offset(const uint32_t block_idx) {
       return m_data[block_idx].head.data_offset();
@@ -262,18 +483,73 @@ class immediate_index {
 
     // Tells us how many blocks make up a slab for a block
     uint64_t slab_size(const uint32_t block) const {
-      return m_slab_size[block];
+      return m_layout.slab_blocks(block);
+    }
+
+    // Returns the number of bytes spanned by the n-th block of a chain
+    uint64_t block_bytes(const uint32_t chain_position) const {
+      return BLOCK_SIZE * m_layout.slab_blocks(std::min(chain_position, MAX_SLAB_IDX));
+    }
+
+    // Records the length of a document once its postings are inserted.
+    // False (with a message) if the index is mapped, and so took none
+    bool add_document(const uint32_t docid, const uint32_t length) {
+      if (!writable()) {
+        return false;
+      }
+      m_doc_lengths.add(docid, length);
+      return true;
+    }
+
+    // The document lengths and collection statistics
+    const document_lengths& doc_lengths() const {
+      return m_doc_lengths;
+    }
+
+    // The number of documents in the index
+    size_t num_docs() const {
+      return m_doc_lengths.num_docs();
+    }
+
+    // How the chains of the index grow
+    const block_layout& layout() const {
+      return m_layout;
+    }
+
+    // The blocks in use, and those still free to take postings
+    size_t used_blocks() const {
+      return m_next_empty;
+    }
+
+    size_t free_blocks() const {
+      return m_data.size() - m_next_empty;
+    }
+
+    // A term is kept in its head block, ahead of the postings there, so
+    // it must leave the block room; longer terms are turned away by every
+    // insert, and skipped by bulk_load
+    static bool term_fits(const std::string& term) {
+      return term.size() < HEAD_BYTES;
     }
 
     // helper for inserting out of in-memory payload structure
-    void insert(const uint32_t docid, const term_position& payload) {
-      insert(docid, payload.m_term, payload.m_positions);
+    bool insert(const uint32_t docid, const term_position& payload) {
+      return insert(docid, payload.m_term, payload.m_positions);
     }
 
-    // Insert a posting, a <docid, f_dt> pair
-    void insert(const uint32_t docid, const std::string& term, const std::vector<uint32_t>& positions) {
+    // Insert a posting for a term with these positions; only their
+    // number, the f_dt, is kept
+    bool insert(const uint32_t docid, const std::string& term, const std::vector<uint32_t>& positions) {
+      return insert(docid, term, uint32_t(positions.size()));
+    }
 
-      uint32_t freq = positions.size();
+    // Insert a posting, a <docid, f_dt> pair. False, adding nothing, if
+    // the term is too long to keep (see term_fits), or if the index is
+    // mapped, which add_document reports, once for the document
+    bool insert(const uint32_t docid, const std::string& term, const uint32_t freq) {
+      if (mapped() || !term_fits(term)) {
+        return false;
+      }
 
       // Find the entry location in the hash table
       uint32_t entry_hash = found_or_empty_offset(term);
@@ -282,8 +558,9 @@ class immediate_index {
       // If the item is not found, we are working with a new empty head block
       if (head_block_index == END_CHAIN) {
         // Always start with first size
-        head_block_index = next_free_slot(m_slab_size[0]); 
+        head_block_index = next_free_slot(m_layout.slab_blocks(0)); 
         m_term_offsets[entry_hash] = head_block_index;
+        touch_entry(entry_hash);
         auto& current_block = m_data[head_block_index];
         current_block.head.init(term, head_block_index);
       } 
@@ -293,7 +570,9 @@ class immediate_index {
       auto& head_block = m_data[head_block_index];
       uint32_t doc_gap = docid - head_block.head.recent_docid();
       head_block.head.increment_doc_freq();
+      head_block.head.update_max_freq(freq);
       head_block.head.set_recent_docid(docid);
+      touch_block(head_block_index);
 
       // Now figure out where to write the new values: we need
       // the block, and the write offset to write new data
@@ -301,21 +580,29 @@ class immediate_index {
       uint16_t write_offset = head_block.head.tail_byte_offset();
 
       size_t bytes_required = magic_bytes_required(doc_gap, freq);
-      size_t slab_size = BLOCK_SIZE * m_slab_size[head_block.head.growth_offset()];
+      size_t slab_size = BLOCK_SIZE * m_layout.slab_blocks(head_block.head.growth_offset());
 
       // Can the new posting fit?
       if (write_offset + bytes_required <= slab_size) {
           auto& write_block = m_data[current_block_index];
           size_t bytes_written = encode_magic(doc_gap, freq, write_block.tail.struct_ptr() + write_offset);
+          touch_block(current_block_index, write_offset, bytes_written);
           head_block.head.advance_tail_byte_offset(bytes_written);
+          if (current_block_index == head_block_index) {
+            head_block.head.update_block_max_freq(freq);
+          } else {
+            write_block.tail.update_max_freq(freq);
+            touch_block(current_block_index);
+          }
       } else {
           // Grab the next free slot, set it up as a 'tail'
           uint32_t prev_block_index = current_block_index;
           head_block.head.increment_growth_offset();
-          current_block_index = next_free_slot(m_slab_size[head_block.head.growth_offset()]);
+          current_block_index = next_free_slot(m_layout.slab_blocks(head_block.head.growth_offset()));
           
           auto& write_block = m_data[current_block_index];
           write_block.tail.init(docid);
+          touch_block(current_block_index);
           
           // Get a handle on the 'previous' block
           auto& prev_block = m_data[prev_block_index];
@@ -329,6 +616,7 @@ class immediate_index {
           
           // Convert the previous block to a 'torso'
           prev_block.torso.set_next_block(current_block_index);
+          touch_block(prev_block_index);
 
           // Fix up the head pointers
           head_block.head.set_tail_block(current_block_index);
@@ -337,17 +625,23 @@ class immediate_index {
 
           // Write it, assume it will fit now
           size_t bytes_written = encode_magic(doc_gap, freq, write_block.tail.struct_ptr() + write_offset);
+          touch_block(current_block_index, write_offset, bytes_written);
           head_block.head.advance_tail_byte_offset(bytes_written); 
+          write_block.tail.update_max_freq(freq);
       }
+      return true;
     }
 
     // Insert a positional vector: a <docid, pos<1..n>> pair
-    void insert_positions(const uint32_t docid, const term_position& payload) {
-      insert_positions(docid, payload.m_term, payload.m_positions);
+    bool insert_positions(const uint32_t docid, const term_position& payload) {
+      return insert_positions(docid, payload.m_term, payload.m_positions);
     }
 
     // Insert a positional vector: a <docid, pos<1..n>> pair
-    void insert_positions(const uint32_t docid, const std::string& term, const std::vector<uint32_t>& positions) {
+    bool insert_positions(const uint32_t docid, const std::string& term, const std::vector<uint32_t>& positions) {
+      if (mapped() || !term_fits(term)) {
+        return false;
+      }
 
       // Find the entry location in the hash table
       uint32_t entry_hash = found_or_empty_offset(term);
@@ -355,8 +649,9 @@ class immediate_index {
 
       // If the item is not found, we are working with a new empty head block
       if (head_block_index == END_CHAIN) {
-        head_block_index = next_free_slot(m_slab_size[0]);
+        head_block_index = next_free_slot(m_layout.slab_blocks(0));
         m_term_offsets[entry_hash] = head_block_index;
+        touch_entry(entry_hash);
         auto& current_block = m_data[head_block_index];
         current_block.head.init(term, head_block_index);
       } 
@@ -366,10 +661,12 @@ class immediate_index {
       auto& head_block = m_data[head_block_index];
       uint32_t doc_gap = docid - head_block.head.recent_docid();
       head_block.head.increment_doc_freq();
+      head_block.head.update_max_freq(positions.size());
       // The -1 in next statement is to handle the possibility
       // that the next posting might be to the same doc, musn't
       // let d-gaps (or b-gaps either, nor w-gaps) ever be zero
       head_block.head.set_recent_docid(docid-1);
+      touch_block(head_block_index);
 
       uint32_t last_word_pos = 0;
       // Now we'll insert f_d,t positions consecutively
@@ -386,21 +683,23 @@ class immediate_index {
 
         // For positions, encode "backwards" (position first, since pos is smaller usually)
         size_t bytes_required = magic_bytes_required(word_gap, doc_gap);
-        size_t slab_size = BLOCK_SIZE * m_slab_size[head_block.head.growth_offset()];
+        size_t slab_size = BLOCK_SIZE * m_layout.slab_blocks(head_block.head.growth_offset());
 
         // Can the new posting fit?
         if (write_offset + bytes_required <= slab_size) {
             auto& write_block = m_data[current_block_index];
             size_t bytes_written = encode_magic(word_gap, doc_gap, write_block.tail.struct_ptr() + write_offset);
+            touch_block(current_block_index, write_offset, bytes_written);
             head_block.head.advance_tail_byte_offset(bytes_written);
         } else {
             // Grab the next free slot, set it up as a 'tail'
             uint32_t prev_block_index = current_block_index;
             head_block.head.increment_growth_offset();
-            current_block_index = next_free_slot(m_slab_size[head_block.head.growth_offset()]);
+            current_block_index = next_free_slot(m_layout.slab_blocks(head_block.head.growth_offset()));
             auto& write_block = m_data[current_block_index];
             // Retain the true first docid associated with this new block
             write_block.tail.init(docid);
+            touch_block(current_block_index);
             
             // Get a handle on the 'previous' block
             auto& prev_block = m_data[prev_block_index];           
@@ -417,6 +716,7 @@ class immediate_index {
               
             // Convert the previous block to a 'torso'
             prev_block.torso.set_next_block(current_block_index);
+            touch_block(prev_block_index);
 
             // Fix up the head pointers
             head_block.head.set_tail_block(current_block_index);
@@ -425,8 +725,11 @@ class immediate_index {
 
             // Write it, but as individually encoded variable byte calls. We'll put the b-gap first
             size_t bytes_written = vbyte_encode(doc_gap, write_block.tail.struct_ptr() + write_offset);
+            touch_block(current_block_index, write_offset, bytes_written);
             head_block.head.advance_tail_byte_offset(bytes_written);
+            write_offset += bytes_written;
             bytes_written = vbyte_encode(word_gap, write_block.tail.struct_ptr() + write_offset);
+            touch_block(current_block_index, write_offset, bytes_written);
             head_block.head.advance_tail_byte_offset(bytes_written); 
         }
         // If we go round the loop, the next doc_gap will be 1, this next
@@ -434,6 +737,65 @@ class immediate_index {
         // doc_gap = docid - head_block.head.recent_docid()
         doc_gap = 1;
       }
+      return true;
+    }
+
+    // The blocks a chain takes up once packed, and where its tail goes
+    packed_chain measure_chain(const uint32_t head_idx) const {
+      packed_chain chain{0, 0};
+      uint32_t tail_idx = tail_block(head_idx);
+      uint32_t position = 0;
+      for (uint32_t block_idx = head_idx; block_idx != END_CHAIN; block_idx = next_block(block_idx, tail_idx)) {
+        chain.m_tail = chain.m_blocks;
+        chain.m_blocks += block_bytes(position) / BLOCK_SIZE;
+        position += 1;
+      }
+      return chain;
+    }
+
+    // Copies the lists of the hash table slots [begin, end) to their packed
+    // places, which are contiguous, through a buffer
+    bool write_packed_run(const int fd, const size_t block_offset, const std::vector<packed_chain>& chains,
+                          const std::vector<uint32_t>& packed_offsets, const size_t begin, const size_t end) const {
+      std::vector<index_block> buffer;
+      buffer.reserve(PACK_BUFFER_BLOCKS);
+      size_t buffer_idx = 0; // where buffer[0] goes
+      auto flush = [&]() {
+        bool written = write_at(fd, buffer.data(), buffer.size() * BLOCK_SIZE, block_offset + buffer_idx * BLOCK_SIZE);
+        buffer_idx += buffer.size();
+        buffer.clear();
+        return written;
+      };
+
+      for (size_t i = begin; i < end; ++i) {
+        uint32_t head_idx = m_term_offsets[i];
+        if (head_idx == END_CHAIN) {
+          continue;
+        }
+        if (buffer.empty()) {
+          buffer_idx = packed_offsets[i];
+        }
+        uint32_t tail_idx = tail_block(head_idx);
+        uint32_t next_idx = packed_offsets[i];
+        uint32_t position = 0;
+        for (uint32_t block_idx = head_idx; block_idx != END_CHAIN; block_idx = next_block(block_idx, tail_idx)) {
+          size_t slab_blocks = block_bytes(position) / BLOCK_SIZE;
+          if (buffer.size() + slab_blocks > PACK_BUFFER_BLOCKS && !buffer.empty() && !flush()) {
+            return false;
+          }
+          size_t at = buffer.size();
+          buffer.insert(buffer.end(), &m_data[block_idx], &m_data[block_idx] + slab_blocks);
+          next_idx += slab_blocks;
+          if (block_idx != tail_idx) {
+            buffer[at].head.set_next_block(next_idx);
+          }
+          if (position == 0) {
+            buffer[at].head.set_tail_block(packed_offsets[i] + chains[i].m_tail);
+          }
+          position += 1;
+        }
+      }
+      return buffer.empty() || flush();
     }
 
     // Report on the index size
@@ -11,11 +11,15 @@
 
 // Constants representing the index, access locations, etc
 const size_t BLOCK_SIZE = 64;
-const size_t HEAD_PL_OFFSET = (4 * sizeof(uint32_t) + 2 * sizeof(uint8_t) + sizeof(uint16_t));
-const size_t TT_PL_OFFSET = sizeof(uint32_t);
+const size_t HEAD_PL_OFFSET = (5 * sizeof(uint32_t) + 3 * sizeof(uint8_t) + sizeof(uint16_t));
+const size_t TT_PL_OFFSET = sizeof(uint32_t) + sizeof(uint8_t);
 const size_t HEAD_BYTES = BLOCK_SIZE - HEAD_PL_OFFSET;
 const size_t TT_BYTES = BLOCK_SIZE - TT_PL_OFFSET;
 
+// Per-block maximum f_dt values are kept in a byte, and saturate here;
+// a saturated block falls back to the max f_dt of the whole list
+const uint32_t MAX_BLOCK_FREQ = std::numeric_limits<uint8_t>::max();
+
 // The number of slab sizes we store
 const uint32_t MAX_SLAB_IDX = 255;
 
@@ -26,9 +30,11 @@ struct head_block {
   uint32_t m_tail_block;       // index of tail block for this term
   uint32_t m_doc_freq;         // number of postings for this term
   uint32_t m_recent_docid;     // most recently seen docid for this term
+  uint32_t m_max_freq;         // largest f_dt seen for this term
   uint16_t m_tail_byte_offset; // next unused byte in the tail block
   uint8_t  m_growth_offset;    // an index into the array of block growth values
   uint8_t  m_word_length;      // number of characters in the term
+  uint8_t  m_block_max_freq;   // largest f_dt in this block (saturating)
   uint8_t  m_bytes[HEAD_BYTES]; 
                                // m_word_length chars representing the term 
                                // string, and then variable-byte postings after
@@ -41,6 +47,8 @@ struct head_block {
     this->set_term(term);
     m_tail_byte_offset = HEAD_PL_OFFSET + m_word_length;
     m_recent_docid = 0;
+    m_max_freq = 0;
+    m_block_max_freq = 0;
     m_growth_offset = 0;
   }
 
@@ -84,6 +92,25 @@ struct head_block {
     return m_growth_offset;
   }
 
+  // Returns the largest f_dt seen so far; used for score upper bounds
+  uint32_t max_freq() const {
+    return m_max_freq;
+  }
+
+  // Keeps the largest f_dt up to date as postings arrive
+  void update_max_freq(const uint32_t freq) {
+    m_max_freq = std::max(m_max_freq, freq);
+  }
+
+  // Largest f_dt stored in the head block itself
+  uint32_t block_max_freq() const {
+    return m_block_max_freq;
+  }
+
+  void update_block_max_freq(const uint32_t freq) {
+    m_block_max_freq = std::min(std::max(uint32_t(m_block_max_freq), freq), MAX_BLOCK_FREQ);
+  }
+
   // Returns the most recently seen docid during encoding
   uint32_t recent_docid() const {
     return m_recent_docid;
@@ -145,6 +172,7 @@ struct head_block {
 // The "middle" blocks of a chain
 struct torso_block {
   uint32_t m_next_block;      // index of the next block for this term
+  uint8_t  m_max_freq;        // largest f_dt in this block (saturating)
   uint8_t  m_bytes[TT_BYTES];
                               // variable-byte postings; first one is the b-gap
   
@@ -161,6 +189,11 @@ struct torso_block {
     m_next_block = next_block;
   }
 
+  // Largest f_dt stored in this block
+  uint32_t max_freq() const {
+    return m_max_freq;
+  }
+
   // Pointer to the memory address of the struct itself
   uint8_t* struct_ptr() {
     return reinterpret_cast<uint8_t *>(&m_next_block);
@@ -178,11 +211,13 @@ struct torso_block {
 // The last block of a chain
 struct tail_block {
   uint32_t m_first_docid; // The first docid in this block (uncompressed)
+  uint8_t  m_max_freq;    // largest f_dt in this block (saturating)
   uint8_t  m_bytes[TT_BYTES];
                               // variable-byte postings; first one is the b-gap
 
   void init(const uint32_t first_docid) {
     m_first_docid = first_docid;
+    m_max_freq = 0;
   }
 
   uint32_t first_docid() const {
@@ -193,6 +228,12 @@ struct tail_block {
     m_first_docid = first_docid;
   }
 
+  // Keeps the largest f_dt of the block up to date; the byte stays in
+  // place when the block becomes a torso
+  void update_max_freq(const uint32_t freq) {
+    m_max_freq = std::min(std::max(uint32_t(m_max_freq), freq), MAX_BLOCK_FREQ);
+  }
+
   // Pointer to the memory address of the struct itself
   uint8_t* struct_ptr() {
     return reinterpret_cast<uint8_t *>(&m_first_docid);
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "util.hpp"
+#include "compress.hpp"
+
+// The most bytes a vbyte coded 32-bit value takes
+const size_t MAX_VBYTE_BYTES = 5;
+
+// A document as the log holds it: its docid and length, and the f_dt of
+// each of its terms
+struct logged_document {
+  uint32_t m_docid;
+  uint32_t m_length;
+  std::vector<std::pair<std::string, uint32_t>> m_terms;
+};
+
+// A write-ahead log of the documents given to the index, so that what was
+// indexed since the last snapshot (see checkpoint) survives a crash.
+//
+// Documents are vbyte coded into a buffer as <docid, length, #terms>, then
+// <term length, term, f_dt> per term, and are committed in groups: every
+// group_docs documents, the buffer is written with a single write() as a
+// frame of <payload bytes, checksum, payload>, and every sync_groups
+// frames the log is fdatasync()ed. Documents are only safe once their
+// group has been synced, so the two trade ingest speed against how much
+// can be lost. A frame which was torn by a crash fails its checksum, and
+// replay stops there
+class write_ahead_log {
+
+  public:
+    write_ahead_log(const size_t group_docs, const size_t sync_groups) : m_fd(-1),
+                                                                       m_group_docs(std::max(group_docs, size_t(1))),
+                                                                       m_sync_groups(std::max(sync_groups, size_t(1))),
+                                                                       m_pending_docs(0),
+                                                                       m_unsynced_groups(0),
+                                                                       m_bytes(0) {}
+
+    ~write_ahead_log() {
+      close();
+    }
+
+    write_ahead_log(const write_ahead_log&) = delete;
+    write_ahead_log& operator=(const write_ahead_log&) = delete;
+
+    // Opens the log for appending, keeping its first keep_bytes (the
+    // intact frames, as found by replay) and dropping anything after
+    bool open(const std::string& filename, const size_t keep_bytes = 0) {
+      m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if (m_fd < 0 || ftruncate(m_fd, keep_bytes) != 0) {
+        std::cerr << "Could not open the log " << filename << "\n";
+        return false;
+      }
+      m_bytes = keep_bytes;
+      return true;
+    }
+
+    // Logs a document, given its terms and their positions
+    bool append(const uint32_t docid, const uint32_t length,
+                const std::unordered_map<std::string, std::vector<uint32_t>>& term_positions) {
+      // Make room for the largest encoding, then trim to what was used
+      size_t bound = 3 * MAX_VBYTE_BYTES;
+      for (const auto& element : term_positions) {
+        bound += element.first.size() + 2 * MAX_VBYTE_BYTES;
+      }
+      size_t used = m_buffer.size();
+      m_buffer.resize(used + bound);
+      uint8_t* out = m_buffer.data() + used;
+      out += vbyte_encode(docid, out);
+      out += vbyte_encode(length, out);
+      out += vbyte_encode(term_positions.size(), out);
+      for (const auto& element : term_positions) {
+        out += vbyte_encode(element.first.size(), out);
+        memcpy(out, element.first.data(), element.first.size());
+        out += element.first.size();
+        out += vbyte_encode(element.second.size(), out);
+      }
+      m_buffer.resize(out - m_buffer.data());
+      m_pending_docs += 1;
+      if (m_pending_docs == m_group_docs) {
+        return commit();
+      }
+      return true;
+    }
+
+    // Writes out the pending documents as a frame, syncing if it's time
+    bool commit() {
+      if (m_pending_docs > 0) {
+        uint64_t payload_bytes = m_buffer.size();
+        uint64_t checksum = hash_bytes(m_buffer.data(), m_buffer.size());
+        std::vector<uint8_t> frame(sizeof(uint64_t) * 2);
+        memcpy(frame.data(), &payload_bytes, sizeof(uint64_t));
+        memcpy(frame.data() + sizeof(uint64_t), &checksum, sizeof(uint64_t));
+        frame.insert(frame.end(), m_buffer.begin(), m_buffer.end());
+        if (!write_all(frame.data(), frame.size())) {
+          std::cerr << "__ERROR__: Could not write to the log.\n";
+          return false;
+        }
+        m_bytes += frame.size();
+        m_buffer.clear();
+        m_pending_docs = 0;
+        m_unsynced_groups += 1;
+      }
+      if (m_unsynced_groups >= m_sync_groups) {
+        return sync();
+      }
+      return true;
+    }
+
+    // Commits and syncs whatever is pending
+    bool sync() {
+      if (m_pending_docs > 0) {
+        m_unsynced_groups = m_sync_groups;
+        return commit();
+      }
+      if (m_unsynced_groups > 0 && fdatasync(m_fd) != 0) {
+        std::cerr << "__ERROR__: Could not sync the log.\n";
+        return false;
+      }
+      m_unsynced_groups = 0;
+      return true;
+    }
+
+    // Empties the log, once a snapshot holds everything in it
+    bool truncate() {
+      m_buffer.clear();
+      m_pending_docs = 0;
+      m_unsynced_groups = 0;
+      m_bytes = 0;
+      return ftruncate(m_fd, 0) == 0 && fdatasync(m_fd) == 0;
+    }
+
+    void close() {
+      if (m_fd >= 0) {
+        sync();
+        ::close(m_fd);
+        m_fd = -1;
+      }
+    }
+
+    // The bytes written to the log so far
+    size_t bytes() const {
+      return m_bytes;
+    }
+
+    // Calls apply(document) on each logged document, in order, up to the
+    // first torn or damaged frame. Returns the bytes of intact frames
+    template <typename Apply>
+    static size_t replay(const std::string& filename, Apply apply) {
+      std::ifstream in(filename, std::ios::binary);
+      std::vector<uint8_t> log((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+      size_t offset = 0;
+      while (offset + 2 * sizeof(uint64_t) <= log.size()) {
+        uint64_t payload_bytes = 0;
+        uint64_t checksum = 0;
+        memcpy(&payload_bytes, log.data() + offset, sizeof(uint64_t));
+        memcpy(&checksum, log.data() + offset + sizeof(uint64_t), sizeof(uint64_t));
+        uint8_t* payload = log.data() + offset + 2 * sizeof(uint64_t);
+        if (payload_bytes > log.size() - offset - 2 * sizeof(uint64_t) ||
+            hash_bytes(payload, payload_bytes) != checksum) {
+          break;
+        }
+        size_t read = 0;
+        while (read < payload_bytes) {
+          logged_document document;
+          document.m_docid = vbyte_decode(payload + read, read);
+          document.m_length = vbyte_decode(payload + read, read);
+          uint32_t num_terms = vbyte_decode(payload + read, read);
+          for (uint32_t i = 0; i < num_terms; ++i) {
+            uint32_t term_bytes = vbyte_decode(payload + read, read);
+            std::string term(reinterpret_cast<char *>(payload + read), term_bytes);
+            read += term_bytes;
+            uint32_t freq = vbyte_decode(payload + read, read);
+            document.m_terms.emplace_back(term, freq);
+          }
+          apply(document);
+        }
+        offset += 2 * sizeof(uint64_t) + payload_bytes;
+      }
+      return offset;
+    }
+
+  private:
+    bool write_all(const uint8_t* data, size_t bytes) {
+      while (bytes > 0) {
+        ssize_t written = ::write(m_fd, data, bytes);
+        if (written < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          return false;
+        }
+        data += written;
+        bytes -= written;
+      }
+      return true;
+    }
+
+    // FNV-1a taken a word at a time, which is plenty to spot a torn frame
+    // and keeps the checksum off the ingest profile
+    static uint64_t hash_bytes(const uint8_t* data, const size_t bytes) {
+      uint64_t hash = 14695981039346656037ULL;
+      size_t i = 0;
+      for (; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        hash = (hash ^ word) * 1099511628211ULL;
+      }
+      for (; i < bytes; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+      }
+      return hash;
+    }
+
+    int m_fd;
+    size_t m_group_docs;
+    size_t m_sync_groups;
+    size_t m_pending_docs;
+    size_t m_unsynced_groups;
+    size_t m_bytes;
+    std::vector<uint8_t> m_buffer;
+};